@@ -0,0 +1,61 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "util.h"
+
+/**
+	@file bench.h
+
+	@brief Helpers shared by the benchmark programs.
+
+	This file defines the timing and the latency statistics that the
+	benchmarks report:
+	- @c now_nsec reads the monotonic clock,
+	- @c sort_u64 sorts an array of samples, and
+	- @c percentile picks a percentile from the sorted samples.
+
+	@{
+ */
+
+/** @brief The current time of the monotonic clock, in nsec. */
+static inline uint64_t now_nsec()
+{
+	struct timespec t;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &t));
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+/** @brief Compare two @c uint64_t values, for @c qsort. */
+static inline int cmp_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x>y) - (x<y);
+}
+
+/** @brief Sort an array of @c n samples in ascending order. */
+static inline void sort_u64(uint64_t* v, size_t n)
+{
+	qsort(v, n, sizeof(uint64_t), cmp_u64);
+}
+
+/**
+	@brief Return a percentile of sorted samples.
+
+	@param v the samples, sorted by @c sort_u64
+	@param n the number of samples
+	@param p the percentile, as a fraction (e.g., 0.99; 1.0 is the maximum)
+	@returns the sample nearest to rank @c p*(n-1), or 0 if @c n is 0
+ */
+static inline uint64_t percentile(const uint64_t* v, size_t n, double p)
+{
+	if(n == 0) return 0;
+	return v[(size_t)(p*(n-1) + 0.5)];
+}
+
+/** @} */
+
+#endif
@@ -0,0 +1,368 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "util.h"
+#include "bench.h"
+#include "bios.h"
+#include "tinyos.h"
+#include "kernel_cc.h"
+
+
+/*
+ 	A microbenchmark suite for the synchronization primitives.
+
+ 	Each workload runs with a number of threads of a single process, for
+ 	each combination of the given core and thread counts:
+
+ 	- mutex:    every thread locks and unlocks a shared mutex, doing a
+ 	            little work inside. An operation is a Mutex_Lock/Mutex_Unlock
+ 	            pair.
+ 	- pingpong: threads are paired; in each pair, the two threads take turns
+ 	            through a mutex and two condition variables (Cond_Signal).
+ 	            An operation is a round trip.
+ 	- fanout:   one thread broadcasts (Cond_Broadcast) a new round to all the
+ 	            others, and waits until they have all seen it. An operation
+ 	            is a round.
+ 	- pipe:     threads are paired; in each pair, one thread passes a byte to
+ 	            the other through a pipe, and gets it back through another.
+ 	            An operation is a round trip.
+
+ 	All the workloads use the mutex algorithm given by -m (see Mutex_kind),
+ 	so that the algorithms can be compared run by run.
+
+ 	The results are printed as CSV: throughput in operations per second,
+ 	and the latency percentiles of single operations, in nsec.
+
+ 	To use the suite as a regression gate, save its output from a known
+ 	good build, and pass it with -b to a later run. The program then fails
+ 	(exit status 1) if any throughput dropped below a fraction (-r) of the
+ 	baseline.
+ */
+
+typedef enum { W_MUTEX, W_PINGPONG, W_FANOUT, W_PIPE, W_COUNT } workload_t;
+static const char* workload_name[W_COUNT] = { "mutex", "pingpong", "fanout", "pipe" };
+
+typedef struct {
+	workload_t w;          /* the workload */
+	int threads;           /* the number of threads */
+	int ops;               /* operations per measuring thread */
+	double elapsed;        /* (sec) */
+	double ops_per_sec;
+	uint64_t p50, p90, p99, max;   /* latency percentiles (nsec) */
+} bench_t;
+
+
+static inline void work(int n)
+{
+	for(volatile int i=0; i<n; i++);
+}
+
+
+/* A pair of threads, for pingpong and pipe */
+typedef struct {
+	Mutex mx;
+	CondVar cv[2];
+	int turn;
+	pipe_t fwd, back;
+} pair_t;
+
+/* The state of a run */
+static bench_t* B;
+static int next_id;
+static uint64_t* samples;      /* ops samples for each measuring thread */
+static int measuring;          /* the number of measuring threads */
+static Mutex mx;
+static pair_t* pairs;
+
+/* for fanout */
+static CondVar round_cv, ack_cv;
+static unsigned long round_no;
+static int acks;
+
+
+/* Record the latency of operation i, of measuring thread m */
+#define SAMPLE(m, i, t0)  (samples[(size_t)(m)*B->ops + (i)] = now_nsec() - (t0))
+
+
+static void run_mutex(int id)
+{
+	for(int i=0; i<B->ops; i++) {
+		uint64_t t0 = now_nsec();
+		Mutex_Lock(&mx);
+		work(20);
+		Mutex_Unlock(&mx);
+		SAMPLE(id, i, t0);
+	}
+}
+
+
+static void run_pingpong(int id)
+{
+	pair_t* P = & pairs[id/2];
+	int me = id % 2;
+
+	for(int i=0; i<B->ops; i++) {
+		uint64_t t0 = now_nsec();
+		Mutex_Lock(& P->mx);
+		if(me == 0) {
+			/* Serve, and wait for the return */
+			P->turn = 1;
+			Cond_Signal(& P->cv[1]);
+			while(P->turn != 0)
+				Cond_Wait(& P->mx, & P->cv[0], 0);
+		} else {
+			while(P->turn != 1)
+				Cond_Wait(& P->mx, & P->cv[1], 0);
+			P->turn = 0;
+			Cond_Signal(& P->cv[0]);
+		}
+		Mutex_Unlock(& P->mx);
+		if(me == 0) SAMPLE(id/2, i, t0);
+	}
+}
+
+
+static void run_fanout(int id)
+{
+	int n = B->threads - 1;     /* the number of waiters */
+
+	if(id == 0) {
+		for(int i=0; i<B->ops; i++) {
+			uint64_t t0 = now_nsec();
+			Mutex_Lock(&mx);
+			acks = 0;
+			round_no++;
+			Cond_Broadcast(&round_cv);
+			while(acks < n)
+				Cond_Wait(&mx, &ack_cv, 0);
+			Mutex_Unlock(&mx);
+			SAMPLE(0, i, t0);
+		}
+	} else {
+		for(unsigned long r=1; r<=B->ops; r++) {
+			Mutex_Lock(&mx);
+			while(round_no < r)
+				Cond_Wait(&mx, &round_cv, 0);
+			if(++acks == n)
+				Cond_Signal(&ack_cv);
+			Mutex_Unlock(&mx);
+		}
+	}
+}
+
+
+static void run_pipe(int id)
+{
+	pair_t* P = & pairs[id/2];
+	char c = 'x';
+
+	for(int i=0; i<B->ops; i++) {
+		if(id % 2 == 0) {
+			uint64_t t0 = now_nsec();
+			if(Write(P->fwd.write, &c, 1) != 1 || Read(P->back.read, &c, 1) != 1)
+				FATAL("bench_sync: pipe failed");
+			SAMPLE(id/2, i, t0);
+		} else {
+			if(Read(P->fwd.read, &c, 1) != 1 || Write(P->back.write, &c, 1) != 1)
+				FATAL("bench_sync: pipe failed");
+		}
+	}
+}
+
+
+/* Each thread picks its role by its order of arrival */
+static int bench_thread(int argl, void* args)
+{
+	int id = __atomic_fetch_add(&next_id, 1, __ATOMIC_SEQ_CST);
+	switch(B->w) {
+		case W_MUTEX: run_mutex(id); break;
+		case W_PINGPONG: run_pingpong(id); break;
+		case W_FANOUT: run_fanout(id); break;
+		case W_PIPE: run_pipe(id); break;
+		default: break;
+	}
+	return 0;
+}
+
+/* The threads are joined implicitly, when the main thread returns */
+static int bench_proc(int argl, void* args)
+{
+	for(int i=0; i<B->threads; i++)
+		CreateThread(bench_thread, 0, NULL);
+	return 0;
+}
+
+static int boot_bench(int argl, void* args)
+{
+	int npairs = B->threads / 2;
+
+	next_id = 0;
+	mx = MUTEX_INIT;
+	round_cv = ack_cv = COND_INIT;
+	round_no = 0;
+	acks = 0;
+
+	pairs = xmalloc(npairs * sizeof(pair_t));
+	for(int i=0; i<npairs; i++) {
+		pairs[i] = (pair_t){ .mx = MUTEX_INIT, .cv = { COND_INIT, COND_INIT }, .turn = 0 };
+		if(B->w == W_PIPE)
+			if(Pipe(& pairs[i].fwd) == -1 || Pipe(& pairs[i].back) == -1)
+				FATAL("bench_sync: cannot create pipes");
+	}
+
+	uint64_t t0 = now_nsec();
+	Exec(bench_proc, 0, NULL);
+	WaitChild(NOPROC, NULL);
+	B->elapsed = (now_nsec() - t0) / 1e9;
+
+	free(pairs);
+	return 0;
+}
+
+
+/* Run the benchmark and fill in the results */
+static void run(uint ncores, bench_t* bench)
+{
+	B = bench;
+	switch(B->w) {
+		case W_MUTEX: measuring = B->threads; break;
+		case W_FANOUT: measuring = 1; break;
+		default: measuring = B->threads / 2;
+	}
+	size_t nsamples = (size_t) measuring * B->ops;
+	samples = xmalloc(nsamples * sizeof(uint64_t));
+
+	boot(ncores, 0, boot_bench, 0, NULL);
+
+	sort_u64(samples, nsamples);
+	B->ops_per_sec = nsamples / B->elapsed;
+	B->p50 = percentile(samples, nsamples, 0.5);
+	B->p90 = percentile(samples, nsamples, 0.9);
+	B->p99 = percentile(samples, nsamples, 0.99);
+	B->max = percentile(samples, nsamples, 1.0);
+	free(samples);
+}
+
+
+/* Look up the throughput of a run in a baseline CSV file (0 if not found) */
+static double baseline_ops(const char* fname, const char* w, uint cores, int threads)
+{
+	FILE* f = fopen(fname, "r");
+	if(f == NULL) { perror(fname); exit(2); }
+
+	char line[256], name[32];
+	unsigned int c;
+	int t, ops;
+	double tput, found = 0.0;
+	while(fgets(line, sizeof(line), f))
+		if(sscanf(line, "%31[^,],%u,%d,%d,%lf", name, &c, &t, &ops, &tput) == 5
+			&& strcmp(name, w)==0 && c==cores && t==threads)
+			found = tput;
+	fclose(f);
+	return found;
+}
+
+
+/* Parse a comma-separated list of positive integers */
+static int parse_list(const char* s, int* list, int max)
+{
+	int n = 0;
+	while(*s && n < max) {
+		char* end;
+		list[n] = strtol(s, &end, 10);
+		if(end == s || list[n] < 1) return 0;
+		n++;
+		s = (*end == ',') ? end+1 : end;
+		if(*end != ',' && *end != 0) return 0;
+	}
+	return n;
+}
+
+
+void usage(const char* pname)
+{
+	printf("usage:\n  %s [-c <cores>] [-t <threads>] [-n <ops>] [-w <workload>] [-m <mutex>] [-b <baseline.csv> [-r <ratio>]]\n\n\
+    where:\n\
+    <cores> is a comma-separated list of core counts (default 1,2,4),\n\
+    <threads> is a comma-separated list of thread counts (default 2,4,8),\n\
+    <ops> is the number of operations per measuring thread (default 10000),\n\
+    <workload> is one of mutex, pingpong, fanout, pipe (default: all of them),\n\
+    <mutex> is the mutex algorithm, one of ttas, ticket, mcs (default %s),\n\
+    <baseline.csv> is the output of an earlier run, to compare against,\n\
+    <ratio> is the lowest acceptable fraction of the baseline throughput (default 0.8).\n\n\
+    The pingpong and pipe workloads use pairs of threads, so odd thread counts are rounded down.\n",
+		pname, mutex_kind_name[mutex_kind]);
+	exit(2);
+}
+
+
+int main(int argc, char** argv)
+{
+	int cores[MAX_CORES] = { 1, 2, 4 }, ncores = 3;
+	int threads[64] = { 2, 4, 8 }, nthreads = 3;
+	int ops = 10000;
+	int wfirst = 0, wlast = W_COUNT-1;
+	const char* baseline = NULL;
+	double ratio = 0.8;
+	int opt, k;
+
+	while((opt = getopt(argc, argv, "c:t:n:w:m:b:r:")) != -1) {
+		switch(opt) {
+			case 'c': if(!(ncores = parse_list(optarg, cores, MAX_CORES))) usage(argv[0]); break;
+			case 't': if(!(nthreads = parse_list(optarg, threads, 64))) usage(argv[0]); break;
+			case 'n': ops = atoi(optarg); break;
+			case 'w':
+				for(wfirst=0; wfirst<W_COUNT; wfirst++)
+					if(strcmp(optarg, workload_name[wfirst])==0) break;
+				if(wfirst==W_COUNT) usage(argv[0]);
+				wlast = wfirst;
+				break;
+			case 'm':
+				for(k=MUTEX_TTAS; k<=MUTEX_MCS; k++)
+					if(strcmp(optarg, mutex_kind_name[k])==0) break;
+				if(k>MUTEX_MCS) usage(argv[0]);
+				CHECK(setenv("TINYOS_MUTEX", optarg, 1));
+				break;
+			case 'b': baseline = optarg; break;
+			case 'r': ratio = atof(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if(optind != argc || ops < 1 || ratio <= 0.0)
+		usage(argv[0]);
+	for(int i=0; i<ncores; i++)
+		if(cores[i] > MAX_CORES) usage(argv[0]);
+
+	int regressions = 0;
+	printf("workload,cores,threads,ops,ops_per_sec,p50_ns,p90_ns,p99_ns,max_ns\n");
+	for(int w=wfirst; w<=wlast; w++)
+		for(int c=0; c<ncores; c++)
+			for(int t=0; t<nthreads; t++) {
+				int nthr = threads[t];
+				if(w == W_PINGPONG || w == W_PIPE) nthr &= ~1;
+				if(nthr < 2 && w != W_MUTEX) continue;
+
+				bench_t bench = { .w = w, .threads = nthr, .ops = ops };
+				run(cores[c], &bench);
+				printf("%s,%d,%d,%d,%.0f,%lu,%lu,%lu,%lu\n", workload_name[w], cores[c], nthr, ops,
+					bench.ops_per_sec, (unsigned long) bench.p50, (unsigned long) bench.p90,
+					(unsigned long) bench.p99, (unsigned long) bench.max);
+				fflush(stdout);
+
+				if(baseline) {
+					double base = baseline_ops(baseline, workload_name[w], cores[c], nthr);
+					if(base > 0.0 && bench.ops_per_sec < ratio * base) {
+						fprintf(stderr, "bench_sync: regression in %s (cores=%d, threads=%d): %.0f < %.2f * %.0f ops/sec\n",
+							workload_name[w], cores[c], nthr, bench.ops_per_sec, ratio, base);
+						regressions++;
+					}
+				}
+			}
+
+	return regressions ? 1 : 0;
+}
@@ -12,6 +12,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sched.h>
+#include <string.h>
 
 #include "util.h"
 #include "bios.h"
@@ -26,6 +28,10 @@
 	- Core threads mask all signals except for USR1.
 	- The PIC thread receives all signals and dispatches them to
 	the right core thread by raising SIGUSR1.
+	- Core interrupts are masked in software: disabling interrupts only
+	sets a per-core flag, and SIGUSR1 stays unblocked. If the signal
+	arrives while the flag is set, the handler leaves the interrupt
+	pending, and it is replayed when interrupts are re-enabled.
 
  */
 
@@ -50,8 +56,14 @@ typedef struct core
 	rlnode halted_node;
 	pthread_cond_t halt_cond;
 
+	/* Host topology (see vm_boot) */
+	int hostcpu;
+	uint sibling_group;
+	uint cache_group;
+
 	/* Statistics */
 	int irq_count;
+	int irq_deferred;
 	int irq_raised[maximum_interrupt_no];
 	int irq_delivered[maximum_interrupt_no];
 } Core;
@@ -112,6 +124,9 @@ static volatile coarse_clock_t  system_clock;
 
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
 
+/* Host cpu of the PIC thread, or -1 if not pinned */
+static int PIC_hostcpu;
+
 
 /* PIC daemon statistics */
 static unsigned long PIC_loops, PIC_usr1_drained, PIC_usr1_queued;
@@ -257,8 +272,10 @@ static void dispatch_interrupts(Core* core)
 	for(int intno = 0; intno < maximum_interrupt_no; intno++) {
 		if(core->int_disabled) break; /* will continue at
 										 cpu_interrupt_enable()*/
-		if(core->intpending[intno]) {
-			core->intpending[intno] = 0;
+		/* A nested SIGUSR1 may dispatch the same interrupt, so claim it
+		   atomically, to deliver it only once. */
+		if(core->intpending[intno] &&
+			__atomic_exchange_n(& core->intpending[intno], 0, __ATOMIC_RELAXED)) {
 			core->irq_delivered[intno]++;
 			interrupt_handler* handler =  core->intvec[intno];
 			if(handler != NULL) { 
@@ -269,6 +286,28 @@ static void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	Soft interrupt masking. The flag is only read by the SIGUSR1 handler,
+	which runs on the same thread, so a signal fence is enough to order
+	it with the surrounding code.
+ */
+static inline void core_mask_interrupts(Core* core)
+{
+	core->int_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Clear the flag and replay the interrupts that were deferred. An interrupt
+   that arrives after the flag is cleared is dispatched by the handler. */
+static inline void core_unmask_interrupts(Core* core)
+{
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	core->int_disabled = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	dispatch_interrupts(core);
+}
+
+
 /*
 	This is the handler run by core threads to handle interrupts.
  */
@@ -277,7 +316,11 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	Core* core = & CORE[si->si_value.sival_int];
 
 	core->irq_count++;
-	if(core->int_disabled) return;
+	if(core->int_disabled) {
+		/* Deferred, until cpu_enable_interrupts() */
+		core->irq_deferred++;
+		return;
+	}
 	dispatch_interrupts(core);
 }
 
@@ -631,6 +674,130 @@ static void PIC_daemon(uint serialno)
 
 
 
+/*
+ 	Host topology and pinning.
+
+ 	When pinning is enabled (see vm_boot), each core thread is pinned to a
+ 	host cpu, taken in order from the set of cpus this process may run on.
+ 	If there are more host cpus than cores, the PIC thread is pinned to
+ 	the next free cpu, else it shares the last cpu.
+
+ 	For pinned cores, the host topology is read from sysfs, and every core
+ 	is assigned a sibling group (cores on the same physical host core,
+ 	i.e., SMT siblings) and a cache group (cores sharing the last-level
+ 	cache). The id of a group is the smallest core id in it. Unpinned cores
+ 	are each in their own groups.
+ */
+
+#define SYSFS_CPU "/sys/devices/system/cpu/cpu%d/"
+
+/* Parse a sysfs cpu list (e.g. "0-3,8-11") into a cpu set. Return 0 on success. */
+static int read_cpu_list(const char* path, cpu_set_t* set)
+{
+	FILE* f = fopen(path, "r");
+	if(f==NULL) return -1;
+
+	CPU_ZERO(set);
+	int lo, hi, rc = 0;
+	char sep;
+	while(fscanf(f, "%d", &lo)==1) {
+		hi = lo;
+		sep = fgetc(f);
+		if(sep=='-') {
+			if(fscanf(f, "%d", &hi)!=1) { rc = -1; break; }
+			sep = fgetc(f);
+		}
+		for(int c=lo; c<=hi && c<CPU_SETSIZE; c++)
+			CPU_SET(c, set);
+		if(sep!=',') break;
+	}
+	fclose(f);
+	return rc;
+}
+
+/* The set of SMT siblings of a host cpu (at least the cpu itself) */
+static void host_siblings(int cpu, cpu_set_t* set)
+{
+	char path[128];
+	snprintf(path, sizeof(path), SYSFS_CPU "topology/thread_siblings_list", cpu);
+	if(read_cpu_list(path, set)!=0) {
+		CPU_ZERO(set);
+		CPU_SET(cpu, set);
+	}
+}
+
+/* The set of cpus sharing the last-level cache with a host cpu */
+static void host_llc(int cpu, cpu_set_t* set)
+{
+	char path[128];
+	int best_level = -1;
+
+	CPU_ZERO(set);
+	CPU_SET(cpu, set);
+	for(int idx=0; ; idx++) {
+		snprintf(path, sizeof(path), SYSFS_CPU "cache/index%d/level", cpu, idx);
+		FILE* f = fopen(path, "r");
+		if(f==NULL) break;
+		int level;
+		int ok = (fscanf(f, "%d", &level)==1);
+		fclose(f);
+		if(!ok || level<=best_level) continue;
+
+		cpu_set_t shared;
+		snprintf(path, sizeof(path), SYSFS_CPU "cache/index%d/shared_cpu_list", cpu, idx);
+		if(read_cpu_list(path, &shared)==0) {
+			*set = shared;
+			best_level = level;
+		}
+	}
+}
+
+/* Assign host cpus to the cores and the PIC thread, and compute the groups */
+static void setup_topology(uint cores, int pin)
+{
+	PIC_hostcpu = -1;
+	for(uint c=0; c<cores; c++) {
+		CORE[c].hostcpu = -1;
+		CORE[c].sibling_group = CORE[c].cache_group = c;
+	}
+	if(!pin) return;
+
+	cpu_set_t avail;
+	CHECKRC(pthread_getaffinity_np(pthread_self(), sizeof(avail), &avail));
+	int navail = CPU_COUNT(&avail);
+	int hostcpu[navail];
+	for(int cpu=0, n=0; n<navail; cpu++)
+		if(CPU_ISSET(cpu, &avail)) hostcpu[n++] = cpu;
+
+	for(uint c=0; c<cores; c++)
+		CORE[c].hostcpu = hostcpu[c % navail];
+	PIC_hostcpu = hostcpu[(cores < navail) ? cores : navail-1];
+
+	for(uint c=0; c<cores; c++) {
+		cpu_set_t sib, llc;
+		host_siblings(CORE[c].hostcpu, &sib);
+		host_llc(CORE[c].hostcpu, &llc);
+		for(uint d=0; d<c; d++) {
+			if(CPU_ISSET(CORE[d].hostcpu, &sib) && CORE[c].sibling_group==c)
+				CORE[c].sibling_group = d;
+			if(CPU_ISSET(CORE[d].hostcpu, &llc) && CORE[c].cache_group==c)
+				CORE[c].cache_group = d;
+		}
+	}
+}
+
+/* Pin a thread to a host cpu */
+static void pin_thread(pthread_t thread, int cpu)
+{
+	if(cpu<0) return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	CHECKRC(pthread_setaffinity_np(thread, sizeof(set), &set));
+}
+
+
+
 /*****************************************
 	Public API
  *****************************************/
@@ -666,6 +833,10 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	/* Initialize the halted list */
 	rlnode_init(&halted_list, NULL);
 
+	/* Host cpu assignment */
+	const char* pinopt = getenv("TINYOS_PIN_CORES");
+	setup_topology(cores, pinopt!=NULL && strcmp(pinopt, "0")!=0);
+
 	/* Launch the core threads */
 	ncores = cores;
 	for(uint c=0; c < cores; c++) {
@@ -679,6 +850,7 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 
 		/* Initialize Core statistics */
 		CORE[c].irq_count = 0;
+		CORE[c].irq_deferred = 0;
 		for(uint intno=0; intno<maximum_interrupt_no;intno++) {
 			CORE[c].irq_delivered[intno] = 0;
 			CORE[c].irq_raised[intno] = 0;
@@ -689,8 +861,14 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		char thread_name[16];
 		CHECK(snprintf(thread_name,16,"core-%d",c));
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
+		pin_thread(CORE[c].thread, CORE[c].hostcpu);
 	}
 
+	/* Pin the PIC thread (this thread), saving its affinity */
+	cpu_set_t saved_affinity;
+	CHECKRC(pthread_getaffinity_np(PIC_thread, sizeof(saved_affinity), &saved_affinity));
+	pin_thread(PIC_thread, PIC_hostcpu);
+
 	/* Initialize PIC statistics */
 	PIC_loops = 0; PIC_usr1_queued = PIC_usr1_drained = 0;
 
@@ -706,6 +884,9 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	pthread_barrier_destroy(& system_barrier);
 	pthread_barrier_destroy(& core_barrier);
 
+	/* Restore the affinity of this thread */
+	CHECKRC(pthread_setaffinity_np(PIC_thread, sizeof(saved_affinity), &saved_affinity));
+
 	/* Restore signal mask before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
 
@@ -717,8 +898,8 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	fprintf(stderr,"PIC loops: %lu  queued/drained= %lu / %lu\n", 
 		PIC_loops, PIC_usr1_queued, PIC_usr1_drained);
 	for(uint c=0;c<cores;c++) {
-		fprintf(stderr,"Core %3d: irq_count=%6d. deliv(raised):\t",
-			c, CORE[c].irq_count);
+		fprintf(stderr,"Core %3d: irq_count=%6d deferred=%6d. deliv(raised):\t",
+			c, CORE[c].irq_count, CORE[c].irq_deferred);
 		for(uint i=0;i<maximum_interrupt_no;i++) 
 			fprintf(stderr," %d(%d)",CORE[c].irq_delivered[i], CORE[c].irq_raised[i]);
 		fprintf(stderr,"\n");
@@ -732,12 +913,32 @@ uint cpu_cores()
 	return ncores;
 }
 
+int cpu_core_hostcpu(uint c)
+{
+	assert(c < ncores);
+	return CORE[c].hostcpu;
+}
+
+uint cpu_core_sibling_group(uint c)
+{
+	assert(c < ncores);
+	return CORE[c].sibling_group;
+}
+
+uint cpu_core_cache_group(uint c)
+{
+	assert(c < ncores);
+	return CORE[c].cache_group;
+}
+
 void cpu_core_halt()
 {
-	/* unmask signals and call sigsuspend */
+	/* Interrupts are masked while waiting, since the handler must not run
+	   while the halt mutex is held. The ones that arrive in the meantime
+	   are replayed on wakeup. */
 	Core* core = curr_core();
 	assert(! core->int_disabled);
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	core_mask_interrupts(core);
 	pthread_mutex_lock(& core_halt_mutex);
 	core->halted = 1;
 	rlist_push_front(&halted_list, & core->halted_node);
@@ -745,8 +946,7 @@ void cpu_core_halt()
 		pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
 	assert(! core->halted);
 	pthread_mutex_unlock(& core_halt_mutex);
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
-	dispatch_interrupts(core);
+	core_unmask_interrupts(core);
 }
 
 static inline void core_restart(Core* core)
@@ -774,6 +974,24 @@ void cpu_core_restart_one()
 	pthread_mutex_unlock(& core_halt_mutex);	
 }
 
+void cpu_core_restart_near(uint c)
+{
+	pthread_mutex_lock(& core_halt_mutex);
+	Core* best = NULL;
+	int best_rank = 3;
+	for(rlnode* p = halted_list.next; p != &halted_list; p = p->next) {
+		Core* core = p->obj;
+		int rank = (core->sibling_group==CORE[c].sibling_group) ? 0 
+			: (core->cache_group==CORE[c].cache_group) ? 1 : 2;
+		if(rank < best_rank) {
+			best = core; best_rank = rank;
+			if(rank==0) break;
+		}
+	}
+	if(best) core_restart(best);
+	pthread_mutex_unlock(& core_halt_mutex);	
+}
+
 void cpu_core_restart_all()
 {
 	pthread_mutex_lock(& core_halt_mutex);
@@ -802,20 +1020,15 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 void cpu_disable_interrupts()
 {
 	Core* core = curr_core();
-	if(! core->int_disabled) {
-		CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
-		core->int_disabled = 1;
-	}
+	if(! core->int_disabled)
+		core_mask_interrupts(core);
 }
 
 void cpu_enable_interrupts()
 {
 	Core* core = curr_core();
-    if(core->int_disabled) {        
-        core->int_disabled = 0;
-        CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));      
-        dispatch_interrupts(curr_core());
-    }
+	if(core->int_disabled)
+		core_unmask_interrupts(core);
 }
 
 
@@ -154,6 +154,13 @@ typedef enum Interrupt
 		pipes (aka FIFOs), which must already exist. See the serial API below 
 		for more details.
 
+	If the environment variable @c TINYOS_PIN_CORES is set (to anything but "0"),
+	each core thread is pinned to its own host cpu (cores wrap around if there
+	are more cores than host cpus), and the interrupt controller thread is pinned
+	to the next free host cpu, if any. The host topology is then read from sysfs
+	and exposed to the VM, see @c cpu_core_sibling_group and 
+	@c cpu_core_cache_group.
+
  */
 void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno);
 
@@ -169,6 +176,31 @@ extern _Thread_local uint cpu_core_id;
 uint cpu_cores();
 
 
+/**
+	@brief Return the host cpu a core is pinned to, or -1 if it is not pinned.
+ */
+int cpu_core_hostcpu(uint core);
+
+/**
+	@brief Return the sibling group of a core.
+
+	Cores in the same sibling group run on the same physical host core
+	(as SMT siblings, or on the very same host cpu). The id of a group
+	is the smallest core id in it. If pinning is disabled, every core
+	is in a group of its own.
+ */
+uint cpu_core_sibling_group(uint core);
+
+/**
+	@brief Return the cache group of a core.
+
+	Cores in the same cache group share the host's last-level cache.
+	The id of a group is the smallest core id in it. If pinning is 
+	disabled, every core is in a group of its own.
+ */
+uint cpu_core_cache_group(uint core);
+
+
 /**
 	@brief Barrier synchronization for all cores.
 
@@ -210,6 +242,9 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler);
 	If an interrupt arrives while interrupts are disabled, it will be
 	marked as _pending_ and will be raised when interrupts are re-enabled.
 
+	Masking is done in software: this call only sets a flag of the core,
+	and does not make a system call.
+
 	@see cpu_enable_interrupts
  */
 void cpu_disable_interrupts();
@@ -253,6 +288,19 @@ void cpu_core_restart(uint c);
 */
 void cpu_core_restart_one();
 
+/**
+	@brief Restart some halted core, preferring cores close to the given core.
+
+	This call will restart a halted core, if at least one exists. Cores in
+	the same sibling group as @c core are preferred, then cores in the same
+	cache group.
+
+	@param core the core whose neighbourhood is preferred
+	@see cpu_core_sibling_group
+	@see cpu_core_cache_group
+*/
+void cpu_core_restart_near(uint core);
+
 /**
 	@brief Signal all halted cores to restart.
 
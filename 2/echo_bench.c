@@ -0,0 +1,220 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "bench.h"
+#include "bios.h"
+#include "tinyos.h"
+#include "symposium.h"
+
+
+/*
+ 	A benchmark of interactive (terminal echo) latency under CPU load.
+
+ 	The program forks. The child is a host-side harness that plays the
+ 	role of the 'terminal' program: it opens the FIFOs of terminal 0
+ 	(kbd0 and con0), and types keystrokes one at a time, timestamping
+ 	each keystroke and the arrival of its echo.
+
+ 	The parent boots TinyOS with one terminal. Inside TinyOS, an echo
+ 	process reads keystrokes from the terminal (serial_read) and writes
+ 	them back (serial_write), while a number of CPU-bound processes keep
+ 	computing Fibonacci numbers.
+
+ 	At the end, the harness reports the distribution of the echo latency,
+ 	which shows how well the scheduler serves I/O-bound threads (e.g.,
+ 	the I/O boost of yield()) in the presence of CPU hogs.
+
+ 	The FIFOs must exist in the current directory (see 'make fifos').
+ */
+
+
+/* The keystroke that ends the benchmark */
+#define QUIT_KEY '\004'
+
+
+typedef struct {
+	int nfibo;             /* number of CPU-bound processes */
+	int fibo_n;            /* the argument of each fibo() call */
+	int keys;              /* number of keystrokes */
+	int interval;          /* time between keystrokes (usec) */
+} bench_t;
+
+
+
+/****************************************************
+	The TinyOS side
+ ****************************************************/
+
+/* Set by the echo process, to stop the CPU hogs */
+static volatile int stop_hogs;
+
+static int fibo_hog(int argl, void* args)
+{
+	int n = *(int*) args;
+	while(! stop_hogs)
+		fibo(n);
+	return 0;
+}
+
+static int echo_proc(int argl, void* args)
+{
+	char c;
+	while(Read(0, &c, 1) == 1) {
+		if(Write(1, &c, 1) != 1) break;
+		if(c == QUIT_KEY) break;
+	}
+	stop_hogs = 1;
+	return 0;
+}
+
+static int boot_echo_bench(int argl, void* args)
+{
+	bench_t* B = (bench_t*) args;
+
+	/* Open the terminal as fids 0 and 1 */
+	Fid_t in = OpenTerminal(0);
+	Fid_t out = OpenTerminal(0);
+	if(in != 0 || out != 1) {
+		fprintf(stderr, "echo_bench: cannot open the terminal\n");
+		return 1;
+	}
+
+	stop_hogs = 0;
+	for(int i=0; i<B->nfibo; i++)
+		Exec(fibo_hog, sizeof(B->fibo_n), & B->fibo_n);
+
+	Exec(echo_proc, 0, NULL);
+
+	Close(0);
+	Close(1);
+
+	while(WaitChild(NOPROC, NULL) != NOPROC); /* Wait for all children */
+	return 0;
+}
+
+
+/****************************************************
+	The host side
+ ****************************************************/
+
+/* Wait for the echo of the given key; return 0 on success */
+static int wait_echo(int confd, char key)
+{
+	char c;
+	int rc;
+	do {
+		while((rc = read(confd, &c, 1)) == -1 && errno == EINTR);
+		if(rc != 1) return -1;
+	} while(c != key);
+	return 0;
+}
+
+static int harness(bench_t* B)
+{
+	/* The order matters: TinyOS opens con0 first, then kbd0 */
+	int confd = open("con0", O_RDONLY);
+	int kbdfd = (confd == -1) ? -1 : open("kbd0", O_WRONLY);
+	if(confd == -1 || kbdfd == -1) {
+		perror("echo_bench: cannot open the terminal FIFOs");
+		return 1;
+	}
+
+	uint64_t* lat = xmalloc(B->keys * sizeof(uint64_t));
+	int n = 0;
+
+	/* Let the hogs get going before the first keystroke */
+	usleep(100000);
+
+	for(int i=0; i<B->keys; i++) {
+		char key = 'a' + (i % 26);
+		uint64_t t0 = now_nsec();
+		if(write(kbdfd, &key, 1) != 1 || wait_echo(confd, key) != 0) {
+			fprintf(stderr, "echo_bench: lost the terminal after %d keystrokes\n", i);
+			break;
+		}
+		lat[n++] = now_nsec() - t0;
+		usleep(B->interval);
+	}
+
+	char quit = QUIT_KEY;
+	if(write(kbdfd, &quit, 1) == 1)
+		wait_echo(confd, quit);
+	close(kbdfd);
+	close(confd);
+
+	/* Report */
+	sort_u64(lat, n);
+	double mean = 0.0;
+	for(int i=0; i<n; i++) mean += lat[i];
+	if(n) mean /= n;
+
+	printf("%8s %8s %10s %10s %10s %10s %10s %10s\n",
+		"hogs", "keys", "mean", "min", "p50", "p90", "p99", "max");
+	printf("%8d %8d %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f\n",
+		B->nfibo, n, mean/1000.0, percentile(lat, n, 0.0)/1000.0,
+		percentile(lat, n, 0.5)/1000.0, percentile(lat, n, 0.9)/1000.0,
+		percentile(lat, n, 0.99)/1000.0, percentile(lat, n, 1.0)/1000.0);
+	printf("(echo latency in usec)\n");
+
+	free(lat);
+	return 0;
+}
+
+
+/****************************************************/
+
+void usage(const char* pname)
+{
+	printf("usage:\n  %s [-c <ncores>] [-f <hogs>] [-n <fibo>] [-k <keys>] [-i <interval>]\n\n\
+    where:\n\
+    <ncores> is the number of cpu cores to use (default 1),\n\
+    <hogs> is the number of CPU-bound fibo processes (default 4),\n\
+    <fibo> is the argument of each fibo call of the hogs (default 30),\n\
+    <keys> is the number of keystrokes to type (default 200),\n\
+    <interval> is the time between keystrokes in usec (default 10000).\n",
+		pname);
+	exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned int ncores = 1;
+	bench_t B = { .nfibo = 4, .fibo_n = 30, .keys = 200, .interval = 10000 };
+	int opt;
+
+	while((opt = getopt(argc, argv, "c:f:n:k:i:")) != -1) {
+		switch(opt) {
+			case 'c': ncores = atoi(optarg); break;
+			case 'f': B.nfibo = atoi(optarg); break;
+			case 'n': B.fibo_n = atoi(optarg); break;
+			case 'k': B.keys = atoi(optarg); break;
+			case 'i': B.interval = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if(optind != argc || ncores < 1 || ncores > MAX_CORES || B.nfibo < 0
+		|| B.fibo_n < 1 || B.keys < 1 || B.interval < 0)
+		usage(argv[0]);
+
+	fflush(stdout);
+	pid_t pid = fork();
+	CHECK(pid);
+	if(pid == 0)
+		exit(harness(&B));
+
+	boot(ncores, 1, boot_echo_bench, sizeof(B), &B);
+
+	int status;
+	CHECK(waitpid(pid, &status, 0));
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
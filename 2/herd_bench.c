@@ -0,0 +1,132 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "util.h"
+#include "bench.h"
+#include "bios.h"
+#include "tinyos.h"
+#include "symposium.h"
+
+
+/*
+ 	A thundering-herd benchmark for condition variables.
+
+ 	A symposium of philosophers (see symposium.h) eats with very short
+ 	thinking and eating periods, so that the run time is dominated by
+ 	the synchronization in the symposium monitor. Two kinds of symposia
+ 	are tried:
+
+ 	- signal: each philosopher waits on its own condition variable, and
+ 	          is signaled by a neighbor when it can eat
+ 	- herd:   all philosophers wait on the same condition variable, which
+ 	          is broadcast whenever a philosopher stops eating
+
+ 	Each kind is run without and with wait morphing (see cv_wait_morphing).
+ 	Without it, a broadcast wakes up all hungry philosophers at once, and they
+ 	all contend for the monitor mutex. With it, they are moved to the wait queue
+ 	of the mutex, and wake up one at a time, as the mutex is handed over.
+
+ 	The benchmark reports the throughput in meals per second, and the number
+ 	of futile wakeups (of philosophers that woke up, but could not eat).
+ */
+
+typedef struct {
+	symposium_t symp;      /* the symposium */
+	int herd;              /* run a herd symposium */
+	double elapsed;        /* returned by the boot task (sec) */
+	unsigned long futile;  /* returned by the boot task */
+} bench_t;
+
+typedef struct { int i; SymposiumTable* S; } philosopher_args;
+
+
+
+/* Each philosopher is a process (they share the table, as they share the memory) */
+static int philosopher_proc(int argl, void* args)
+{
+	philosopher_args* A = args;
+	SymposiumTable_philosopher(A->S, A->i);
+	return 0;
+}
+
+static int boot_bench(int argl, void* args)
+{
+	bench_t* B = *(bench_t**) args;
+
+	SymposiumTable S;
+	SymposiumTable_init(&S, &B->symp);
+	S.herd = B->herd;
+	S.quiet = 1;
+
+	uint64_t t0 = now_nsec();
+	for(int i=0; i<B->symp.N; i++) {
+		philosopher_args A = { i, &S };
+		Exec(philosopher_proc, sizeof(A), &A);
+	}
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	B->elapsed = (now_nsec() - t0) / 1e9;
+	B->futile = S.futile;
+
+	SymposiumTable_destroy(&S);
+	return 0;
+}
+
+
+/* Run the benchmark and return the throughput */
+static double run(uint ncores, int morph, bench_t* B)
+{
+	CHECK(setenv("TINYOS_WAIT_MORPHING", morph ? "1" : "0", 1));
+	boot(ncores, 0, boot_bench, sizeof(B), &B);
+	return (double) B->symp.N * B->symp.bites / B->elapsed;
+}
+
+
+void usage(const char* pname)
+{
+	printf("usage:\n  %s [-c <ncores>] [-p <philosophers>] [-b <bites>] [-f <fibo>]\n\n\
+    where:\n\
+    <ncores> is the number of cpu cores to use (default 4),\n\
+    <philosophers> is the number of philosophers (default 16),\n\
+    <bites> is the number of times each philosopher eats (default 2000),\n\
+    <fibo> is the Fibonacci index computed to think or eat (default 10).\n",
+		pname);
+	exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned int ncores = 4;
+	symposium_t symp = { .N = 16, .bites = 2000, .fmin = 10, .fmax = 10 };
+	int opt;
+
+	while((opt = getopt(argc, argv, "c:p:b:f:")) != -1) {
+		switch(opt) {
+			case 'c': ncores = atoi(optarg); break;
+			case 'p': symp.N = atoi(optarg); break;
+			case 'b': symp.bites = atoi(optarg); break;
+			case 'f': symp.fmin = symp.fmax = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if(optind != argc || ncores < 1 || ncores > MAX_CORES || symp.N < 2 || symp.bites < 1
+		|| symp.fmin < 0)
+		usage(argv[0]);
+
+	printf("%-8s %8s %8s %8s %14s %14s\n", "table", "morphing", "cores", "phils", "meals/sec", "futile");
+	for(int herd=0; herd<=1; herd++)
+		for(int morph=0; morph<=1; morph++) {
+			bench_t B = { .symp = symp, .herd = herd };
+			double tput = run(ncores, morph, &B);
+			printf("%-8s %8s %8u %8d %14.0f %14lu\n", herd ? "herd" : "signal", morph ? "on" : "off",
+				ncores, symp.N, tput, B.futile);
+			fflush(stdout);
+		}
+
+	return 0;
+}
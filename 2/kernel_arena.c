@@ -0,0 +1,305 @@
+
+#include <assert.h>
+
+#include "kernel_sched.h"
+#include "kernel_proc.h"
+#include "kernel_arena.h"
+
+/**
+	@file kernel_arena.c
+
+	@brief The implementation of per-process memory arenas.
+  */
+
+unsigned long arena_default_limit = 0;
+
+/* The size class of the blocks that are taken from the host one by one */
+#define ARENA_LARGE ARENA_CLASSES
+
+#define ARENA_MAGIC 0x4d454d41u   /* An allocated block */
+#define ARENA_FREED 0x45455246u   /* A freed block */
+
+/*
+  The header of every block. It is 16 bytes long, so that the blocks are
+  16-byte aligned, like those of malloc. A free block of a size class is
+  linked in its free list through its first word.
+ */
+typedef struct {
+  arena* owner;         /* The arena of the block */
+  unsigned int sclass;  /* The size class, or ARENA_LARGE */
+  unsigned int magic;
+} block_header;
+
+/* A large block starts with a list node (and its size), before its header */
+typedef struct {
+  rlnode node;
+  unsigned long size;
+} large_prefix;
+
+#define LARGE_PREFIX_SIZE (((sizeof(large_prefix)+15)/16)*16)
+
+/* A chunk starts with a link to the previous chunk */
+#define CHUNK_HEADER_SIZE 16
+
+/* In the hash set of regions, a chunk is marked by the low bit of its address */
+#define REGION_CHUNK 1
+
+
+static inline unsigned long class_size(unsigned int c)
+{
+  return (unsigned long) ARENA_MIN_CLASS << c;
+}
+
+static inline unsigned int size_class(unsigned int size)
+{
+  unsigned int c = 0;
+  while(c < ARENA_CLASSES && class_size(c) < size) c++;
+  return c;
+}
+
+
+void arena_init(arena* a, unsigned long limit)
+{
+  a->lock = SLEEPMUTEX_INIT;
+  a->chunks = NULL;
+  a->bump = a->bump_end = NULL;
+  for(int c=0; c<ARENA_CLASSES; c++) a->free[c] = NULL;
+  rlnode_init(& a->large, NULL);
+  a->regions = NULL;
+  a->region_slots = a->region_count = 0;
+  a->info = (meminfo){ .limit = limit };
+}
+
+
+void arena_release(arena* a)
+{
+  while(a->chunks != NULL) {
+    void* chunk = a->chunks;
+    a->chunks = *(void**) chunk;
+    free(chunk);
+  }
+  while(! is_rlist_empty(& a->large))
+    free(rlist_pop_front(& a->large));
+  free(a->regions);
+
+  arena_init(a, a->info.limit);
+}
+
+
+/*
+  The hash set of regions. The keys are the chunks (tagged with REGION_CHUNK)
+  and the headers of the large blocks, in an open-addressing table with linear
+  probing, which is at most half full. Empty slots are 0.
+ */
+
+static inline unsigned int region_home(arena* a, uintptr_t key)
+{
+  uint64_t h = (uint64_t) (key >> 4) * 0x9E3779B97F4A7C15ull;
+  return (unsigned int) (h >> 32) & (a->region_slots - 1);
+}
+
+/* Return the slot of a key, or -1 */
+static int region_find(arena* a, uintptr_t key)
+{
+  if(a->region_slots == 0) return -1;
+  for(unsigned int i = region_home(a, key); a->regions[i] != 0; i = (i+1) & (a->region_slots-1))
+    if(a->regions[i] == key) return i;
+  return -1;
+}
+
+/* Add a key. Return -1 if the host is out of memory. */
+static int region_add(arena* a, uintptr_t key)
+{
+  if(2*(a->region_count+1) > a->region_slots) {
+    unsigned int old_slots = a->region_slots;
+    uintptr_t* old = a->regions;
+    unsigned int slots = old_slots ? 2*old_slots : 16;
+    uintptr_t* regions = calloc(slots, sizeof(uintptr_t));
+    if(regions == NULL) return -1;
+
+    a->regions = regions;
+    a->region_slots = slots;
+    for(unsigned int j=0; j<old_slots; j++)
+      if(old[j] != 0) {
+        unsigned int i = region_home(a, old[j]);
+        while(regions[i] != 0) i = (i+1) & (slots-1);
+        regions[i] = old[j];
+      }
+    free(old);
+  }
+
+  unsigned int i = region_home(a, key);
+  while(a->regions[i] != 0) i = (i+1) & (a->region_slots-1);
+  a->regions[i] = key;
+  a->region_count++;
+  return 0;
+}
+
+/* Remove the key at slot i, moving back the keys of its probe sequence */
+static void region_remove(arena* a, unsigned int i)
+{
+  unsigned int mask = a->region_slots - 1;
+  for(unsigned int j = (i+1) & mask; a->regions[j] != 0; j = (j+1) & mask) {
+    /* The key at j may fill the hole at i, if its home is not in (i, j] */
+    unsigned int home = region_home(a, a->regions[j]);
+    if(((j - home) & mask) >= ((j - i) & mask)) {
+      a->regions[i] = a->regions[j];
+      i = j;
+    }
+  }
+  a->regions[i] = 0;
+  a->region_count--;
+}
+
+
+/* 
+  Take a new chunk from the host. The rest of the current chunk is lost.
+  Return -1 if the host is out of memory.
+ */
+static int arena_grow(arena* a)
+{
+  char* chunk = aligned_alloc(ARENA_CHUNK, ARENA_CHUNK);
+  if(chunk == NULL) return -1;
+  if(region_add(a, (uintptr_t) chunk | REGION_CHUNK) != 0) {
+    free(chunk);
+    return -1;
+  }
+  *(void**) chunk = a->chunks;
+  a->chunks = chunk;
+  a->bump = chunk + CHUNK_HEADER_SIZE;
+  a->bump_end = chunk + ARENA_CHUNK;
+  a->info.reserved += ARENA_CHUNK;
+  return 0;
+}
+
+
+void* MemAlloc(unsigned int size)
+{
+  if(size == 0) return NULL;
+
+  arena* a = & CURPROC->mem;
+  unsigned int c = size_class(size);
+  unsigned long bytes = (c < ARENA_LARGE) ? class_size(c) : size;
+  block_header* h;
+
+  SleepMutex_Lock(& a->lock);
+
+  if(a->info.limit != 0 && a->info.in_use + bytes > a->info.limit)
+    goto fail;
+
+  if(c < ARENA_LARGE) {
+    if(a->free[c] != NULL) {
+      h = a->free[c];
+      a->free[c] = *(void**) (h+1);
+    } else {
+      if(a->bump + sizeof(block_header) + bytes > a->bump_end && arena_grow(a) != 0)
+        goto fail;
+      h = (block_header*) a->bump;
+      a->bump += sizeof(block_header) + bytes;
+    }
+  } else {
+    large_prefix* lp = malloc(LARGE_PREFIX_SIZE + sizeof(block_header) + size);
+    if(lp == NULL) goto fail;
+    h = (block_header*) ((char*) lp + LARGE_PREFIX_SIZE);
+    if(region_add(a, (uintptr_t) h) != 0) {
+      free(lp);
+      goto fail;
+    }
+    rlnode_init(& lp->node, lp);
+    lp->size = size;
+    rlist_push_back(& a->large, & lp->node);
+    a->info.reserved += LARGE_PREFIX_SIZE + sizeof(block_header) + size;
+  }
+
+  h->owner = a;
+  h->sclass = c;
+  h->magic = ARENA_MAGIC;
+
+  a->info.in_use += bytes;
+  if(a->info.in_use > a->info.peak) a->info.peak = a->info.in_use;
+  a->info.allocs++;
+
+  SleepMutex_Unlock(& a->lock);
+  return h+1;
+
+fail:
+  /* Over the limit, or the host is out of memory */
+  a->info.failures++;
+  SleepMutex_Unlock(& a->lock);
+  return NULL;
+}
+
+
+/*
+  Check that h lies where a block header of arena a may be: in the used
+  part of one of its chunks, or in front of one of its large blocks. Only
+  then may it be read. Must be called with a->lock held.
+ */
+static int arena_contains(arena* a, block_header* h)
+{
+  uintptr_t p = (uintptr_t) h;
+  if(p % 16 != 0) return 0;
+  if(region_find(a, p) >= 0) return 1;
+
+  uintptr_t chunk = p & ~(uintptr_t) (ARENA_CHUNK-1);
+  if(region_find(a, chunk | REGION_CHUNK) < 0) return 0;
+  uintptr_t end = (chunk == (uintptr_t) a->chunks) ? (uintptr_t) a->bump : chunk + ARENA_CHUNK;
+  return p >= chunk + CHUNK_HEADER_SIZE && p + sizeof(block_header) <= end;
+}
+
+
+int MemFree(void* ptr)
+{
+  if(ptr == NULL) return 0;
+
+  arena* a = & CURPROC->mem;
+  block_header* h = ((block_header*) ptr) - 1;
+
+  SleepMutex_Lock(& a->lock);
+
+  /* The block must be a live block of this process. Its header is only
+     read if it is inside the arena. */
+  if(! arena_contains(a, h) || h->magic != ARENA_MAGIC || h->owner != a) {
+    SleepMutex_Unlock(& a->lock);
+    return -1;
+  }
+  h->magic = ARENA_FREED;
+
+  if(h->sclass < ARENA_LARGE) {
+    *(void**) ptr = a->free[h->sclass];
+    a->free[h->sclass] = h;
+    a->info.in_use -= class_size(h->sclass);
+  } else {
+    large_prefix* lp = (large_prefix*) ((char*) h - LARGE_PREFIX_SIZE);
+    region_remove(a, region_find(a, (uintptr_t) h));
+    rlist_remove(& lp->node);
+    a->info.in_use -= lp->size;
+    a->info.reserved -= LARGE_PREFIX_SIZE + sizeof(block_header) + lp->size;
+    free(lp);
+  }
+  a->info.frees++;
+
+  SleepMutex_Unlock(& a->lock);
+  return 0;
+}
+
+
+int MemInfo(meminfo* info)
+{
+  if(info == NULL) return -1;
+  arena* a = & CURPROC->mem;
+  SleepMutex_Lock(& a->lock);
+  *info = a->info;
+  SleepMutex_Unlock(& a->lock);
+  return 0;
+}
+
+
+int MemSetLimit(unsigned long limit)
+{
+  arena* a = & CURPROC->mem;
+  SleepMutex_Lock(& a->lock);
+  a->info.limit = limit;
+  SleepMutex_Unlock(& a->lock);
+  return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef __KERNEL_ARENA_H
+#define __KERNEL_ARENA_H
+
+/**
+  @file kernel_arena.h
+  @brief TinyOS kernel: Per-process memory arenas.
+
+  @defgroup arena Memory arenas
+  @ingroup kernel
+  @brief The memory of the @c MemAlloc system call.
+
+  Every process owns an arena, from which @c MemAlloc allocates the memory of
+  the process. The arena takes memory from the host in chunks of @c ARENA_CHUNK
+  bytes, and carves it into blocks by bumping a pointer. A block is rounded up
+  to one of @c ARENA_CLASSES size classes (16, 32, ..., 2048 bytes). A freed block
+  is put on the free list of its class, to be reused by the next allocation of
+  the same class. Larger blocks are taken from the host one by one.
+
+  When the process exits, the whole arena is released at once, whatever the
+  process did not free.
+
+  The chunks are aligned at @c ARENA_CHUNK bytes. The arena keeps a hash set of
+  its chunks and its large blocks, so that @c MemFree can check in constant
+  time that a pointer is in the arena, before it reads the block header.
+
+  Each arena counts the memory in use (by size class), its peak and the memory
+  taken from the host, and it may have a limit on the memory in use.
+
+  The arena is protected by its own sleeping mutex, since the threads of a process
+  may allocate concurrently.
+
+  @{
+*/
+
+#include "tinyos.h"
+#include "util.h"
+
+/** @brief The size of the chunks taken from the host */
+#define ARENA_CHUNK (64*1024)
+
+/** @brief The number of size classes */
+#define ARENA_CLASSES 8
+
+/** @brief The smallest size class (the others are successive powers of 2) */
+#define ARENA_MIN_CLASS 16
+
+/** @brief A per-process memory arena */
+typedef struct arena {
+  SleepMutex lock;                  /**< Protects the arena */
+  void* chunks;                     /**< The chunks taken from the host */
+  char* bump;                       /**< The free space of the current chunk */
+  char* bump_end;                   /**< The end of the current chunk */
+  void* free[ARENA_CLASSES];        /**< The free lists of the size classes */
+  rlnode large;                     /**< The blocks above the largest class */
+  uintptr_t* regions;               /**< The hash set of the chunks and the large blocks */
+  unsigned int region_slots;        /**< The size of @c regions (0, or a power of 2) */
+  unsigned int region_count;        /**< The number of entries in @c regions */
+  meminfo info;                     /**< The counters and the limit */
+} arena;
+
+/** @brief Initialize an empty arena, with a limit (0 for none). */
+void arena_init(arena* a, unsigned long limit);
+
+/** @brief Return all the memory of an arena to the host. */
+void arena_release(arena* a);
+
+/** @brief The default limit of the initial process. This is set by @c boot(). */
+extern unsigned long arena_default_limit;
+
+/** @} */
+
+#endif
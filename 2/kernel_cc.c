@@ -1,10 +1,12 @@
 
 
 #include <assert.h>
+#include <sched.h>
 
 #include "kernel_sched.h"
 #include "kernel_proc.h"
 #include "kernel_cc.h"
+#include "kernel_lockstat.h"
 
 
 /**
@@ -54,10 +56,15 @@ int get_core_preemption()
  *
  */
 
-Mutex kernel_mutex = MUTEX_INIT;          /* lock for resource tables */
+RWLock tables_lock = { .writer = 0 };     /* lock for the process table */
 
 
 
+Mutex_kind mutex_kind = MUTEX_TTAS;
+
+const char* mutex_kind_name[] = { "ttas", "ticket", "mcs" };
+
+
 /*
  	Pre-emption aware mutex.
  	-------------------------
@@ -65,72 +72,615 @@ Mutex kernel_mutex = MUTEX_INIT;          /* lock for resource tables */
  	This mutex will act as a spinlock if preemption is off, and a
  	yielding mutex if it is on.
 
+ 	There are three algorithms (see Mutex_kind), all of which keep their
+ 	state in the single word of the Mutex, with 0 meaning unlocked.
  */
-void Mutex_Lock(Mutex* lock)
-{
+
 #define MUTEX_SPINS 1000
 
+/* Called by waiters at each spin. Yield after spinning for a while.
+   In the non-preemptive domain we cannot yield the core, but we give
+   the host cpu to the other core threads: when there are more cores than
+   host cpus, the thread we are waiting for may need it (with the FIFO
+   algorithms, this includes the next waiter in line). */
+static inline void mutex_spin(int* spin, lockstat_wait* w)
+{
+  __builtin_ia32_pause();
+  w->spins++;
+  if(*spin>0) 
+    (*spin)--; 
+  else { 
+    *spin=MUTEX_SPINS; 
+    w->yields++;
+    if(get_core_preemption())
+      yield(0,0); 
+    else
+      sched_yield();
+  }
+}
+
+
+/*
+  Test-and-test-and-set.
+ */
+static inline void ttas_lock(Mutex* lock, lockstat_wait* w)
+{
   int spin=MUTEX_SPINS;
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-      __builtin_ia32_pause();      
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(get_core_preemption())
-      		yield(0,0); 
-      }
+  while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+    w->contended = 1;
+    while(__atomic_load_n(lock, __ATOMIC_RELAXED))
+      mutex_spin(&spin, w);
+  }
+}
+
+static inline void ttas_unlock(Mutex* lock)
+{
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+  Ticket lock. The mutex word holds two 32-bit counters: the ticket
+  currently served and the next ticket to hand out.
+ */
+typedef uint32_t __attribute__((__may_alias__)) ticket_t;
+#define TICKET_OWNER(lock) (((ticket_t*)(lock))[0])
+#define TICKET_NEXT(lock) (((ticket_t*)(lock))[1])
+
+_Static_assert(sizeof(Mutex) >= 2*sizeof(ticket_t), "Mutex cannot hold a ticket lock");
+
+static inline void ticket_lock(Mutex* lock, lockstat_wait* w)
+{
+  int spin=MUTEX_SPINS;
+  ticket_t my = __atomic_fetch_add(& TICKET_NEXT(lock), 1, __ATOMIC_RELAXED);
+  if(__atomic_load_n(& TICKET_OWNER(lock), __ATOMIC_ACQUIRE) == my) return;
+  w->contended = 1;
+  while(__atomic_load_n(& TICKET_OWNER(lock), __ATOMIC_ACQUIRE) != my)
+    mutex_spin(&spin, w);
+}
+
+static inline void ticket_unlock(Mutex* lock)
+{
+  assert(TICKET_OWNER(lock) != TICKET_NEXT(lock));
+  /* Only the owner writes the 'owner' counter */
+  __atomic_store_n(& TICKET_OWNER(lock), TICKET_OWNER(lock)+1, __ATOMIC_RELEASE);
+}
+
+
+/*
+  MCS queue lock. The mutex word holds a pointer to the tail of the queue
+  of waiters. Each waiter spins on the 'locked' field of its own node.
+ */
+_Static_assert(sizeof(Mutex) >= sizeof(mcs_node*), "Mutex cannot hold an MCS lock");
+
+static inline mcs_node* mcs_acquire_node(Mutex* lock)
+{
+  TCB* tcb = CURTHREAD;
+  mcs_node* nodes = (get_core_preemption() && tcb!=NULL) ? tcb->mcs_nodes : CURCORE.mcs_nodes;
+  for(int i=0; i<MCS_NODES; i++)
+    if(nodes[i].lock == NULL) {
+      nodes[i].lock = lock;
+      return & nodes[i];
     }
+  FATAL("Too many nested MCS locks");
+}
+
+/* Find the node of the holder of the lock. It may have been taken
+   in either domain. */
+static inline mcs_node* mcs_find_node(Mutex* lock)
+{
+  TCB* tcb = CURTHREAD;
+  if(tcb!=NULL)
+    for(int i=0; i<MCS_NODES; i++)
+      if(tcb->mcs_nodes[i].lock == lock) return & tcb->mcs_nodes[i];
+  for(int i=0; i<MCS_NODES; i++)
+    if(CURCORE.mcs_nodes[i].lock == lock) return & CURCORE.mcs_nodes[i];
+  FATAL("MCS lock released by a thread that does not hold it");
+}
+
+static inline void mcs_lock(Mutex* lock, lockstat_wait* w)
+{
+  mcs_node* node = mcs_acquire_node(lock);
+  node->next = NULL;
+  node->locked = 1;
+
+  mcs_node* pred = (mcs_node*) __atomic_exchange_n(lock, (Mutex) node, __ATOMIC_ACQ_REL);
+  if(pred != NULL) {
+    int spin=MUTEX_SPINS;
+    w->contended = 1;
+    __atomic_store_n(& pred->next, node, __ATOMIC_RELEASE);
+    while(__atomic_load_n(& node->locked, __ATOMIC_ACQUIRE))
+      mutex_spin(&spin, w);
   }
-#undef MUTEX_SPINS
+}
+
+static inline void mcs_unlock(Mutex* lock)
+{
+  mcs_node* node = mcs_find_node(lock);
+  mcs_node* succ = __atomic_load_n(& node->next, __ATOMIC_ACQUIRE);
+
+  if(succ == NULL) {
+    /* No known successor, try to release the lock */
+    Mutex expected = (Mutex) node;
+    if(__atomic_compare_exchange_n(lock, &expected, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      goto done;
+
+    /* A successor is linking itself, wait for it */
+    while((succ = __atomic_load_n(& node->next, __ATOMIC_ACQUIRE)) == NULL)
+      __builtin_ia32_pause();
+  }
+  __atomic_store_n(& succ->locked, 0, __ATOMIC_RELEASE);
+
+done:
+  node->lock = NULL;
+}
+
+
+/*
+  The holder of a lock is in a kernel section, so that a killed thread
+  does not exit at quantum expiry with the lock held (see kill_point). 
+  The section is entered before the lock is taken and left after it is 
+  released, so that there is no window where the thread holds the lock
+  outside of it. There is no thread while booting.
+
+  A thread that spends most of its time holding locks would rarely be
+  outside a section at quantum expiry, so leaving the last section is
+  a kill point too, when preemption is on (i.e., where the timer could
+  have killed the thread anyway).
+ */
+static inline void lock_section_enter()
+{
+  TCB* tcb = CURTHREAD;
+  if(tcb != NULL && tcb->kernel_depth++ == 0) usage_kernel_enter(tcb);
+}
+
+static inline void lock_section_leave()
+{
+  TCB* tcb = CURTHREAD;
+  if(tcb != NULL && --tcb->kernel_depth == 0) {
+    usage_kernel_leave(tcb);
+    if(CURCORE.preemption) kill_point();
+  }
+}
+
+
+void Mutex_Lock(Mutex* lock)
+{
+  lockstat_wait w = { 0, 0, 0 };
+  lock_section_enter();
+  switch(mutex_kind) {
+    case MUTEX_TICKET: ticket_lock(lock, &w); break;
+    case MUTEX_MCS: mcs_lock(lock, &w); break;
+    default: ttas_lock(lock, &w);
+  }
+  if(lockstat_enabled) lockstat_acquired(lock, &w);
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  if(lockstat_enabled) lockstat_released(lock);
+  switch(mutex_kind) {
+    case MUTEX_TICKET: ticket_unlock(lock); break;
+    case MUTEX_MCS: mcs_unlock(lock); break;
+    default: ttas_unlock(lock);
+  }
+  lock_section_leave();
+}
+
+#undef MUTEX_SPINS
+
+
+void Mutex_Register(Mutex* lock, const char* name)
+{
+  lockstat_register(lock, name);
+}
+
+
+void Mutex_Unregister(Mutex* lock)
+{
+  lockstat_unregister(lock);
+}
+
+
+
+/*
+	Killable waits.
+	---------------
+
+	A thread that sleeps in a wait queue (of a sleeping mutex, a condition
+	variable, a semaphore or a barrier) lists its wait in the sleepers of 
+	its process, before it locks the queue. KillGroup marks the process as
+	killed and then calls the cancel function of every listed wait, which
+	removes the waiter from its queue (if it is still there) and wakes it up.
+	A wait that checks the mark under the queue lock, after it is listed,
+	does not sleep. The thread is not killed while its wait is listed.
+ */
+
+/** \cond HELPER A killable wait, the first member of the waiter of a queue. */
+typedef struct __kill_wait {
+  rlnode sleeper;                         /* In the sleepers of the process */
+  void (*cancel)(struct __kill_wait*);    /* Removes the waiter from its queue and wakes it */
+  int killed;                             /* Set if the wait was cut short */
+} __kill_wait;
+/** \endcond */
+
+
+/* List a wait of the current thread, unless it is exiting. Return its process, or NULL. */
+static PCB* kill_wait_begin(__kill_wait* kw, void (*cancel)(__kill_wait*))
+{
+  TCB* tcb = CURTHREAD;
+  kw->cancel = cancel;
+  kw->killed = 0;
+  if(tcb == NULL || tcb->exiting) return NULL;
+
+  PCB* pcb = tcb->owner_pcb;
+  kernel_enter();
+  Mutex_Lock(& pcb->sleepers_lock);
+  rlist_push_back(& pcb->sleepers, rlnode_init(& kw->sleeper, kw));
+  Mutex_Unlock(& pcb->sleepers_lock);
+  return pcb;
+}
+
+/* Check, with the queue locked, if a listed wait must not sleep */
+static inline int kill_wait_check(PCB* pcb, __kill_wait* kw)
+{
+  if(pcb && __atomic_load_n(& pcb->killed, __ATOMIC_RELAXED))
+    kw->killed = 1;
+  return kw->killed;
+}
+
+/* Remove a wait from the sleepers, after the thread is awake */
+static void kill_wait_end(PCB* pcb, __kill_wait* kw)
+{
+  if(pcb == NULL) return;
+  Mutex_Lock(& pcb->sleepers_lock);
+  rlist_remove(& kw->sleeper);
+  Mutex_Unlock(& pcb->sleepers_lock);
+  kernel_leave();
 }
 
 
+/* The waiter cannot go away while it is listed, because it must lock 
+   sleepers_lock to leave the list */
+void cancel_waits(PCB* pcb)
+{
+  Mutex_Lock(& pcb->sleepers_lock);
+  for(rlnode* n = pcb->sleepers.next; n != &pcb->sleepers; n = n->next) {
+    __kill_wait* kw = n->obj;
+    kw->cancel(kw);
+  }
+  Mutex_Unlock(& pcb->sleepers_lock);
+}
+
+
+
+/*
+	Sleeping mutex.
+	---------------
+
+	The owner word is the owner TCB (or SMX_BOOT, while booting and there
+	are no threads yet), with bit SMX_WAITERS set when the wait queue is 
+	not empty. The word is SMX_WAITERS alone, when the mutex is unlocked
+	but there are waiters. The bit is only changed under the spinlock, 
+	(or preserved by a CAS that takes the mutex), so an owner that can clear
+	the word with a single CAS knows that nobody needs to be woken.
+
+	Unlocking does not hand the mutex over to the first waiter; it just wakes
+	it up, and the waiter tries to lock the mutex again (possibly losing it
+	to a running thread, and queueing again). Handing over to a thread that
+	has yet to be scheduled would keep the mutex idle in the meantime, and
+	would make every other thread wait in a convoy behind it.
+ */
+
+/** \cond HELPER A waiter of a sleeping mutex (on the waiter's stack). */
+typedef struct __smx_waiter {
+  __kill_wait kw;
+  TCB* thread;
+  struct __smx_waiter* next;
+  SleepMutex* mx;
+} __smx_waiter;
+/** \endcond */
+
+#define SMX_WAITERS ((uintptr_t)1)
+#define SMX_BOOT ((uintptr_t)2)
+
+/* How many times to check that the owner is still running, before sleeping */
+#define SMX_SPINS 100
+
+static inline uintptr_t smx_self()
+{
+  TCB* tcb = CURTHREAD;
+  return (tcb==NULL) ? SMX_BOOT : (uintptr_t) tcb;
+}
+
+/* Check if a thread is currently running on some core. We do not touch
+   the TCB itself: the owner may release the mutex and exit at any time. */
+static int smx_owner_running(uintptr_t owner)
+{
+  TCB* tcb = (TCB*) (owner & ~SMX_WAITERS);
+  for(uint c=0; c<cpu_cores(); c++)
+    if(cctx[c].current_thread == tcb) return 1;
+  return 0;
+}
+
+/* Try to take the mutex, if it is unlocked, preserving the waiters bit */
+static inline int smx_trylock(SleepMutex* mx, uintptr_t* owner, uintptr_t self)
+{
+  while((*owner & ~SMX_WAITERS) == 0)
+    if(__atomic_compare_exchange_n(& mx->owner, owner, self | *owner, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return 1;
+  return 0;
+}
+
+/* Append a waiter to the wait queue (the spinlock must be held) */
+static inline void smx_enqueue(SleepMutex* mx, __smx_waiter* w)
+{
+  w->next = NULL;
+  if(mx->tail) 
+    ((__smx_waiter*) mx->tail)->next = w;
+  else
+    mx->head = w;
+  mx->tail = w;
+}
+
+/* Remove a killed waiter from the wait queue, and wake it up */
+static void smx_cancel(__kill_wait* kw)
+{
+  __smx_waiter* w = (__smx_waiter*) kw;
+  SleepMutex* mx = w->mx;
+
+  Mutex_Lock(& mx->spinlock);
+  __smx_waiter* prev = NULL;
+  for(__smx_waiter* p = mx->head; p != NULL; prev = p, p = p->next) {
+    if(p != w) continue;
+    if(prev) prev->next = w->next; else mx->head = w->next;
+    if(mx->tail == w) mx->tail = prev;
+
+    /* The owner may change by CAS, but the bit is only changed under the spinlock */
+    if(mx->head == NULL)
+      __atomic_and_fetch(& mx->owner, ~SMX_WAITERS, __ATOMIC_RELAXED);
+    kw->killed = 1;
+    wakeup(w->thread);
+    break;
+  }
+  Mutex_Unlock(& mx->spinlock);
+}
+
+
+/* Return 0 if a killable wait was cut short by a kill, else 1 (with the mutex locked) */
+static int smx_lock(SleepMutex* mx, lockstat_wait* w, int killable)
+{
+  uintptr_t self = smx_self();
+  uintptr_t owner;
+
+  while(1) {
+    /* Adaptive phase: spin while the owner is running */
+    for(int spin=SMX_SPINS; ; spin--) {
+      owner = __atomic_load_n(& mx->owner, __ATOMIC_RELAXED);
+      if(smx_trylock(mx, &owner, self)) return 1;
+      w->contended = 1;
+      if(self==SMX_BOOT || spin==0 || !smx_owner_running(owner)) break;
+      w->spins++;
+      for(int i=0; i<10; i++) __builtin_ia32_pause();
+    }
+
+    /* Sleeping phase */
+    assert(self != SMX_BOOT);
+    assert(get_core_preemption());
+
+    __smx_waiter node = { .thread = (TCB*) self, .next = NULL, .mx = mx };
+    PCB* pcb = killable ? kill_wait_begin(& node.kw, smx_cancel) : NULL;
+
+    Mutex_Lock(& mx->spinlock);
+    owner = __atomic_load_n(& mx->owner, __ATOMIC_RELAXED);
+    while(1) {
+      if(smx_trylock(mx, &owner, self)) {
+        Mutex_Unlock(& mx->spinlock);
+        kill_wait_end(pcb, & node.kw);
+        return 1;
+      }
+      if(kill_wait_check(pcb, & node.kw))
+        break;
+      if((owner & SMX_WAITERS) || 
+        __atomic_compare_exchange_n(& mx->owner, &owner, owner|SMX_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+
+    /* Join the end of the queue, and try again when woken up */
+    if(node.kw.killed)
+      Mutex_Unlock(& mx->spinlock);
+    else {
+      smx_enqueue(mx, &node);
+      w->yields++;
+      sleep_releasing(STOPPED, & mx->spinlock, 0);
+    }
+
+    kill_wait_end(pcb, & node.kw);
+    if(node.kw.killed) return 0;
+  }
+}
+
+void SleepMutex_Lock(SleepMutex* mx)
+{
+  lockstat_wait w = { 0, 0, 0 };
+
+  /* A thread that holds no other lock may be killed while it waits */
+  TCB* tcb = CURTHREAD;
+  int killable = (tcb != NULL && tcb->kernel_depth == 0);
+
+  lock_section_enter();
+  if(! smx_lock(mx, &w, killable)) {
+    /* The wait was cut short by a kill: exit, without the mutex */
+    lock_section_leave();
+    kill_point();
+    assert(0);
+  }
+  if(lockstat_enabled) lockstat_acquired(mx, &w);
+}
+
+
+void SleepMutex_Unlock(SleepMutex* mx)
+{
+  uintptr_t self = smx_self();
+  if(lockstat_enabled) lockstat_released(mx);
+
+  /* Fast path: no waiters */
+  uintptr_t owner = self;
+  if(__atomic_compare_exchange_n(& mx->owner, &owner, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    lock_section_leave();
+    return;
+  }
+  assert(owner == (self|SMX_WAITERS));
+
+  /* Wake up the first waiter */
+  Mutex_Lock(& mx->spinlock);
+  __smx_waiter* w = mx->head;
+  assert(w != NULL);
+  mx->head = w->next;
+  if(mx->head == NULL) mx->tail = NULL;
+  TCB* next = w->thread;   /* w is on a stack that may go away after wakeup */
+  __atomic_store_n(& mx->owner, (mx->head ? SMX_WAITERS : 0), __ATOMIC_RELEASE);
+  wakeup(next);
+  Mutex_Unlock(& mx->spinlock);
+  lock_section_leave();
+}
+
+#undef SMX_SPINS
+
+
+void SleepMutex_Register(SleepMutex* mx, const char* name)
+{
+  lockstat_register(mx, name);
+}
+
+
+void SleepMutex_Unregister(SleepMutex* mx)
+{
+  lockstat_unregister(mx);
+}
+
 
 /** \cond HELPER Helper structure for condition variables. */
 typedef struct __cv_waitset_node {
+  __kill_wait kw;
   void* thread;
   struct __cv_waitset_node* next;
+  SleepMutex* mx;          /* For wait morphing: the mutex to move the waiter to, */
+  __smx_waiter* morph;     /* and the waiter's node for its wait queue */
+  int killable;            /* If a kill cuts the wait short */
+  CondVar* cv;
 } __cv_waitset_node;
 /** \endcond */
 
 
+int cv_wait_morphing = 1;
+
 
 /*
 	Condition variables.	
-*/
 
-int Cond_Wait(Mutex* mutex, CondVar* cv,int I_O)
+	The waitset is a circular FIFO queue, and cv->waitset points to its
+	tail (so that cv->waitset->next is the head). Waiters join at the tail,
+	and signals wake the head.
+ */
+
+static void cv_cancel(__kill_wait* kw);
+
+/*
+  Join the waitset of cv, release the mutex (by calling 'unlock') 
+  and sleep. Releasing the mutex while holding the waitset lock makes
+  the release-and-sleep atomic with respect to signals.
+
+  A killable wait is listed in the sleepers of the process. Return 0 if 
+  the wait was cut short by a kill, else 1.
+ */
+static int cv_wait_releasing(CondVar* cv, int I_O, void (*unlock)(void*), void* mutex,
+  __cv_waitset_node* newnode)
 {
-  __cv_waitset_node newnode;
-  
-  newnode.thread = CURTHREAD;
+  newnode->thread = CURTHREAD;
+  newnode->cv = cv;
+  PCB* pcb = NULL;
+  if(newnode->killable)
+    pcb = kill_wait_begin(& newnode->kw, cv_cancel);
+  else
+    newnode->kw.killed = 0;
 
   Mutex_Lock(&(cv->waitset_lock));
 
-  /* We just push the current thread to the head of the list */
-  newnode.next = cv->waitset;
-  cv->waitset = &newnode;
+  if(kill_wait_check(pcb, & newnode->kw)) {
+    /* Do not sleep, just release the mutex */
+    unlock(mutex);
+    Mutex_Unlock(&(cv->waitset_lock));
+  } else {
+    /* Append the current thread to the tail of the queue */
+    __cv_waitset_node* tail = cv->waitset;
+    if(tail) {
+      newnode->next = tail->next;
+      tail->next = newnode;
+    } else
+      newnode->next = newnode;
+    cv->waitset = newnode;
 
-  /* Now atomically release mutex and sleep */
-  Mutex_Unlock(mutex);
+    /* Now atomically release mutex and sleep */
+    unlock(mutex);
 
-  if (I_O)		
-  	sleep_releasing(STOPPED, &(cv->waitset_lock),1);
-  else 
-	sleep_releasing(STOPPED, &(cv->waitset_lock),0);
+    if (I_O)		
+    	sleep_releasing(STOPPED, &(cv->waitset_lock),1);
+    else 
+  	sleep_releasing(STOPPED, &(cv->waitset_lock),0);
+  }
+
+  kill_wait_end(pcb, & newnode->kw);
+  return ! newnode->kw.killed;
+}
+
+
+int Cond_Wait(Mutex* mutex, CondVar* cv,int I_O)
+{
+  __cv_waitset_node newnode = { .mx = NULL, .morph = NULL, .killable = 1 };
+  int ret = cv_wait_releasing(cv, I_O, (void (*)(void*)) Mutex_Unlock, mutex, &newnode);
+
+  /* A killed thread that holds no other lock exits here */
+  if(! ret) kill_point();
 
   /* Re-lock mutex before returning */
   Mutex_Lock(mutex);
 
-  return 1;
+  return ret;
+}
+
+
+/*
+  Move a signaled waiter to the wait queue of its sleeping mutex, to be woken
+  up when the mutex is unlocked. If the mutex is unlocked now, wake it up.
+ */
+static void cv_morph(SleepMutex* mx, __smx_waiter* w)
+{
+  Mutex_Lock(& mx->spinlock);
+  uintptr_t owner = __atomic_load_n(& mx->owner, __ATOMIC_RELAXED);
+  while(1) {
+    if((owner & ~SMX_WAITERS) == 0) {
+      wakeup(w->thread);
+      Mutex_Unlock(& mx->spinlock);
+      return;
+    }
+    if((owner & SMX_WAITERS) || 
+      __atomic_compare_exchange_n(& mx->owner, &owner, owner|SMX_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+  }
+  smx_enqueue(mx, w);
+  Mutex_Unlock(& mx->spinlock);
+}
+
+
+/* Wake up a waiter that was removed from the waitset */
+static inline void cv_wake(__cv_waitset_node* node)
+{
+  if(node->mx)
+    cv_morph(node->mx, node->morph);
+  else
+    wakeup(node->thread);
 }
 
 
@@ -140,16 +690,91 @@ int Cond_Wait(Mutex* mutex, CondVar* cv,int I_O)
  */
 static __cv_waitset_node* cv_signal(CondVar* cv)
 {
-  /* Wakeup first process in the waiters' queue, if it exists. */
-  if(cv->waitset != NULL) {
-    __cv_waitset_node *node = cv->waitset;
-    cv->waitset = node->next;
-    wakeup(node->thread);
+  /* Wakeup the first thread in the waiters' queue, if it exists. */
+  __cv_waitset_node* tail = cv->waitset;
+  if(tail != NULL) {
+    __cv_waitset_node *node = tail->next;
+    if(node == tail) 
+      cv->waitset = NULL;
+    else
+      tail->next = node->next;
+
+    cv_wake(node);
   }
   return cv->waitset;
 }
 
 
+/* Remove a node from the waitset of cv, if it is there, and return it */
+static __cv_waitset_node* cv_remove(CondVar* cv, __cv_waitset_node* node)
+{
+  __cv_waitset_node* tail = cv->waitset;
+  if(tail == NULL) return NULL;
+
+  __cv_waitset_node* prev = tail;
+  do {
+    if(prev->next == node) {
+      if(node == prev) 
+        cv->waitset = NULL;
+      else {
+        prev->next = node->next;
+        if(node == tail) cv->waitset = prev;
+      }
+      return node;
+    }
+    prev = prev->next;
+  } while(prev != tail);
+  return NULL;
+}
+
+
+/* Remove a killed waiter from the waitset, and wake it up (without morphing) */
+static void cv_cancel(__kill_wait* kw)
+{
+  __cv_waitset_node* node = (__cv_waitset_node*) kw;
+  CondVar* cv = node->cv;
+  Mutex_Lock(&(cv->waitset_lock));
+  if(cv_remove(cv, node)) {
+    kw->killed = 1;
+    wakeup(node->thread);
+  }
+  Mutex_Unlock(&(cv->waitset_lock));
+}
+
+
+
+int SleepMutex_Wait(SleepMutex* mx, CondVar* cv, int I_O)
+{
+  __smx_waiter w = { .thread = CURTHREAD, .next = NULL, .mx = mx };
+  __cv_waitset_node newnode = { .mx = NULL, .morph = NULL, .killable = 1 };
+  if(cv_wait_morphing) {
+    newnode.mx = mx;
+    newnode.morph = &w;
+  }
+
+  int ret = cv_wait_releasing(cv, I_O, (void (*)(void*)) SleepMutex_Unlock, mx, &newnode);
+
+  /* A killed thread that holds no other lock exits here */
+  if(! ret) kill_point();
+
+  SleepMutex_Lock(mx);
+  return ret;
+}
+
+
+void SleepMutex_WaitUnkillable(SleepMutex* mx, CondVar* cv)
+{
+  __smx_waiter w = { .thread = CURTHREAD, .next = NULL, .mx = mx };
+  __cv_waitset_node newnode = { .mx = NULL, .morph = NULL, .killable = 0 };
+  if(cv_wait_morphing) {
+    newnode.mx = mx;
+    newnode.morph = &w;
+  }
+
+  cv_wait_releasing(cv, 0, (void (*)(void*)) SleepMutex_Unlock, mx, &newnode);
+  SleepMutex_Lock(mx);
+}
+
 
 void Cond_Signal(CondVar* cv)
 {
@@ -168,3 +793,376 @@ void Cond_Broadcast(CondVar* cv)
 
 
 
+/*
+	Reader-writer locks.
+	--------------------
+
+	A reader increments the counter of its current core and then checks
+	the writer flag, while a writer sets the flag and then sums the counters.
+	Both sides use sequentially consistent atomics, so at least one of them
+	sees the other. The thread may migrate between locking and unlocking, 
+	so a counter may become negative; only the sum is meaningful.
+ */
+
+static inline long* rw_counter(RWLock* rw)
+{
+  return & rw->readers[cpu_core_id % RWLOCK_SLOTS].count;
+}
+
+static long rw_readers(RWLock* rw)
+{
+  long sum = 0;
+  for(int i=0; i<RWLOCK_SLOTS; i++)
+    sum += __atomic_load_n(& rw->readers[i].count, __ATOMIC_SEQ_CST);
+  return sum;
+}
+
+static void rw_read_unlock(RWLock* rw)
+{
+  __atomic_sub_fetch(rw_counter(rw), 1, __ATOMIC_SEQ_CST);
+  if(! __atomic_load_n(& rw->writer, __ATOMIC_SEQ_CST))
+    return;
+
+  /* A writer may be waiting for the readers to leave */
+  Mutex_Lock(& rw->lock);
+  Cond_Broadcast(& rw->writers_cv);
+  Mutex_Unlock(& rw->lock);
+}
+
+
+/* Wait on a condition of rw. This is not cut short by a kill: a thread that
+   waits for a lock is in a kernel section, and it must wait until it gets it. */
+static void rw_wait(RWLock* rw, CondVar* cv)
+{
+  __cv_waitset_node newnode = { .mx = NULL, .morph = NULL, .killable = 0 };
+  cv_wait_releasing(cv, 0, (void (*)(void*)) Mutex_Unlock, & rw->lock, &newnode);
+  Mutex_Lock(& rw->lock);
+}
+
+
+/* The holder of a reader-writer lock is in a kernel section, as for the mutexes */
+
+void RWLock_ReadLock(RWLock* rw)
+{
+  lock_section_enter();
+  __atomic_add_fetch(rw_counter(rw), 1, __ATOMIC_SEQ_CST);
+  if(! __atomic_load_n(& rw->writer, __ATOMIC_SEQ_CST))
+    return;
+
+  /* There is a writer, back off and wait for it */
+  rw_read_unlock(rw);
+
+  Mutex_Lock(& rw->lock);
+  while(rw->writer)
+    rw_wait(rw, & rw->readers_cv);
+  __atomic_add_fetch(rw_counter(rw), 1, __ATOMIC_SEQ_CST);
+  Mutex_Unlock(& rw->lock);
+}
+
+
+void RWLock_ReadUnlock(RWLock* rw)
+{
+  rw_read_unlock(rw);
+  lock_section_leave();
+}
+
+
+void RWLock_WriteLock(RWLock* rw)
+{
+  lock_section_enter();
+  Mutex_Lock(& rw->lock);
+  while(rw->writer)
+    rw_wait(rw, & rw->writers_cv);
+  __atomic_store_n(& rw->writer, 1, __ATOMIC_SEQ_CST);
+  while(rw_readers(rw) != 0)
+    rw_wait(rw, & rw->writers_cv);
+  Mutex_Unlock(& rw->lock);
+}
+
+
+void RWLock_WriteUnlock(RWLock* rw)
+{
+  Mutex_Lock(& rw->lock);
+  __atomic_store_n(& rw->writer, 0, __ATOMIC_SEQ_CST);
+  Cond_Broadcast(& rw->readers_cv);
+  Cond_Broadcast(& rw->writers_cv);
+  Mutex_Unlock(& rw->lock);
+  lock_section_leave();
+}
+
+
+
+
+/*
+	Semaphores.
+	-----------
+
+	The value word holds the available units, with bit SEM_WAITERS set when
+	the wait queue is not empty. While the bit is set, the word only changes 
+	under the lock; otherwise, it changes by CAS. A waiter only sleeps 
+	after setting the bit (under the lock), so a Sem_V that can add its units 
+	with a single CAS on a word without the bit knows that nobody waits.
+ */
+
+/** \cond HELPER A waiter of a semaphore (on the waiter's stack). */
+typedef struct __sem_waiter {
+  __kill_wait kw;
+  TCB* thread;
+  unsigned long n;
+  struct __sem_waiter* next;
+  Semaphore* sem;
+} __sem_waiter;
+/** \endcond */
+
+#define SEM_WAITERS (1ul << (8*sizeof(unsigned long)-1))
+
+/*
+  Serve the waiters in order, as long as there are enough of the v units,
+  and store the rest. The lock must be held.
+ */
+static void sem_serve(Semaphore* sem, unsigned long v)
+{
+  __sem_waiter* w;
+  while((w = sem->head) != NULL && w->n <= v) {
+    v -= w->n;
+    sem->head = w->next;
+    wakeup(w->thread);   /* w may go away after this */
+  }
+  if(sem->head == NULL) 
+    sem->tail = NULL;
+  else
+    v |= SEM_WAITERS;
+  __atomic_store_n(& sem->value, v, __ATOMIC_RELEASE);
+}
+
+
+/*
+  Remove a killed waiter from the wait queue, and wake it up. The waiters 
+  behind it may be served now, with the units that it was waiting to add to.
+ */
+static void sem_cancel(__kill_wait* kw)
+{
+  __sem_waiter* w = (__sem_waiter*) kw;
+  Semaphore* sem = w->sem;
+
+  Mutex_Lock(& sem->lock);
+  __sem_waiter* prev = NULL;
+  for(__sem_waiter* p = sem->head; p != NULL; prev = p, p = p->next) {
+    if(p != w) continue;
+    if(prev) prev->next = w->next; else sem->head = w->next;
+    if(sem->tail == w) sem->tail = prev;
+
+    kw->killed = 1;
+    wakeup(w->thread);
+    sem_serve(sem, __atomic_load_n(& sem->value, __ATOMIC_RELAXED) & ~SEM_WAITERS);
+    break;
+  }
+  Mutex_Unlock(& sem->lock);
+}
+
+
+int Sem_P(Semaphore* sem, unsigned int n)
+{
+  /* Fast path: take the units if nobody waits */
+  unsigned long v = __atomic_load_n(& sem->value, __ATOMIC_RELAXED);
+  while(!(v & SEM_WAITERS) && v >= n)
+    if(__atomic_compare_exchange_n(& sem->value, &v, v-n, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return 1;
+
+  /* The wait is listed for KillGroup before the lock is taken */
+  __sem_waiter w = { .thread = CURTHREAD, .n = n, .next = NULL, .sem = sem };
+  PCB* pcb = kill_wait_begin(& w.kw, sem_cancel);
+
+  Mutex_Lock(& sem->lock);
+  v = __atomic_load_n(& sem->value, __ATOMIC_RELAXED);
+  while(1) {
+    if(!(v & SEM_WAITERS) && v >= n) {
+      if(__atomic_compare_exchange_n(& sem->value, &v, v-n, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        Mutex_Unlock(& sem->lock);
+        kill_wait_end(pcb, & w.kw);
+        return 1;
+      }
+    }
+    else if(kill_wait_check(pcb, & w.kw))
+      break;
+    else if((v & SEM_WAITERS) ||
+      __atomic_compare_exchange_n(& sem->value, &v, v|SEM_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+  }
+
+  /* Join the end of the queue; Sem_V will give us our units */
+  if(w.kw.killed)
+    Mutex_Unlock(& sem->lock);
+  else {
+    if(sem->tail)
+      ((__sem_waiter*) sem->tail)->next = &w;
+    else
+      sem->head = &w;
+    sem->tail = &w;
+
+    sleep_releasing(STOPPED, & sem->lock, 0);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  }
+
+  kill_wait_end(pcb, & w.kw);
+  if(w.kw.killed) {
+    /* A killed thread that holds no lock exits here */
+    kill_point();
+    return 0;
+  }
+  return 1;
+}
+
+
+void Sem_V(Semaphore* sem, unsigned int n)
+{
+  /* Fast path: add the units if nobody waits */
+  unsigned long v = __atomic_load_n(& sem->value, __ATOMIC_RELAXED);
+  while(!(v & SEM_WAITERS))
+    if(__atomic_compare_exchange_n(& sem->value, &v, v+n, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return;
+
+  Mutex_Lock(& sem->lock);
+
+  /* The waiters may have left while we were locking */
+  v = __atomic_load_n(& sem->value, __ATOMIC_RELAXED);
+  while(!(v & SEM_WAITERS))
+    if(__atomic_compare_exchange_n(& sem->value, &v, v+n, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      Mutex_Unlock(& sem->lock);
+      return;
+    }
+
+  sem_serve(sem, (v & ~SEM_WAITERS) + n);
+
+  Mutex_Unlock(& sem->lock);
+}
+
+#undef SEM_WAITERS
+
+
+
+/*
+	Barriers.
+	---------
+
+	The waiters of a phase are linked in their order of arrival, which is
+	also the breadth-first order of the wakeup tree: the children of the k-th
+	waiter are waiters k*F+1 ... k*F+F (F = BARRIER_FANOUT). So, the children 
+	of a waiter are consecutive in the list, and 'attach' moves along the
+	list, to the next waiter, whenever a waiter gets its F-th child.
+
+	The last thread to arrive resets the barrier for the next phase, before
+	any waiter wakes up. The waiter nodes of a phase stay valid until 
+	their threads wake up, which happens only after they wake their children.
+ */
+
+/** \cond HELPER A waiter of a barrier (on the waiter's stack). */
+typedef struct __barrier_waiter {
+  __kill_wait kw;
+  TCB* thread;
+  struct __barrier_waiter* next;    /* The next waiter to arrive */
+  struct __barrier_waiter* child;   /* The first child */
+  int nchildren;
+  Barrier* barrier;
+} __barrier_waiter;
+/** \endcond */
+
+/* Add a waiter to the current phase, and to the wakeup tree. The lock must be held. */
+static void barrier_link(Barrier* b, __barrier_waiter* w)
+{
+  w->next = w->child = NULL;
+  w->nchildren = 0;
+  if(b->root == NULL)
+    b->root = b->attach = w;
+  else {
+    __barrier_waiter* parent = b->attach;
+    ((__barrier_waiter*) b->last)->next = w;
+    if(parent->nchildren++ == 0) parent->child = w;
+    if(parent->nchildren == BARRIER_FANOUT) b->attach = parent->next;
+  }
+  b->last = w;
+}
+
+
+/*
+  Remove a killed waiter from the current phase, if it is still there, and
+  wake it up. The tree of the other waiters is built again, in their order
+  of arrival.
+ */
+static void barrier_cancel(__kill_wait* kw)
+{
+  __barrier_waiter* w = (__barrier_waiter*) kw;
+  Barrier* b = w->barrier;
+
+  Mutex_Lock(& b->lock);
+  __barrier_waiter* p = b->root;
+  while(p != NULL && p != w) p = p->next;
+  if(p == w) {
+    __barrier_waiter* first = b->root;
+    b->root = b->last = b->attach = NULL;
+    for(p = first; p != NULL; ) {
+      __barrier_waiter* next = p->next;
+      if(p != w) barrier_link(b, p);
+      p = next;
+    }
+    b->arrived--;
+
+    kw->killed = 1;
+    wakeup(w->thread);
+  }
+  Mutex_Unlock(& b->lock);
+}
+
+
+int Barrier_Wait(Barrier* b)
+{
+  /* The wait is listed for KillGroup before the lock is taken */
+  __barrier_waiter w = { .thread = CURTHREAD, .barrier = b };
+  PCB* pcb = kill_wait_begin(& w.kw, barrier_cancel);
+
+  Mutex_Lock(& b->lock);
+
+  if(b->arrived + 1 >= b->n) {
+    /* The last one: start a new phase and release this one */
+    __barrier_waiter* root = b->root;
+    b->arrived = 0;
+    b->root = b->last = b->attach = NULL;
+    Mutex_Unlock(& b->lock);
+    if(root) wakeup(root->thread);
+    kill_wait_end(pcb, & w.kw);
+    return 1;
+  }
+
+  if(kill_wait_check(pcb, & w.kw)) {
+    Mutex_Unlock(& b->lock);
+    kill_wait_end(pcb, & w.kw);
+    kill_point();
+    return -1;
+  }
+
+  barrier_link(b, &w);
+  b->arrived++;
+
+  /* We must not be killed before we wake up our children */
+  kernel_enter();
+  sleep_releasing(STOPPED, & b->lock, 0);
+
+  /* Wake up our children, unless we were taken out of the tree by a kill */
+  if(! w.kw.killed) {
+    __barrier_waiter* c = w.child;
+    for(int i=0; i<w.nchildren; i++) {
+      __barrier_waiter* next = c->next;   /* c may go away after the wakeup */
+      wakeup(c->thread);
+      c = next;
+    }
+  }
+  kernel_leave();
+
+  kill_wait_end(pcb, & w.kw);
+  if(w.kw.killed) {
+    /* A killed thread that holds no lock exits here */
+    kill_point();
+    return -1;
+  }
+  return 0;
+}
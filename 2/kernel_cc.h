@@ -37,17 +37,122 @@
    	tinyos.h file
 */
 #include "tinyos.h"
+#include "util.h"
 
 
+/**
+ * @brief The kernel locks.
+ *
+ * There is no global kernel lock. Each kernel resource is protected by its own lock:
+ *
+ * - @c PCB.lock protects the children and exited lists of a process, its
+ *   @c child_exit and @c thread_exit condition variables, its thread list and
+ *   thread counters, and the @c parent field of its children.
+ * - @c PCB.files_lock protects the file table (@c FIDT) of a process.
+ * - @c port_lock protects the port table (@c PORTS_TABLE) and the listener
+ *   and request state of sockets. The port table may also be read without it,
+ *   in an RCU read-side section (see kernel_rcu.h).
+ * - @c pipe_ctrl_block.mut protects a pipe.
+ * - @c tables_lock protects the process table (@c PT): the state of each PID, 
+ *   the list of non-free PCBs with the cursors of the information streams, and
+ *   the fields of a PCB reported by @c OpenInfo().
+ * - Spinlocks protect the free lists of PCBs, NTCBs and FCBs.
+ *
+ * When a thread needs more than one of these locks, it must lock them in the following
+ * order:
+ *
+ * 1. @c PCB.lock, of a process before that of its parent (and of @c init)
+ * 2. @c port_lock
+ * 3. @c PCB.files_lock
+ * 4. @c pipe_ctrl_block.mut
+ * 5. @c tables_lock
+ * 6. the free list spinlocks
+ *
+ * No lock may be held while calling @c FCB_decref(), because the @c Close() operation of a 
+ * stream locks the resources of the stream.
+ *
+ * The spinlock @c PCB.sleepers_lock is taken before the spinlocks of the wait queues 
+ * (see @c cancel_waits()).
+ */
+
 
 /**
- * @brief The kernel lock.
+ * @brief The lock of the process table.
  *
- * This mutex is used to protect most of the resources in kernel-space (the preemptive domain
- * of the kernel). 
+ * This reader-writer lock protects the state of each PID of the process table (@c PT), 
+ * and the fields of the PCB that are reported by @c OpenInfo(). Code that only scans the 
+ * table locks it for reading. A thread that changes these fields must lock it for writing.
+ */
+extern RWLock tables_lock;
+
+
+/**
+  @brief The mutex lock algorithms.
+
+  All algorithms implement the same @c Mutex API and are preemption-aware:
+  in the preemptive domain, a waiter that has spun for a while yields the core.
+
+  @see mutex_kind
+ */
+typedef enum {
+  MUTEX_TTAS,     /**< Test-and-test-and-set spinlock (the default) */
+  MUTEX_TICKET,   /**< Ticket lock: FIFO order, all waiters spin on the same word */
+  MUTEX_MCS       /**< MCS queue lock: FIFO order, each waiter spins on its own node */
+} Mutex_kind;
+
+/**
+  @brief The lock algorithm used by all mutexes.
+
+  This must not change while any mutex is in use. It is set by @c boot(),
+  from the environment variable @c TINYOS_MUTEX (one of "ttas", "ticket" 
+  or "mcs"), if it is defined.
+ */
+extern Mutex_kind mutex_kind;
+
+/** @brief The names of the mutex kinds, indexed by @c Mutex_kind */
+extern const char* mutex_kind_name[];
+
+/**
+  @brief A queue node for MCS locks.
+
+  A thread waiting for (or holding) an MCS lock owns a queue node. Nodes are
+  taken from a small per-core array in the non-preemptive domain (where no
+  other thread can run on the core) and from a per-thread array in the 
+  preemptive domain (where a waiter may be preempted by another thread
+  that needs a node on the same core).
  */
+typedef struct mcs_node {
+  struct mcs_node* next;   /**< The successor in the queue */
+  int locked;              /**< Cleared by the predecessor when handing over */
+  Mutex* lock;             /**< The lock this node is queued on, or NULL if free */
+} mcs_node;
 
-extern Mutex kernel_mutex;          /* lock for resource tables */
+/** @brief The number of MCS nodes per core and per thread (i.e., max. nesting). */
+#define MCS_NODES 8
+
+
+/**
+  @brief Cut short the waits of the threads of a killed process.
+
+  Every thread of process @c pcb that sleeps on a condition variable, a 
+  semaphore, a barrier or a sleeping mutex is removed from its wait queue and 
+  woken up, and its @c Cond_Wait, @c SleepMutex_Wait, @c Sem_P or 
+  @c Barrier_Wait fails, while its @c SleepMutex_Lock exits the thread.
+  This is called by @c KillGroup, after it marks the process as killed; a wait 
+  that starts after that does not sleep at all. A wait that is not killable 
+  (e.g., for a reader-writer lock, or for a sleeping mutex by a thread that 
+  holds other locks), or a wait of a thread that is exiting, is not affected.
+ */
+void cancel_waits(PCB* pcb);
+
+/**
+  @brief Wait on a condition variable, releasing a sleeping mutex, without being killed.
+
+  This is @c SleepMutex_Wait, except that a kill does not cut the wait short.
+  It is used where a killed thread must still wait for a short while, for
+  another thread that is not blocked on it.
+ */
+void SleepMutex_WaitUnkillable(SleepMutex* mx, CondVar* cv);
 
 
 /*
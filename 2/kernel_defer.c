@@ -0,0 +1,104 @@
+
+#include <assert.h>
+
+#include "kernel_sched.h"
+#include "kernel_defer.h"
+
+/**
+	@file kernel_defer.c
+
+	@brief The implementation of deferred cleanup work.
+  */
+
+/* Per-core state. The queue is only accessed by its own core, with
+   preemption off. The counters are read by other cores, by GetDeferInfo. */
+typedef struct {
+  defer_work* head;         /* The queue, in FIFO order */
+  defer_work* tail;
+  deferinfo info;           /* The counters */
+} defer_core;
+
+static defer_core DEFER[MAX_CORES];
+
+
+void initialize_defer()
+{
+  for(int c=0; c<MAX_CORES; c++)
+    DEFER[c] = (defer_core){ .head = NULL, .tail = NULL };
+}
+
+
+void defer_call(defer_work* work, void (*run)(defer_work*))
+{
+  int preempt = preempt_off;
+  defer_core* dc = & DEFER[cpu_core_id];
+
+  work->run = run;
+  work->next = NULL;
+  if(dc->tail) dc->tail->next = work; else dc->head = work;
+  dc->tail = work;
+
+  dc->info.queued++;
+  dc->info.backlog++;
+  if(dc->info.backlog > dc->info.peak) dc->info.peak = dc->info.backlog;
+
+  if(preempt) preempt_on;
+}
+
+
+/* Run up to n items of the queue of a core. Must be called with preemption off. */
+static unsigned long defer_process(defer_core* dc, unsigned long n)
+{
+  unsigned long done = 0;
+  while(dc->head && done < n) {
+    defer_work* work = dc->head;
+    dc->head = work->next;
+    if(dc->head == NULL) dc->tail = NULL;
+    dc->info.backlog--;
+    work->run(work);   /* This may free work */
+    done++;
+  }
+  dc->info.processed += done;
+  return done;
+}
+
+
+void defer_switch()
+{
+  defer_core* dc = & DEFER[cpu_core_id];
+  if(dc->info.backlog > DEFER_HIGH_WATER) {
+    defer_process(dc, DEFER_BATCH);
+    dc->info.switch_runs++;
+  }
+}
+
+
+void defer_idle()
+{
+  int preempt = preempt_off;
+  defer_core* dc = & DEFER[cpu_core_id];
+  if(dc->head) {
+    defer_process(dc, (unsigned long) -1);
+    dc->info.idle_runs++;
+  }
+  if(preempt) preempt_on;
+}
+
+
+int GetDeferInfo(deferinfo* info)
+{
+  if(info == NULL) return -1;
+
+  *info = (deferinfo){ 0 };
+  for(uint c=0; c<cpu_cores(); c++) {
+    deferinfo* ci = & DEFER[c].info;
+    info->queued += __atomic_load_n(& ci->queued, __ATOMIC_RELAXED);
+    info->processed += __atomic_load_n(& ci->processed, __ATOMIC_RELAXED);
+    info->backlog += __atomic_load_n(& ci->backlog, __ATOMIC_RELAXED);
+    unsigned long peak = __atomic_load_n(& ci->peak, __ATOMIC_RELAXED);
+    if(peak > info->peak) info->peak = peak;
+    info->idle_runs += __atomic_load_n(& ci->idle_runs, __ATOMIC_RELAXED);
+    info->switch_runs += __atomic_load_n(& ci->switch_runs, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
@@ -0,0 +1,82 @@
+#ifndef __KERNEL_DEFER_H
+#define __KERNEL_DEFER_H
+
+/**
+  @file kernel_defer.h
+  @brief TinyOS kernel: Deferred cleanup work.
+
+  @defgroup defer Deferred cleanup
+  @ingroup kernel
+  @brief Per-core queues of teardown work, taken off the critical paths.
+
+  Releasing the memory of a dead object (e.g., the stack of an exited thread,
+  or the argument buffer of a process) costs a call to the host allocator,
+  which is not needed for the kernel to make progress. Instead of doing it
+  inline, in a context switch or while holding a lock, the kernel queues a
+  @c defer_work item, embedded in the object, with @c defer_call().
+
+  Each core has its own queue, which is only accessed by its own core, with
+  preemption off. The queue is processed
+  - by the idle thread of the core, before it halts the core, and
+  - at a context switch (in @c gain()), in batches of @c DEFER_BATCH items,
+    when the backlog exceeds @c DEFER_HIGH_WATER, so that a core that is never
+    idle does not accumulate garbage.
+
+  Deferred work runs with preemption off, so it must not sleep or yield; e.g.,
+  closing a stream, which may block, cannot be deferred.
+
+  The queues keep counters of their activity, which are returned by
+  @c GetDeferInfo().
+
+  @{
+*/
+
+#include "kernel_cc.h"
+
+/** @brief The backlog that makes a context switch process deferred work */
+#define DEFER_HIGH_WATER 64
+
+/** @brief The number of items processed by a context switch */
+#define DEFER_BATCH 16
+
+/**
+  @brief A deferred work item.
+
+  This is embedded in the object to be cleaned up.
+ */
+typedef struct defer_work {
+  struct defer_work* next;                  /**< Next in the queue */
+  void (*run)(struct defer_work*);          /**< Called to do the work */
+} defer_work;
+
+
+/** @brief Initialize the queues. This is called at kernel startup. */
+void initialize_defer();
+
+/**
+  @brief Queue work on the current core.
+
+  At some later time, @c run is called with @c work, on the same core, with
+  preemption off. This may be called with or without locks held.
+ */
+void defer_call(defer_work* work, void (*run)(defer_work*));
+
+/**
+  @brief Process deferred work at a context switch.
+
+  This is called by @c gain(), with preemption off. It does nothing, unless
+  the backlog of the core exceeds @c DEFER_HIGH_WATER.
+ */
+void defer_switch();
+
+/**
+  @brief Process all the deferred work of the current core.
+
+  This is called by the idle thread, before it halts the core, and when
+  the core leaves the scheduler.
+ */
+void defer_idle();
+
+/** @} */
+
+#endif
@@ -116,7 +116,8 @@ int serial_read(void* dev, char *buf, unsigned int size)
       count++;
     }
     else if(count==0) {
-      Cond_Wait(&dcb->spinlock, &dcb->rx_ready,1);
+      if(! Cond_Wait(&dcb->spinlock, &dcb->rx_ready,1))
+        break;    /* The process was killed */
     }
     else
       break;
@@ -215,6 +216,7 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    Mutex_Register(& serial_dcb[i].spinlock, "serial");
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
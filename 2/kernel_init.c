@@ -9,6 +9,9 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_trace.h"
+#include "kernel_lockstat.h"
+#include "kernel_rcu.h"
 
 
 
@@ -39,6 +42,8 @@ void boot_tinyos_kernel()
     initialize_devices();
     initialize_files();
     initialize_scheduler();
+    initialize_rcu();
+    initialize_defer();
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -55,17 +60,64 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
+#ifdef SCHED_TRACE
+    sched_trace_dump();
+#endif
   }
 }
 
 
+/* Parse a table limit. There must be room for the scheduler and the init process. */
+static unsigned int boot_limit(const char* value, unsigned int max)
+{
+  long n = atol(value);
+  if(n < 2 || n > (long) max) {
+    fprintf(stderr, "Table limit %s out of range [2,%u], using %u\n", value, max, max);
+    return max;
+  }
+  return n;
+}
+
+
 void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
 {
   boot_rec.init_task = boot_task;
   boot_rec.argl = argl;
   boot_rec.args = args;
 
+  /* Select the mutex algorithm */
+  const char* kind = getenv("TINYOS_MUTEX");
+  if(kind != NULL) {
+    int k;
+    for(k=0; k<=MUTEX_MCS; k++)
+      if(strcmp(kind, mutex_kind_name[k])==0) break;
+    if(k<=MUTEX_MCS) 
+      mutex_kind = k;
+    else
+      fprintf(stderr, "Unknown TINYOS_MUTEX=%s, using %s\n", kind, mutex_kind_name[mutex_kind]);
+  }
+
+  /* The limits of the process and thread tables */
+  const char* limit = getenv("TINYOS_MAX_PROC");
+  max_proc = (limit != NULL) ? boot_limit(limit, MAX_PROC) : MAX_PROC;
+  limit = getenv("TINYOS_MAX_THREADS");
+  max_ntcb = (limit != NULL) ? boot_limit(limit, MAX_NTCB) : MAX_NTCB;
+
+  /* The memory limit of the initial task (0 for none) */
+  limit = getenv("TINYOS_MEM_LIMIT");
+  arena_default_limit = (limit != NULL) ? strtoul(limit, NULL, 0) : 0;
+
+  /* The lock contention profiler */
+  lockstat_init();
+
+  /* Wait morphing for sleeping mutexes */
+  const char* morph = getenv("TINYOS_WAIT_MORPHING");
+  if(morph != NULL)
+    cv_wait_morphing = (strcmp(morph, "0") != 0);
+
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+  finalize_processes();
 }
 
 
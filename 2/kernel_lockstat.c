@@ -0,0 +1,239 @@
+
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernel_sched.h"
+#include "kernel_proc.h"
+#include "kernel_streams.h"
+#include "kernel_lockstat.h"
+
+/**
+	@file kernel_lockstat.c
+
+	@brief The implementation of the lock contention profiler.
+  */
+
+int lockstat_enabled = 0;
+
+/* The key of a registered lock. A slot is taken by a CAS on 'lock', and
+   released by lockstat_unregister(), which leaves a tombstone, so that the
+   lookups of the locks after it in the table still find them. */
+typedef struct {
+  void* lock;             /* The lock, NULL for a free slot, or KEY_FREED */
+  const char* name;       /* The registered name, or NULL */
+  uint64_t since;         /* When the current holder took the lock */
+} lock_key;
+
+/* The counters of a lock, on one core */
+typedef struct {
+  unsigned long acquisitions;
+  unsigned long contended;
+  unsigned long spins;
+  unsigned long yields;
+  unsigned long hold;
+} lock_counters;
+
+/* The last slot collects the locks that are not registered, or that did
+   not fit in the table */
+#define LOCKSTAT_OTHER LOCKSTAT_SLOTS
+
+/* The tombstone of a released slot */
+#define KEY_FREED ((void*) 1)
+
+static lock_key KEYS[LOCKSTAT_SLOTS+1];
+static lock_counters COUNTERS[MAX_CORES][LOCKSTAT_SLOTS+1];
+
+
+static inline uint64_t lockstat_now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec*1000000000ull + t.tv_nsec;
+}
+
+
+void lockstat_init()
+{
+  const char* opt = getenv("TINYOS_LOCKSTAT");
+  lockstat_enabled = (opt != NULL && strcmp(opt, "0") != 0);
+
+  memset(KEYS, 0, sizeof(KEYS));
+  memset(COUNTERS, 0, sizeof(COUNTERS));
+  KEYS[LOCKSTAT_OTHER].name = "(other)";
+}
+
+
+static inline unsigned int lockstat_home(void* lock)
+{
+  uint64_t h = ((uintptr_t) lock >> 3) * 0x9E3779B97F4A7C15ull;
+  return (h >> 32) & (LOCKSTAT_SLOTS-1);
+}
+
+
+/* Find the slot of a registered lock, by open addressing */
+static unsigned int lockstat_slot(void* lock)
+{
+  unsigned int i = lockstat_home(lock);
+
+  for(int n=0; n<LOCKSTAT_SLOTS; n++, i = (i+1) & (LOCKSTAT_SLOTS-1)) {
+    void* key = __atomic_load_n(& KEYS[i].lock, __ATOMIC_ACQUIRE);
+    if(key == lock) return i;
+    if(key == NULL) break;
+  }
+  return LOCKSTAT_OTHER;
+}
+
+
+void lockstat_register(void* lock, const char* name)
+{
+  if(! lockstat_enabled) return;
+  unsigned int i = lockstat_slot(lock);
+
+  /* Take the first free slot (or tombstone) on the way of the lookups */
+  if(i == LOCKSTAT_OTHER) {
+    unsigned int j = lockstat_home(lock);
+    for(int n=0; n<LOCKSTAT_SLOTS; n++, j = (j+1) & (LOCKSTAT_SLOTS-1)) {
+      void* key = __atomic_load_n(& KEYS[j].lock, __ATOMIC_ACQUIRE);
+      if((key == NULL || key == KEY_FREED) &&
+        __atomic_compare_exchange_n(& KEYS[j].lock, &key, lock, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        i = j;
+        break;
+      }
+    }
+  }
+
+  if(i != LOCKSTAT_OTHER)
+    __atomic_store_n(& KEYS[i].name, name, __ATOMIC_RELEASE);
+}
+
+
+void lockstat_unregister(void* lock)
+{
+  if(! lockstat_enabled) return;
+  unsigned int i = lockstat_slot(lock);
+  if(i == LOCKSTAT_OTHER) return;
+
+  /* Clear the slot before it is released, so that the next lock in it
+     starts afresh */
+  for(int c=0; c<MAX_CORES; c++)
+    memset(& COUNTERS[c][i], 0, sizeof(lock_counters));
+  __atomic_store_n(& KEYS[i].name, NULL, __ATOMIC_RELAXED);
+  KEYS[i].since = 0;
+  __atomic_store_n(& KEYS[i].lock, KEY_FREED, __ATOMIC_RELEASE);
+}
+
+
+/* The thread may migrate between cores at any time, so the per-core
+   counters are updated atomically (but they are hardly ever shared). */
+#define COUNT(field, n) __atomic_add_fetch(& COUNTERS[cpu_core_id][i].field, (n), __ATOMIC_RELAXED)
+
+void lockstat_acquired(void* lock, lockstat_wait* w)
+{
+  unsigned int i = lockstat_slot(lock);
+
+  COUNT(acquisitions, 1);
+  if(w->contended) COUNT(contended, 1);
+  if(w->spins) COUNT(spins, w->spins);
+  if(w->yields) COUNT(yields, w->yields);
+
+  /* Only the holder writes 'since' */
+  if(i != LOCKSTAT_OTHER)
+    KEYS[i].since = lockstat_now();
+}
+
+
+void lockstat_released(void* lock)
+{
+  unsigned int i = lockstat_slot(lock);
+  if(i != LOCKSTAT_OTHER && KEYS[i].since != 0) {
+    COUNT(hold, lockstat_now() - KEYS[i].since);
+    KEYS[i].since = 0;
+  }
+}
+
+#undef COUNT
+
+
+/*
+	The lock information stream
+ */
+
+typedef struct {
+  unsigned int slot;      /* The next slot to report */
+} lockinfo_cb;
+
+
+static int lockinfo_read(void* this, char* buf, unsigned int size)
+{
+  lockinfo_cb* cb = (lockinfo_cb*) this;
+  if(size < sizeof(lockinfo)) return -1;
+
+  for( ; cb->slot <= LOCKSTAT_SLOTS; cb->slot++) {
+    unsigned int i = cb->slot;
+    void* lock = __atomic_load_n(& KEYS[i].lock, __ATOMIC_ACQUIRE);
+    if((lock == NULL || lock == KEY_FREED) && i != LOCKSTAT_OTHER) continue;
+
+    /* Merge the per-core counters */
+    lockinfo info;
+    memset(&info, 0, sizeof(info));
+    for(int c=0; c<MAX_CORES; c++) {
+      lock_counters* C = & COUNTERS[c][i];
+      info.acquisitions += __atomic_load_n(& C->acquisitions, __ATOMIC_RELAXED);
+      info.contended += __atomic_load_n(& C->contended, __ATOMIC_RELAXED);
+      info.spins += __atomic_load_n(& C->spins, __ATOMIC_RELAXED);
+      info.yields += __atomic_load_n(& C->yields, __ATOMIC_RELAXED);
+      info.hold_time += __atomic_load_n(& C->hold, __ATOMIC_RELAXED);
+    }
+    if(info.acquisitions == 0) continue;
+
+    info.lock = (uintptr_t) lock;
+    const char* name = __atomic_load_n(& KEYS[i].name, __ATOMIC_ACQUIRE);
+    if(name)
+      strncpy(info.name, name, LOCKINFO_NAME_SIZE-1);
+
+    cb->slot++;
+    memcpy(buf, &info, sizeof(info));
+    return sizeof(info);
+  }
+
+  return 0;
+}
+
+
+static int lockinfo_close(void* this)
+{
+  free(this);
+  return 0;
+}
+
+
+static file_ops lockinfo_fops = {
+  .Open = NULL,
+  .Read = lockinfo_read,
+  .Write = NULL,
+  .Close = lockinfo_close
+};
+
+
+Fid_t OpenLockInfo()
+{
+  Fid_t fid;
+  FCB* fcb;
+
+  PCB* curproc = CURPROC;
+  SleepMutex_Lock(& curproc->files_lock);
+
+  if(! FCB_reserve(1, &fid, &fcb)) {
+    SleepMutex_Unlock(& curproc->files_lock);
+    return NOFILE;
+  }
+
+  lockinfo_cb* cb = (lockinfo_cb*) xmalloc(sizeof(lockinfo_cb));
+  cb->slot = 0;
+  fcb->streamobj = cb;
+  fcb->streamfunc = &lockinfo_fops;
+
+  SleepMutex_Unlock(& curproc->files_lock);
+  return fid;
+}
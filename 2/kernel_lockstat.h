@@ -0,0 +1,76 @@
+#ifndef __KERNEL_LOCKSTAT_H
+#define __KERNEL_LOCKSTAT_H
+
+/**
+  @file kernel_lockstat.h
+  @brief TinyOS kernel: The lock contention profiler.
+
+  @defgroup lockstat Lock contention profiler
+  @ingroup kernel
+  @brief The lock contention profiler.
+
+  When the environment variable @c TINYOS_LOCKSTAT is set (to anything but "0")
+  at @c boot(), every @c Mutex and @c SleepMutex operation is recorded. For each
+  lock, identified by its address, the profiler counts
+  - the acquisitions,
+  - the contended acquisitions (those that had to wait),
+  - the spin iterations of the waiters,
+  - the forced yields (for a @c SleepMutex, the times a waiter slept), and
+  - the total time that the lock was held (in nsec).
+
+  A lock is profiled separately once it is given a name, by @c Mutex_Register
+  or @c SleepMutex_Register. The kernel names its own locks when it creates
+  them. A lock that goes away (e.g., the mutex of a pipe that is freed) must
+  release its entry, by @c Mutex_Unregister or @c SleepMutex_Unregister, or
+  else the entry is reported under the old name, for whatever lock is later
+  allocated at the same address.
+
+  The counters of each lock are kept separately on each core, so that
+  recording does not add contention of its own. They are merged when they
+  are read, through an information stream (see @c OpenLockInfo).
+
+  Registered locks are kept in a fixed-size hash table of @c LOCKSTAT_SLOTS
+  entries. The operations on the locks that are not registered, or that did
+  not fit in the table, are counted under a single entry, named "(other)".
+
+  @{
+*/
+
+#include "tinyos.h"
+
+/** @brief The number of locks that can be profiled separately (a power of 2). */
+#define LOCKSTAT_SLOTS 256
+
+/** @brief The waiting statistics of a single lock operation */
+typedef struct {
+  int contended;          /**< Non-zero if the lock was not free at the first attempt */
+  unsigned long spins;    /**< Spin iterations */
+  unsigned long yields;   /**< Forced yields (or sleeps) */
+} lockstat_wait;
+
+/** @brief Non-zero if the profiler is enabled. This is set by @c boot(). */
+extern int lockstat_enabled;
+
+/**
+  @brief Reset the profiler.
+
+  This is called by @c boot(), before any lock is used, and enables
+  the profiler according to @c TINYOS_LOCKSTAT.
+ */
+void lockstat_init(void);
+
+/** @brief Give a name to a lock (of either kind). */
+void lockstat_register(void* lock, const char* name);
+
+/** @brief Release the entry of a lock (of either kind), and its counters. */
+void lockstat_unregister(void* lock);
+
+/** @brief Record an acquisition, right after the lock was taken. */
+void lockstat_acquired(void* lock, lockstat_wait* w);
+
+/** @brief Record a release, right before the lock is released. */
+void lockstat_released(void* lock);
+
+/** @} */
+
+#endif
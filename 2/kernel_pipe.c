@@ -7,123 +7,115 @@
 #include "util.h"
 #include "kernel_proc.h"
 
-int read_first_flag=0;
-
 int dummy ()
 {
 	return -1 ; 
 }
 
+/*
+	The pipe is a monitor on pipe_ctrl->mut. Readers wait on data_var while the
+	buffer is empty, writers wait on space_var while it is full. The waiting
+	conditions depend only on the state of this pipe, so that any number of
+	pipes can be used concurrently.
+ */
 int pipe_read(void* ctrl_block, char *buf, unsigned int size) {
-	
-	read_first_flag=1;
 
 	pipe_ctrl_block *pipe_ctrl = (pipe_ctrl_block*) ctrl_block;
-	
-	preempt_on ; 
-	Mutex_Lock(& pipe_ctrl->mut);
+
+	SleepMutex_Lock(& pipe_ctrl->mut);
 
 	int count =  0; // Αριθμός των char που διαβάσαμε
 
 	if(pipe_ctrl->reader== NULL) {
-		Mutex_Unlock(& pipe_ctrl->mut);
-		preempt_off; 
-		read_first_flag=0;
+		SleepMutex_Unlock(& pipe_ctrl->mut);
 		return -1;
 	}
 
-	if (write_flag == 1) Cond_Broadcast(&(pipe_ctrl->space_var)) ; 
-
- 	if ((pipe_ctrl->numOfElements == 0) && (pipe_ctrl->writer !=NULL) && (write_flag == 0)) {// Οταν δεν υπάρχουν δεδομένα and write is open , η read θα κοιμάται
-	   Cond_Broadcast(&(pipe_ctrl->space_var)) ;
-	   Cond_Wait(&pipe_ctrl->mut, &pipe_ctrl->data_var,0);
-	}     
+	// Οταν δεν υπάρχουν δεδομένα and write is open , η read θα κοιμάται
+	while ((pipe_ctrl->numOfElements == 0) && (pipe_ctrl->writer !=NULL))
+		if (!SleepMutex_Wait(&pipe_ctrl->mut, &pipe_ctrl->data_var,0)) { // The process was killed
+			SleepMutex_Unlock(& pipe_ctrl->mut);
+			return -1;
+		}
 
-	if ((pipe_ctrl->numOfElements == 0 ) && (write_flag == 0)) goto end_read;
- 
-  	while(count<size) {
+	while((count<size) && (pipe_ctrl->numOfElements > 0)) {
 		buf[count] = pipe_ctrl->buffer[pipe_ctrl->head] ; // Μεταφέρουμε τα δεδομένα απο το pipe στο εξωτερικο buffer
 		count++; 
 
-  		// Υπολογισμός νέου head . numberofElements
-  		pipe_ctrl->head = (pipe_ctrl->head + 1 ) % BUF_SIZE ; // Εξασφαλίζει οτι το head είναι πάντα μέσα στα όρια του array
-
-    	if (pipe_ctrl->numOfElements >= 0 ) pipe_ctrl->numOfElements-- ; 
-
-    	if ( pipe_ctrl->numOfElements == 0 ) {
-    		if (write_flag == 1) { 
-				Cond_Broadcast(&(pipe_ctrl->space_var)) ; 
-				Cond_Wait(&pipe_ctrl->mut, &pipe_ctrl->data_var,0);
-			}
-		else goto end_read;
-		} 		
-
+		// Υπολογισμός νέου head . numberofElements
+		pipe_ctrl->head = (pipe_ctrl->head + 1 ) % BUF_SIZE ; // Εξασφαλίζει οτι το head είναι πάντα μέσα στα όρια του array
+		pipe_ctrl->numOfElements-- ; 
 	}
 
-	end_read:
-		Mutex_Unlock(& pipe_ctrl->mut);
-		preempt_off; 
-		read_first_flag=0;
-		return count; // Returns the number of bytes/chars it read
+	if (count > 0) Cond_Broadcast(&(pipe_ctrl->space_var)) ; 
+
+	SleepMutex_Unlock(& pipe_ctrl->mut);
+	return count; // Returns the number of bytes/chars it read
 }
 
 int pipe_write(void* ctrl_block, const char* buf, unsigned int size) { // like serial_write
 	
 	pipe_ctrl_block *pipe_ctrl = (pipe_ctrl_block*) ctrl_block;
 
-	preempt_on; 
-	Mutex_Lock(& pipe_ctrl->mut);
+	SleepMutex_Lock(& pipe_ctrl->mut);
 
 	int count =  0; // Αριθμός των char που γράψαμε
-	
-  	if (pipe_ctrl->writer == NULL) {
-		Mutex_Unlock(& pipe_ctrl->mut);
-		preempt_off; 
-		return -1;
-	}
-    if (pipe_ctrl->reader == NULL) {// Read end is closed, so write becomes unusable
-    	Mutex_Unlock(& pipe_ctrl->mut);
-		preempt_off; 
+
+	// Οταν δεν υπάρχει χώρος and read is open , η write θα κοιμάται
+	while ((pipe_ctrl->numOfElements == BUF_SIZE) && (pipe_ctrl->reader != NULL) && (pipe_ctrl->writer != NULL))
+		if (!SleepMutex_Wait(&pipe_ctrl->mut, &pipe_ctrl->space_var,0)) { // The process was killed
+			SleepMutex_Unlock(& pipe_ctrl->mut);
+			return -1;
+		}
+
+	if ((pipe_ctrl->writer == NULL) || (pipe_ctrl->reader == NULL)) {// Read end is closed, so write becomes unusable
+		SleepMutex_Unlock(& pipe_ctrl->mut);
 		return -1; 
-    }
+	}
 
-	while(count<size) {
+	while((count<size) && (pipe_ctrl->numOfElements < BUF_SIZE)) {
 		int write_position =  (pipe_ctrl->head + pipe_ctrl->numOfElements) % BUF_SIZE; 
-	    pipe_ctrl->buffer[write_position] = buf[count] ; // Μεταφέρουμε τα δεδομένα απο το εξωτερικο buffer στο pipe    
+		pipe_ctrl->buffer[write_position] = buf[count] ; // Μεταφέρουμε τα δεδομένα απο το εξωτερικο buffer στο pipe    
 		// Υπολογισμός νέου numberofElements
-    	pipe_ctrl->numOfElements++ ; 
- 		count++;     
-
-		if ((pipe_ctrl->numOfElements == BUF_SIZE) && (pipe_ctrl->reader!=NULL) && (count != size) ) { 
-			Cond_Broadcast (&(pipe_ctrl->data_var)) ; // Υπάρχουν δεδομένα για ανάγνωση , αρα ξυπνα την read
-			write_flag = 1 ; 
-    		Cond_Wait(&pipe_ctrl->mut, &pipe_ctrl->space_var,0);  
-    	}   
+		pipe_ctrl->numOfElements++ ; 
+		count++;     
 	}
-	write_flag = 0 ; 
-	if (read_first_flag) 
-		Cond_Broadcast (&(pipe_ctrl->data_var)); // Υπάρχουν δεδομένα για ανάγνωση , αρα ξυπνα την read
 
-	Mutex_Unlock(& pipe_ctrl->mut);
-	preempt_off; 
+	Cond_Broadcast (&(pipe_ctrl->data_var)); // Υπάρχουν δεδομένα για ανάγνωση , αρα ξυπνα την read
+
+	SleepMutex_Unlock(& pipe_ctrl->mut);
 	return count; // Returns the number of bytes/chars it wrote  
 }
 
+/* The two ends may be closed concurrently, so the pipe is freed by 
+   whoever closes last, after unlocking the monitor */
 int pipe_reader_close(void* ctrl_block) {
 
 	pipe_ctrl_block *pipe_ctrl = (pipe_ctrl_block*) ctrl_block;
+	SleepMutex_Lock(& pipe_ctrl->mut);
 	pipe_ctrl->reader = NULL ;
 	Cond_Broadcast (&(pipe_ctrl->space_var)) ;
-	if (pipe_ctrl->writer== NULL ) free (pipe_ctrl) ;
+	int last = (pipe_ctrl->writer== NULL);
+	SleepMutex_Unlock(& pipe_ctrl->mut);
+	if (last) {
+		SleepMutex_Unregister(& pipe_ctrl->mut);
+		free (pipe_ctrl) ;
+	}
 	return 0; 
 }
 
 int pipe_writer_close(void* ctrl_block) {
 
 	pipe_ctrl_block *pipe_ctrl = (pipe_ctrl_block*) ctrl_block;
+	SleepMutex_Lock(& pipe_ctrl->mut);
 	pipe_ctrl->writer = NULL ;	
-	if (pipe_ctrl->reader== NULL ) free (pipe_ctrl) ;
 	Cond_Broadcast (&(pipe_ctrl->data_var)) ;
+	int last = (pipe_ctrl->reader== NULL);
+	SleepMutex_Unlock(& pipe_ctrl->mut);
+	if (last) {
+		SleepMutex_Unregister(& pipe_ctrl->mut);
+		free (pipe_ctrl) ;
+	}
 	return 0; 
 }
 
@@ -147,10 +139,11 @@ int Pipe(pipe_t* pipe) {
 	FCB* fcb_reader;
 	FCB* fcb_writer;
 	
-	Mutex_Lock(&kernel_mutex);
+	PCB* curproc = CURPROC;
+	SleepMutex_Lock(& curproc->files_lock);
 
 	if((!FCB_reserve(1, &pipe->read, &fcb_reader)) | (!FCB_reserve(1, &pipe->write, &fcb_writer))) {// If the fids are exhausted 
-		Mutex_Unlock(&kernel_mutex);
+		SleepMutex_Unlock(& curproc->files_lock);
 		return -1;
 	}
 	else {
@@ -171,12 +164,13 @@ int Pipe(pipe_t* pipe) {
 	    newPipe->data_var = COND_INIT; 
 	    newPipe->space_var = COND_INIT; 
 
-	    newPipe->mut = MUTEX_INIT ; 
+	    newPipe->mut = SLEEPMUTEX_INIT ; 
+	    SleepMutex_Register(& newPipe->mut, "pipe");
 
 	    newPipe->head = 0;
 	    newPipe->numOfElements = 0 ; 
 	   
-	    Mutex_Unlock(&kernel_mutex);	
+	    SleepMutex_Unlock(& curproc->files_lock);	
 
 	    return 0 ; 
 
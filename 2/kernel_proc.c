@@ -16,21 +16,63 @@
 
  */
 
-/* The process table */
-PCB PT[MAX_PROC];
+/* 
+  The process table is segmented: the PCBs are allocated in chunks of PT_CHUNK,
+  when the free list runs out, and PT is the directory of the chunks. The PCB of
+  a PID is found at PT[pid/PT_CHUNK][pid%PT_CHUNK]. The NTCBs are allocated in
+  chunks in the same way. The chunks are released at shutdown.
+ */
+#define PT_CHUNK 64
+#define NTT_CHUNK 128
+
+static PCB* PT[MAX_PROC/PT_CHUNK];
+static NTCB* NTT[MAX_NTCB/NTT_CHUNK];
+
+/* The number of allocated chunks. They are updated with the free list locks held. */
+static unsigned int pt_chunks, ntt_chunks;
 
-NTCB NTT[MAX_NTCB];
+unsigned int max_proc = MAX_PROC, max_ntcb = MAX_NTCB;
 
 unsigned int process_count, nt_count;
 
+/* 
+  The non-free PCBs (alive or zombie), in order of creation, linked by
+  live_node. It is protected by tables_lock.
+ */
+static rlnode live_pcbs;
+
+/*
+  The position of an information stream in live_pcbs. The stream reads
+  live_pcbs with tables_lock locked for reading, and it is the only reader
+  that moves its cursor. A PCB is released with tables_lock locked for
+  writing, and then the cursors that point to it are moved back to its
+  predecessor, so that the PCB can leave the list under them.
+ */
+typedef struct info_cursor {
+  rlnode node;      /* In info_cursors */
+  rlnode* last;     /* The last node reported, or live_pcbs */
+} info_cursor;
+
+/* The cursors of the open information streams, protected by tables_lock */
+static rlnode info_cursors;
+
+/* The PCB of a PID, in whatever state, or NULL if its chunk is not allocated */
+static inline PCB* pcb_slot(Pid_t pid)
+{
+  if(pid<0 || pid>=MAX_PROC) return NULL;
+  PCB* chunk = __atomic_load_n(& PT[pid/PT_CHUNK], __ATOMIC_ACQUIRE);
+  return chunk==NULL ? NULL : chunk + pid%PT_CHUNK;
+}
+
 PCB* get_pcb(Pid_t pid)
 {
-  return PT[pid].pstate==FREE ? NULL : &PT[pid];
+  PCB* pcb = pcb_slot(pid);
+  return (pcb==NULL || pcb->pstate==FREE) ? NULL : pcb;
 }
 
 Pid_t get_pid(PCB* pcb)
 {
-  return pcb==NULL ? NOPROC : pcb-PT;
+  return pcb==NULL ? NOPROC : pcb->pid;
 }
 
 /* Initialize a PCB */
@@ -39,18 +81,28 @@ static inline void initialize_PCB(PCB* pcb)
   pcb->pstate = FREE;
   pcb->argl = 0;
   pcb->args = NULL;
+  pcb->argbuf = NULL;
+  pcb->detached = 0;
+  rlnode_init(& pcb->live_node, pcb);
+  arena_init(& pcb->mem, 0);
 
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
+  rlnode_init(& pcb->detached_list, NULL);
   rlnode_init(& pcb->children_node, pcb);
   rlnode_init(& pcb->exited_node, pcb);
   pcb->child_exit = COND_INIT;
   rlnode_init(& pcb->NT, NULL);
   pcb->ntcb_count=0;
   pcb->active_thread_count=0;
+  pcb->thread_exit = COND_INIT;
+  pcb->lock = SLEEPMUTEX_INIT;
+  pcb->files_lock = SLEEPMUTEX_INIT;
+  rlnode_init(& pcb->sleepers, NULL);
+  pcb->sleepers_lock = MUTEX_INIT;
 }
 
 /* Initialize a NTCB */
@@ -62,102 +114,172 @@ static inline void initialize_NTCB(NTCB* ntcb)
   ntcb->ntcb_thread = NULL;     
   ntcb->join_var=COND_INIT;
   ntcb->flag_detach=0;
+  ntcb->exitval=0;
+  ntcb->exited=0;
+  ntcb->joiners=0;
 }
 
 static PCB* pcb_freelist;
 static NTCB* ntcb_freelist;
 
-void initialize_processes()
+/* Spinlocks for the free lists */
+static Mutex pcb_freelist_lock = MUTEX_INIT;
+static Mutex ntcb_freelist_lock = MUTEX_INIT;
+
+/* 
+  Allocate the next chunk of PCBs, and add its PIDs below max_proc
+  to the free list, in increasing order. Must be called with
+  pcb_freelist_lock held.
+ */
+static void grow_PT()
 {
-  /* initialize the PCBs */
-  for(Pid_t p=0; p<MAX_PROC; p++) {
-    initialize_PCB(&PT[p]);
+  if(pt_chunks*PT_CHUNK >= max_proc) return;
+
+  PCB* chunk = xmalloc(PT_CHUNK*sizeof(PCB));
+  Pid_t base = pt_chunks*PT_CHUNK;
+  for(int i=PT_CHUNK-1; i>=0; i--) {
+    initialize_PCB(&chunk[i]);
+    chunk[i].pid = base+i;
+    if(base+i < max_proc) {
+      chunk[i].parent = pcb_freelist;
+      pcb_freelist = &chunk[i];
+    }
   }
+  __atomic_store_n(& PT[pt_chunks], chunk, __ATOMIC_RELEASE);
+  pt_chunks++;
+}
 
-  /* Initialize the NTCBs */
-  for(Pid_t i=0; i<MAX_NTCB; i++) {
-    initialize_NTCB(&NTT[i]);
-  }
-  
-  /* Use the parent field to build a free list */
-  PCB* pcbiter;
-  pcb_freelist = NULL;
-  for(pcbiter = PT+MAX_PROC; pcbiter!=PT; ) {
-    --pcbiter;
-    pcbiter->parent = pcb_freelist;
-    pcb_freelist = pcbiter;
+/* Allocate the next chunk of NTCBs. Must be called with ntcb_freelist_lock held. */
+static void grow_NTT()
+{
+  if(ntt_chunks*NTT_CHUNK >= max_ntcb) return;
+
+  NTCB* chunk = xmalloc(NTT_CHUNK*sizeof(NTCB));
+  unsigned int base = ntt_chunks*NTT_CHUNK;
+  for(int i=NTT_CHUNK-1; i>=0; i--) {
+    initialize_NTCB(&chunk[i]);
+    if(base+i < max_ntcb) {
+      chunk[i].ntcb_next = ntcb_freelist;
+      ntcb_freelist = &chunk[i];
+    }
   }
+  NTT[ntt_chunks++] = chunk;
+}
 
+void initialize_processes()
+{
+  /* The chunks are allocated on demand */
+  pcb_freelist = NULL;
+  pt_chunks = 0;
   process_count = 0;
+  rlnode_init(& live_pcbs, NULL);
+  rlnode_init(& info_cursors, NULL);
 
-  /* Use the ntcb_next field to build a free list */
-  NTCB* ntcbiter;
   ntcb_freelist = NULL;
-  for(ntcbiter = NTT+MAX_NTCB; ntcbiter!=NTT; ) {
-    --ntcbiter;
-    ntcbiter->ntcb_next = ntcb_freelist;
-    ntcb_freelist = ntcbiter;
-  }
-
+  ntt_chunks = 0;
   nt_count = 0;
 
+  Mutex_Register(& pcb_freelist_lock, "pcb_freelist");
+  Mutex_Register(& ntcb_freelist_lock, "ntcb_freelist");
+  Mutex_Register(& tables_lock.lock, "tables_lock");
+
   /* Execute a null "idle" process */
   if(Exec(NULL,0,NULL)!=0)
     FATAL("The scheduler process does not have pid==0");
 }
 
 
+/* The largest number of processes created or reaped under one acquisition of the locks */
+#define PCB_BATCH 64
+
 /*
-  Must be called with kernel_mutex held
+  Acquire up to n PCBs, and return how many were acquired.
+  Must be called with tables_lock locked for writing
 */
-PCB* acquire_PCB()
+static int acquire_PCBs(PCB* pcbs[], int n)
 {
-  PCB* pcb = NULL;
-
-  if(pcb_freelist != NULL) {
-    pcb = pcb_freelist;
+  int k = 0;
+
+  Mutex_Lock(& pcb_freelist_lock);
+  while(k < n) {
+    if(pcb_freelist == NULL)
+      grow_PT();
+    if(pcb_freelist == NULL)
+      break;
+    PCB* pcb = pcb_freelist;
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
-    process_count++;
+    rlist_push_back(& live_pcbs, & pcb->live_node);
+    pcbs[k++] = pcb;
   }
+  process_count += k;
+  Mutex_Unlock(& pcb_freelist_lock);
 
-  return pcb;
+  return k;
 }
 
+
 /*
-  Must be called with kernel_mutex held
+  Must be called with tables_lock locked for writing
 */
-void release_PCB(PCB* pcb)
+static void release_PCBs(PCB* pcbs[], int n)
 {
-  pcb->pstate = FREE;
-  pcb->parent = pcb_freelist;
-  pcb_freelist = pcb;
-  process_count--;
+  Mutex_Lock(& pcb_freelist_lock);
+  for(int k=0; k<n; k++) {
+    PCB* pcb = pcbs[k];
+    pcb->pstate = FREE;
+    for(rlnode* c = info_cursors.next; c != &info_cursors; c = c->next) {
+      info_cursor* cursor = c->obj;
+      if(cursor->last == & pcb->live_node) cursor->last = pcb->live_node.prev;
+    }
+    rlist_remove(& pcb->live_node);
+    pcb->parent = pcb_freelist;
+    pcb_freelist = pcb;
+  }
+  process_count -= n;
+  Mutex_Unlock(& pcb_freelist_lock);
 }
 
-/*
-  Must be called with kernel_mutex held
-*/
 NTCB* acquire_NTCB() {
 
   NTCB* ntcb = NULL;
+  Mutex_Lock(& ntcb_freelist_lock);
+  if(ntcb_freelist == NULL)
+    grow_NTT();
   if(ntcb_freelist != NULL) {
     ntcb = ntcb_freelist;
     ntcb_freelist = ntcb_freelist->ntcb_next;
     nt_count++;
   }
+  Mutex_Unlock(& ntcb_freelist_lock);
 
   return ntcb;
 }
 
-/*
-  Must be called with kernel_mutex held
-*/
 void release_NTCB(NTCB* ntcb) {
 
+  Mutex_Lock(& ntcb_freelist_lock);
   ntcb->ntcb_next = ntcb_freelist;
   ntcb_freelist = ntcb;
   nt_count--;
+  Mutex_Unlock(& ntcb_freelist_lock);
+}
+
+void finalize_processes()
+{
+  for(unsigned int c=0; c<pt_chunks; c++) {
+    free(PT[c]);
+    PT[c] = NULL;
+  }
+  pt_chunks = 0;
+  pcb_freelist = NULL;
+
+  for(unsigned int c=0; c<ntt_chunks; c++) {
+    free(NTT[c]);
+    NTT[c] = NULL;
+  }
+  ntt_chunks = 0;
+  ntcb_freelist = NULL;
 }
 
 /*
@@ -166,6 +288,26 @@ void release_NTCB(NTCB* ntcb) {
  *
  */
 
+/*
+  The end of the main thread: wait for the other threads and exit the process.
+ */
+void main_thread_exit(int exitval)
+{
+  /* The thread is leaving: it may not be killed any more */
+  kernel_enter();
+  CURTHREAD->exiting = 1;
+
+  /* Wait for the other threads. We must not touch their TCBs, which 
+     are released as soon as they exit. */
+  PCB* curproc = CURPROC;
+  SleepMutex_Lock(& curproc->lock);
+  while (curproc->active_thread_count>0)
+    SleepMutex_Wait(& curproc->lock, &curproc->thread_exit, 0);
+  SleepMutex_Unlock(& curproc->lock);
+  
+  Exit(exitval);
+}
+
 /*
 	This function is provided as an argument to spawn,
 	to execute the main thread of a process.
@@ -179,16 +321,7 @@ void start_main_thread()
   void* args = CURPROC->args;
 
   exitval = call(argl,args);
-  
-  while (CURPROC->active_thread_count>0) {
-    rlnode* node=rlist_pop_back(& CURPROC->NT);
-    rlist_push_back(& CURPROC->NT,node);
-    if(node->ntcb->ntcb_thread->state != EXITED)
-      ThreadJoin((Tid_t)node->ntcb->ntcb_thread,&node->ntcb->exitval);
-    release_NTCB(node->ntcb);
-  }
-  
-  Exit(exitval);
+  main_thread_exit(exitval);
 }
 
 void start_thread() {   
@@ -199,79 +332,257 @@ void start_thread() {
   void* args = CURTHREAD->owner_ntcb->args;
 
   exitval = call(argl,args);
-  Mutex_Unlock(&kernel_mutex);
   ThreadExit(exitval);
 }
 
 
 /*
-	System call to create a new process.
+	Shared argument buffers
  */
-Pid_t Exec(Task call, int argl, void* args)
+
+/* A shared buffer is preceded by the deferred work that frees it */
+static void free_args_work(defer_work* work)
 {
-  PCB *curproc, *newproc;
-  
-  Mutex_Lock(&kernel_mutex);
+  free(work);
+}
 
-  /* The new process PCB */
-  newproc = acquire_PCB();
+SharedArgs* SharedArgs_Create(int argl, const void* args)
+{
+  defer_work* work = xmalloc(sizeof(defer_work) + sizeof(SharedArgs) + argl);
+  SharedArgs* sargs = (SharedArgs*) (work + 1);
+  sargs->refcount = 1;
+  sargs->argl = argl;
+  if(args != NULL)
+    memcpy(sargs->args, args, argl);
+  return sargs;
+}
 
-  if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
+static inline void SharedArgs_Incref(SharedArgs* sargs)
+{
+  __atomic_add_fetch(& sargs->refcount, 1, __ATOMIC_RELAXED);
+}
 
-  if(get_pid(newproc)<=1) {
-    /* Processes with pid<=1 (the scheduler and the init process) 
-       are parentless and are treated specially. */
-    newproc->parent = NULL;
-  }
-  else
-  {
-    /* Inherit parent */
-    curproc = CURPROC;
+void SharedArgs_Release(SharedArgs* sargs)
+{
+  if(__atomic_sub_fetch(& sargs->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    defer_call(((defer_work*) sargs) - 1, free_args_work);
+}
 
-    /* Add new process to the parent's child list */
-    newproc->parent = curproc;
-    rlist_push_front(& curproc->children_list, & newproc->children_node);
 
-    if (!accept_flag) {
-    /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i]) 
-          FCB_incref(newproc->FIDT[i]);
+/*
+  Create up to n (<= PCB_BATCH) new processes, and return how many were 
+  created. The arguments of process i are taken from sargs[i], or, if it is
+  NULL, they are (argl, NULL). If detached is non-zero, the processes are
+  created detached. The processes inherit the file table of the caller, or
+  fidt, if it is not NULL.
+ */
+static int exec_batch(Task call, int n, int argl, SharedArgs* sargs[], Pid_t pids[], int detached,
+                      FCB* fidt[])
+{
+  PCB* newproc[PCB_BATCH];
+  PCB* curproc = NULL;
+
+  /* From the moment the new PCBs are taken until they are linked to 
+     their parent, the caller must not be killed (there is no thread
+     at boot) */
+  int section = (CURTHREAD != NULL);
+  if(section) kernel_enter();
+
+  RWLock_WriteLock(& tables_lock);
+
+  /* The new process PCBs */
+  n = acquire_PCBs(newproc, n);
+
+  /* Processes with pid<=1 (the scheduler and the init process) 
+     are parentless and are treated specially. They are created
+     one at a time, at boot. */
+  if(n > 0 && get_pid(newproc[0]) > 1)
+    curproc = CURPROC;
+
+  for(int k=0; k<n; k++) {
+    PCB* pcb = newproc[k];
+    pcb->parent = curproc;
+    pcb->detached = detached;
+
+    /* The children of a killed process are killed too, since they may 
+       have been created after KillGroup passed over their parent. */
+    if(curproc != NULL) {
+      pcb->pgid = curproc->pgid;
+      pcb->killed = curproc->killed;
+    } else {
+      pcb->pgid = get_pid(pcb);
+      pcb->killed = 0;
     }
+    pcb->exit_requested = 0;
+    memset(& pcb->usage, 0, sizeof(usageinfo));
+    arena_init(& pcb->mem, (curproc != NULL) ? curproc->mem.info.limit : arena_default_limit);
+
+    /* Set the main thread's function */
+    pcb->main_task = call;
+    if(sargs[k] != NULL) {
+      SharedArgs_Incref(sargs[k]);
+      pcb->argbuf = sargs[k];
+      pcb->argl = sargs[k]->argl;
+      pcb->args = sargs[k]->args;
+    } else {
+      pcb->argl = argl;
+      pcb->args = NULL;
+    }
+    pids[k] = get_pid(pcb);
   }
+
+  RWLock_WriteUnlock(& tables_lock);
+
+  if(n == 0) {  /* We have run out of PIDs! */
+    if(section) kernel_leave();
+    return 0;
   }
 
+  for(int k=0; k<n; k++) {
+    SleepMutex_Register(& newproc[k]->lock, "pcb.lock");
+    SleepMutex_Register(& newproc[k]->files_lock, "pcb.files_lock");
+  }
 
-  /* Set the main thread's function */
-  newproc->main_task = call;
+  if(curproc != NULL) {
+    /* Add the new processes to the parent's child list */
+    rlnode* list = detached ? & curproc->detached_list : & curproc->children_list;
+    SleepMutex_Lock(& curproc->lock);
+    for(int k=0; k<n; k++)
+      rlist_push_front(list, & newproc[k]->children_node);
+    SleepMutex_Unlock(& curproc->lock);
 
-  /* Copy the arguments to new storage, owned by the new process */
-  newproc->argl = argl;
-  if(args!=NULL) {
-    newproc->args = malloc(argl);
-    memcpy(newproc->args, args, argl);
+    if (!accept_flag) {
+      /* Inherit file streams from parent. A table built by fidt_build is 
+         private to the caller, and needs no lock. */
+      if(fidt == NULL) SleepMutex_Lock(& curproc->files_lock);
+      FCB** src = (fidt != NULL) ? fidt : curproc->FIDT;
+      for(int i=0; i<MAX_FILEID; i++) {
+        FCB* fcb = src[i];
+        for(int k=0; k<n; k++) {
+          newproc[k]->FIDT[i] = fcb;
+          if(fcb) 
+            FCB_incref(fcb);
+        }
+      }
+      if(fidt == NULL) SleepMutex_Unlock(& curproc->files_lock);
+    }
   }
-  else
-    newproc->args=NULL;
   
   /* 
-    Create and wake up the thread for the main function. This must be the last thing
-    we do, because once we wakeup the new thread it may run! so we need to have finished
+    Create and wake up the threads for the main function. This must be the last thing
+    we do, because once we wakeup a new thread it may run! so we need to have finished
     the initialization of the PCB.
    */
   if(call != NULL) {
-   
-    
+    TCB* threads[PCB_BATCH];
+    for(int k=0; k<n; k++)
+      threads[k] = newproc[k]->main_thread = spawn_thread(newproc[k], start_main_thread);
+    wakeup_spawned(threads, n);
+  }
+
+  if(section) kernel_leave();
+  return n;
+}
 
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
-    wakeup(newproc->main_thread);
+
+/*
+	Create a single process, with a private copy of its arguments.
+ */
+static Pid_t exec_one(Task call, int argl, void* args, int detached, FCB* fidt[])
+{
+  Pid_t pid;
+  SharedArgs* sargs = NULL;
+
+  kill_point();
+
+  /* Copy the arguments to a buffer owned by the new process */
+  if(args != NULL)
+    sargs = SharedArgs_Create(argl, args);
+
+  if(! exec_batch(call, 1, argl, &sargs, &pid, detached, fidt))
+    pid = NOPROC;
+
+  if(sargs != NULL)
+    SharedArgs_Release(sargs);
+  return pid;
+}
+
+
+/*
+	System call to create a new process.
+ */
+Pid_t Exec(Task call, int argl, void* args)
+{
+  return exec_one(call, argl, args, 0, NULL);
+}
+
+
+Pid_t ExecWithFiles(Task call, int argl, void* args, const file_action* actions)
+{
+  FCB* fidt[MAX_FILEID];
+  Pid_t pid = NOPROC;
+
+  kill_point();
+  kernel_enter();
+  if(fidt_build(actions, fidt) == 0) {
+    pid = exec_one(call, argl, args, 0, fidt);
+    fidt_release(fidt);
   }
+  kernel_leave();
+  return pid;
+}
 
 
-finish:
-  Mutex_Unlock(&kernel_mutex);
-  return get_pid(newproc);
+Pid_t ExecDetached(Task call, int argl, void* args)
+{
+  return exec_one(call, argl, args, 1, NULL);
+}
+
+
+Pid_t ExecShared(Task call, SharedArgs* sargs)
+{
+  Pid_t pid;
+  kill_point();
+  return exec_batch(call, 1, 0, &sargs, &pid, 0, NULL) ? pid : NOPROC;
+}
+
+
+int ExecMany(Task call, int n, int argl, void* args[], Pid_t pids[])
+{
+  int created = 0;
+  kill_point();
+
+  while(created < n) {
+    int batch = (n-created < PCB_BATCH) ? n-created : PCB_BATCH;
+    SharedArgs* sargs[PCB_BATCH];
+    Pid_t batch_pids[PCB_BATCH];
+
+    /* Copy the arguments. As with Exec, each process gets its own copy; 
+       sharing one is up to the caller (see ExecShared). */
+    for(int k=0; k<batch; k++) {
+      void* a = (args != NULL) ? args[created+k] : NULL;
+      sargs[k] = (a == NULL) ? NULL : SharedArgs_Create(argl, a);
+    }
+
+    int k = exec_batch(call, batch, argl, sargs, batch_pids, 0, NULL);
+
+    for(int i=0; i<batch; i++)
+      if(sargs[i] != NULL)
+        SharedArgs_Release(sargs[i]);
+
+    if(pids != NULL)
+      for(int i=0; i<k; i++)
+        pids[created+i] = batch_pids[i];
+    created += k;
+
+    if(k < batch) break;  /* Out of PIDs */
+  }
+
+  if(pids != NULL)
+    for(int i=created; i<n; i++)
+      pids[i] = NOPROC;
+
+  return created;
 }
 
 
@@ -284,221 +595,544 @@ Pid_t GetPid()
 
 Pid_t GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  /* The parent changes if it exits */
+  RWLock_ReadLock(& tables_lock);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  RWLock_ReadUnlock(& tables_lock);
+  return ppid;
 }
 
 
-static void cleanup_zombie(PCB* pcb, int* status)
+int GetUsage(int who, usageinfo* usage)
 {
-  if(status != NULL)
-    *status = pcb->exitval;
+  if(usage == NULL) return -1;
+
+  switch(who) {
+    case USAGE_THREAD: {
+      /* Our counters change when we are switched out */
+      int preempt = preempt_off;
+      *usage = CURTHREAD->usage;
+      if(preempt) preempt_on;
+      return 0;
+    }
+    case USAGE_PROCESS: {
+      /* Each counter is read atomically, but not all of them at once */
+      usageinfo* u = & CURPROC->usage;
+      usage->user_time = __atomic_load_n(& u->user_time, __ATOMIC_RELAXED);
+      usage->kernel_time = __atomic_load_n(& u->kernel_time, __ATOMIC_RELAXED);
+      usage->switches = __atomic_load_n(& u->switches, __ATOMIC_RELAXED);
+      usage->preemptions = __atomic_load_n(& u->preemptions, __ATOMIC_RELAXED);
+      usage->wakeups = __atomic_load_n(& u->wakeups, __ATOMIC_RELAXED);
+      usage->bytes_read = __atomic_load_n(& u->bytes_read, __ATOMIC_RELAXED);
+      usage->bytes_written = __atomic_load_n(& u->bytes_written, __ATOMIC_RELAXED);
+      usage->stack_peak = __atomic_load_n(& u->stack_peak, __ATOMIC_RELAXED);
+      return 0;
+    }
+    default:
+      return -1;
+  }
+}
+
 
-  rlist_remove(& pcb->children_node);
-  rlist_remove(& pcb->exited_node);
+/*
+	Process groups
+ */
+Pid_t GetPgid(Pid_t pid)
+{
+  if(pid == NOPROC) return CURPROC->pgid;
 
-  release_PCB(pcb);
+  RWLock_ReadLock(& tables_lock);
+  PCB* pcb = get_pcb(pid);
+  Pid_t pgid = (pcb != NULL && pcb->pstate == ALIVE) ? pcb->pgid : NOPROC;
+  RWLock_ReadUnlock(& tables_lock);
+  return pgid;
 }
 
 
-static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
+int SetPgid(Pid_t pid, Pid_t pgid)
 {
-  Mutex_Lock(& kernel_mutex);
+  int ret = -1;
+  PCB* curproc = CURPROC;
 
-  /* Legality checks */
-  if((cpid<0) || (cpid>=MAX_PROC)) {
-    cpid = NOPROC;
+  if(pid == NOPROC) pid = get_pid(curproc);
+  if(pgid == NOPROC) pgid = pid;
+
+  /* The parent lock keeps the child from being reaped */
+  SleepMutex_Lock(& curproc->lock);
+  RWLock_WriteLock(& tables_lock);
+
+  PCB* pcb = get_pcb(pid);
+  if(pcb == NULL || pcb->pstate != ALIVE || pid <= 1)
+    goto finish;
+  if(pcb != curproc && pcb->parent != curproc)
     goto finish;
+
+  /* Join a new group, or the group of a live leader, or our own */
+  PCB* leader = get_pcb(pgid);
+  if(pgid != pid && pgid != curproc->pgid && 
+     (leader == NULL || leader->pstate != ALIVE || leader->pgid != pgid))
+    goto finish;
+
+  pcb->pgid = pgid;
+  ret = 0;
+
+finish:
+  RWLock_WriteUnlock(& tables_lock);
+  SleepMutex_Unlock(& curproc->lock);
+  return ret;
+}
+
+
+int KillGroup(Pid_t pgid)
+{
+  if(pgid < 1) return -1;
+
+  /* Mark every live process of the group in one pass, and wake up their 
+     sleeping threads. The threads exit at the next kill point, and the 
+     processes become zombies. */
+  int killed = 0;
+  RWLock_ReadLock(& tables_lock);
+  for(rlnode* node = live_pcbs.next; node != &live_pcbs; node = node->next) {
+    PCB* pcb = node->pcb;
+    if(pcb->pid > 1 && pcb->pstate == ALIVE && pcb->pgid == pgid) {
+      __atomic_store_n(& pcb->killed, 1, __ATOMIC_RELAXED);
+      cancel_waits(pcb);
+      killed++;
+    }
+  }
+  RWLock_ReadUnlock(& tables_lock);
+
+  return killed ? killed : -1;
+}
+
+
+void kill_current_thread()
+{
+  /* The thread is leaving: it may not be killed again */
+  kernel_enter();
+  if(CURTHREAD == CURPROC->main_thread)
+    main_thread_exit(-1);
+  else
+    ThreadExit(-1);
+}
+
+
+/*
+  Release up to n (<= PCB_BATCH) zombie children, storing their pids and exit
+  values (if the arrays are not NULL). Must be called with the parent's lock held.
+*/
+static void cleanup_zombies(PCB* zombies[], int n, Pid_t pids[], int status[])
+{
+  for(int k=0; k<n; k++) {
+    PCB* pcb = zombies[k];
+    if(pids != NULL) pids[k] = get_pid(pcb);
+    if(status != NULL) status[k] = pcb->exitval;
+
+    rlist_remove(& pcb->children_node);
+    rlist_remove(& pcb->exited_node);
   }
 
+  RWLock_WriteLock(& tables_lock);
+  release_PCBs(zombies, n);
+  RWLock_WriteUnlock(& tables_lock);
+}
+
+
+static Pid_t wait_for_specific_child(Pid_t cpid, int* status, int options)
+{
+  /* Legality checks */
+  if((cpid<0) || (cpid>=(Pid_t) max_proc))
+    return NOPROC;
+
   PCB* parent = CURPROC;
+  SleepMutex_Lock(& parent->lock);
+
+  /* Once it is found to be our child, it stays so while we hold our lock */
+  RWLock_ReadLock(& tables_lock);
   PCB* child = get_pcb(cpid);
-  if( child == NULL || child->parent != parent)
+  int mine = (child != NULL && child->parent == parent && ! child->detached);
+  RWLock_ReadUnlock(& tables_lock);
+  if(! mine)
   {
     cpid = NOPROC;
     goto finish;
   }
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
+  if(child->pstate == ALIVE && (options & WNOHANG)) {
+    cpid = 0;
+    goto finish;
+  }
   while(child->pstate == ALIVE)
-    Cond_Wait(& kernel_mutex, & parent->child_exit,0);
+    SleepMutex_Wait(& parent->lock, & parent->child_exit,0);
   
-  cleanup_zombie(child, status);
+  cleanup_zombies(&child, 1, NULL, status);
   
 finish:
-  Mutex_Unlock(& kernel_mutex);
+  SleepMutex_Unlock(& parent->lock);
   return cpid;
 }
 
 
-static Pid_t wait_for_any_child(int* status)
+/*
+  Reap up to max exited children, waiting for one if there are none and
+  WNOHANG is not given. Return the number reaped, or -1 if there are no children.
+ */
+static int wait_for_children(Pid_t pids[], int status[], int max, int options)
 {
-  Pid_t cpid;
-  Mutex_Lock(&kernel_mutex);
+  int reaped = 0;
   PCB* parent = CURPROC;
+  SleepMutex_Lock(& parent->lock);
   
   /* Make sure I have children! */
   if(is_rlist_empty(& parent->children_list)) {
-    cpid = NOPROC;
+    reaped = -1;
     goto finish;
   }
   
-  while(is_rlist_empty(& parent->exited_list)) {
-    Cond_Wait(& kernel_mutex, & parent->child_exit,0);
-  }
+  if(! (options & WNOHANG))
+    while(is_rlist_empty(& parent->exited_list))
+      SleepMutex_Wait(& parent->lock, & parent->child_exit,0);
   
-  PCB* child = parent->exited_list.next->pcb;
-  assert(child->pstate == ZOMBIE);
-  cpid = get_pid(child);
-  cleanup_zombie(child, status);
+  while(reaped < max && !is_rlist_empty(& parent->exited_list)) {
+    PCB* zombies[PCB_BATCH];
+    int n = 0;
+    for(rlnode* node = parent->exited_list.next; 
+        n < PCB_BATCH && reaped+n < max && node != &parent->exited_list; 
+        node = node->next) {
+      assert(node->pcb->pstate == ZOMBIE);
+      zombies[n++] = node->pcb;
+    }
+    cleanup_zombies(zombies, n, pids ? pids+reaped : NULL, status ? status+reaped : NULL);
+    reaped += n;
+  }
   
 finish:
-  Mutex_Unlock(& kernel_mutex);
-  return cpid;
+  SleepMutex_Unlock(& parent->lock);
+  return reaped;
 }
 
 
-Pid_t WaitChild(Pid_t cpid, int* status)
+Pid_t WaitPid(Pid_t cpid, int* status, int options)
 {
+  kill_point();
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    return wait_for_specific_child(cpid, status, options);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    Pid_t pid;
+    int n = wait_for_children(&pid, status, 1, options);
+    return (n < 0) ? NOPROC : (n == 0) ? 0 : pid;
   }
+}
+
 
+Pid_t WaitChild(Pid_t cpid, int* status)
+{
+  return WaitPid(cpid, status, 0);
+}
+
+
+int WaitChildren(Pid_t pids[], int status[], int max)
+{
+  kill_point();
+  if(max <= 0) return 0;
+  int n = wait_for_children(pids, status, max, 0);
+  return (n < 0) ? 0 : n;
+}
+
+
+int DetachChild(Pid_t cpid)
+{
+  int ret = -1;
+  PCB* parent = CURPROC;
+  SleepMutex_Lock(& parent->lock);
+
+  RWLock_ReadLock(& tables_lock);
+  PCB* child = get_pcb(cpid);
+  int mine = (child != NULL && child->parent == parent && ! child->detached);
+  RWLock_ReadUnlock(& tables_lock);
+  if(! mine)
+    goto finish;
+
+  /* An exited child is reaped right away. Else, it releases itself at exit. */
+  if(child->pstate == ZOMBIE)
+    cleanup_zombies(&child, 1, NULL, NULL);
+  else {
+    child->detached = 1;
+    rlist_remove(& child->children_node);
+    rlist_push_front(& parent->detached_list, & child->children_node);
+  }
+  ret = 0;
+
+finish:
+  SleepMutex_Unlock(& parent->lock);
+  return ret;
+}
+
+
+/*
+  Lock the parent of a process. The parent may change (if it exits and 
+  we are adopted by init) until we hold its lock.
+ */
+static PCB* lock_parent(PCB* pcb)
+{
+  PCB* parent;
+  while((parent = pcb->parent) != NULL) {
+    SleepMutex_Lock(& parent->lock);
+    if(pcb->parent == parent) break;
+    SleepMutex_Unlock(& parent->lock);
+  }
+  return parent;
 }
 
 
 void Exit(int exitval)
 {
+  /* The thread is leaving: it may not be killed any more */
+  kernel_enter();
+
+  /* The files and the memory of the process are released below, so the other
+     threads must be gone first. They are stopped as by a kill, and the process
+     exits with the status of the first Exit, when its main thread exits. */
+  PCB* self = CURPROC;
+  SleepMutex_Lock(& self->lock);
+  int alone = (self->active_thread_count == 0);
+  if(! alone && ! self->exit_requested) {
+    self->exit_requested = 1;
+    self->exitval = exitval;
+  }
+  SleepMutex_Unlock(& self->lock);
+
+  if(! alone) {
+    __atomic_store_n(& self->killed, 1, __ATOMIC_RELAXED);
+    cancel_waits(self);
+    if(CURTHREAD != self->main_thread)
+      ThreadExit(exitval);
+    main_thread_exit(exitval);
+  }
+  if(self->exit_requested)
+    exitval = self->exitval;
+
   /* Right here, we must check that we are not the boot task. If we are, 
-     we must wait until all processes exit. */
+     we must wait until all processes exit. Detached processes leave no
+     zombies, but they signal child_exit too; while we wait for them, they
+     may give us new children. */
   if(GetPid()==1) {
-    while(WaitChild(NOPROC,NULL)!=NOPROC);
+    PCB* initpcb = CURPROC;
+    Pid_t pids[PCB_BATCH];
+    SleepMutex_Lock(& initpcb->lock);
+    while(! is_rlist_empty(& initpcb->children_list) || ! is_rlist_empty(& initpcb->detached_list)) {
+      if(is_rlist_empty(& initpcb->children_list)) {
+        SleepMutex_Wait(& initpcb->lock, & initpcb->child_exit, 0);
+        continue;
+      }
+      SleepMutex_Unlock(& initpcb->lock);
+      while(WaitChildren(pids, NULL, PCB_BATCH) > 0);
+      SleepMutex_Lock(& initpcb->lock);
+    }
+    SleepMutex_Unlock(& initpcb->lock);
   }
 
   /* Now, we exit */
-  Mutex_Lock(& kernel_mutex);
-
   PCB *curproc = CURPROC;  /* cache for efficiency */
 
   /* Do all the other cleanup we want here, close files etc. */
-  if(curproc->args) {
-    free(curproc->args);
-    curproc->args = NULL;
-  }
+  FCB* files[MAX_FILEID];
 
   /* Clean up FIDT */
+  SleepMutex_Lock(& curproc->files_lock);
   for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
+    files[i] = curproc->FIDT[i];
+    curproc->FIDT[i] = NULL;
   }
+  SleepMutex_Unlock(& curproc->files_lock);
+
+  /* Closing may sleep, so it is done without any locks */
+  for(int i=0;i<MAX_FILEID;i++)
+    if(files[i] != NULL)
+      FCB_decref(files[i]);
+
+  /* Release the memory of MemAlloc, all at once */
+  arena_release(& curproc->mem);
+
+  /* Release the records of the threads that were never joined */
+  release_thread_records(curproc);
 
   /* Reparent any children of the exiting process to the 
      initial task */
   PCB* initpcb = get_pcb(1);
-  while(!is_rlist_empty(& curproc->children_list)) {
-    rlnode* child = rlist_pop_front(& curproc->children_list);
-    child->pcb->parent = initpcb;
-    rlist_push_front(& initpcb->children_list, child);
-  }
+  SleepMutex_Lock(& curproc->lock);
+  if(curproc != initpcb) {
+    SleepMutex_Lock(& initpcb->lock);
+
+    RWLock_WriteLock(& tables_lock);
+    while(!is_rlist_empty(& curproc->children_list)) {
+      rlnode* child = rlist_pop_front(& curproc->children_list);
+      child->pcb->parent = initpcb;
+      rlist_push_front(& initpcb->children_list, child);
+    }
+    while(!is_rlist_empty(& curproc->detached_list)) {
+      rlnode* child = rlist_pop_front(& curproc->detached_list);
+      child->pcb->parent = initpcb;
+      rlist_push_front(& initpcb->detached_list, child);
+    }
+    RWLock_WriteUnlock(& tables_lock);
+
+    /* Add exited children to the initial task's exited list 
+       and signal the initial task */
+    if(!is_rlist_empty(& curproc->exited_list)) {
+      rlist_append(& initpcb->exited_list, &curproc->exited_list);
+      Cond_Broadcast(& initpcb->child_exit);
+    }
 
-  /* Add exited children to the initial task's exited list 
-     and signal the initial task */
-  if(!is_rlist_empty(& curproc->exited_list)) {
-    rlist_append(& initpcb->exited_list, &curproc->exited_list);
-    Cond_Broadcast(& initpcb->child_exit);
+    SleepMutex_Unlock(& initpcb->lock);
   }
+  SleepMutex_Unlock(& curproc->lock);
+
+  /* Now, mark the process as exited. This is done holding the parent's 
+     lock, so that the parent sees the state change and the exited list
+     change at once. */
+  PCB* parent = lock_parent(curproc);
 
-  /* Put me into my parent's exited list */
-  if(curproc->parent != NULL) {   /* Maybe this is init */
-    rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
-    Cond_Broadcast(& curproc->parent->child_exit);
+  RWLock_WriteLock(& tables_lock);
+  if(curproc->argbuf) {
+    SharedArgs_Release(curproc->argbuf);
+    curproc->argbuf = NULL;
+    curproc->args = NULL;
   }
 
   /* Disconnect my main_thread */
   curproc->main_thread = NULL;
 
-  /* Now, mark the process as exited. */
-  curproc->pstate = ZOMBIE;
+  /* If nobody will wait for me, my PCB is released right now. Once 
+     tables_lock is unlocked, it may be reused, and it must not be touched. */
+  int detached = curproc->detached;
   curproc->exitval = exitval;
+  if(detached) {
+    rlist_remove(& curproc->children_node);
+    release_PCBs(&curproc, 1);
+  } else
+    curproc->pstate = ZOMBIE;
+  RWLock_WriteUnlock(& tables_lock);
+
+  /* Put me into my parent's exited list. A detached process only 
+     signals its parent (init may be waiting for it to shut down). */
+  if(parent != NULL) {   /* Maybe this is init */
+    if(! detached)
+      rlist_push_front(& parent->exited_list, &curproc->exited_node);
+    Cond_Broadcast(& parent->child_exit);
+    SleepMutex_Unlock(& parent->lock);
+  }
 
   /* Bye-bye cruel world */
-  sleep_releasing(EXITED, & kernel_mutex,0);
+  sleep_releasing(EXITED, NULL, 0);
 }
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
 typedef struct OpenInfo_ctrl_block {
 
-  FCB * reader ; 
-  int PCB_counter ; 
-  procinfo pcb_info ; 
+  FCB* reader;
+  SleepMutex lock;        /* Serializes the reads of the stream */
+  info_cursor cursor;
+  procinfo partial;       /* A record that was read in part */
+  unsigned int left;      /* The size of the unread tail of partial */
 
 } OICB ; 
 
 int openInfo_close(void* ctrl_block) {
 
 	OICB * open_ctrl = (OICB*) ctrl_block;
+	RWLock_WriteLock(& tables_lock);
+	rlist_remove(& open_ctrl->cursor.node);
+	RWLock_WriteUnlock(& tables_lock);
 	open_ctrl->reader = NULL ;
 	free (open_ctrl) ;
 
 	return 0; 
 }
 
+/* Fill in the record of a PCB. Must be called with tables_lock held. */
+static void fill_procinfo(procinfo* info, PCB* pcb)
+{
+  memset(info, 0, sizeof(procinfo));
+  info->pid = get_pid(pcb);
+  info->ppid = get_pid(pcb->parent);
+  info->alive = (pcb->pstate == ALIVE);
+  info->main_task = pcb->main_task;
+  info->argl = pcb->argl;
+  info->thread_count = (unsigned long) pcb->ntcb_count+1;
+  info->usage = pcb->usage;
+
+  /* The args of a zombie are gone */
+  if(pcb->args != NULL && pcb->argl > 0)
+    memcpy(info->args, pcb->args, 
+      (pcb->argl < PROCINFO_MAX_ARGS_SIZE) ? pcb->argl : PROCINFO_MAX_ARGS_SIZE);
+}
+
+/*
+  Return the rest of a record that was read in part, or else as many whole
+  records as fit in the buffer. If the buffer is smaller than a record, one
+  record is taken, and what does not fit is kept for the next reads.
+
+  The PCBs are taken after the cursor, up to PCB_BATCH at a time, each batch
+  under one acquisition of tables_lock for reading, so that each batch is a 
+  consistent snapshot of the table. Monitors do not exclude each other, and
+  they only hold up the threads that change the table for one batch.
+ */
 int openInfo_read(void* ctrl_block, char *buf, unsigned int size) {
 
   OICB *OI_ctrl = (OICB*) ctrl_block;  
+  SleepMutex_Lock(& OI_ctrl->lock);
+
+  if(OI_ctrl->left > 0) {
+    unsigned int n = (size < OI_ctrl->left) ? size : OI_ctrl->left;
+    memcpy(buf, (char*) &OI_ctrl->partial + sizeof(procinfo) - OI_ctrl->left, n);
+    OI_ctrl->left -= n;
+    SleepMutex_Unlock(& OI_ctrl->lock);
+    return n;
+  }
 
-  // This will fill the procinfo struct with the PCB info
-
-  while (PT[OI_ctrl->PCB_counter].pstate == FREE)
-    OI_ctrl->PCB_counter++ ;  
-
-    if (OI_ctrl->PCB_counter < MAX_PROC) {
-	    OI_ctrl->pcb_info.pid = get_pid (&PT[OI_ctrl->PCB_counter]) ;
-	    OI_ctrl->pcb_info.ppid = get_pid (PT[OI_ctrl->PCB_counter].parent) ;
-    
-    if (PT[OI_ctrl->PCB_counter].pstate == ALIVE) // Non zero
-	    OI_ctrl->pcb_info.alive = 1 ;
-
-    if (PT[OI_ctrl->PCB_counter].pstate == ZOMBIE) 
-      	    OI_ctrl->pcb_info.alive = 0 ;
-
-  	OI_ctrl->pcb_info.main_task = PT[OI_ctrl->PCB_counter].main_task ;
-  	OI_ctrl->pcb_info.argl = PT[OI_ctrl->PCB_counter].argl ;
-
-  	OI_ctrl->pcb_info.thread_count = (unsigned long) PT[OI_ctrl->PCB_counter].ntcb_count+1 ;  
-
-  	if(PT[OI_ctrl->PCB_counter].args) // Alive
-  	{
-  	 	void * tmp = PT [OI_ctrl->PCB_counter].args ;
-  		int i = 0 ; 
-  		for (i = 0; i < PROCINFO_MAX_ARGS_SIZE ; i++)
-  		{
-  			OI_ctrl->pcb_info.args[i] = * (char *) tmp  ; 
-  			tmp += sizeof(char) ; 
-  		}
-    	}  
-	//else the args is null so there is no need to copy anything		
+  unsigned int want = size / sizeof(procinfo);
+  if(want == 0) want = 1;
+
+  unsigned int count = 0;
+  rlnode* node;
+  do {
+    RWLock_ReadLock(& tables_lock);
+
+    int n = 0;
+    node = OI_ctrl->cursor.last->next;
+    while(count < want && n < PCB_BATCH && node != &live_pcbs) {
+      if(size < sizeof(procinfo))
+        fill_procinfo(& OI_ctrl->partial, node->pcb);
+      else {
+        procinfo info;
+        fill_procinfo(&info, node->pcb);
+        memcpy(buf + count*sizeof(procinfo), &info, sizeof(procinfo));
+      }
+      count++;
+      n++;
+      OI_ctrl->cursor.last = node;
+      node = node->next;
+    }
 
-	// This will package the data from the struct to the buffer	
+    RWLock_ReadUnlock(& tables_lock);
+  } while(count < want && node != &live_pcbs);
 
-	memcpy (buf,((char*) &OI_ctrl->pcb_info) , size);
+  int ret = count*sizeof(procinfo);
+  if(count > 0 && size < sizeof(procinfo)) {
+    memcpy(buf, &OI_ctrl->partial, size);
+    OI_ctrl->left = sizeof(procinfo) - size;
+    ret = size;
+  }
 
-	OI_ctrl->PCB_counter++ ;
-	
-	return size ; 
-} 
-else 
-{
-	return 0 ;
-}
-   
+  SleepMutex_Unlock(& OI_ctrl->lock);
+  return ret;
 }
 
 
@@ -515,17 +1149,28 @@ Fid_t OpenInfo() {
   Fid_t FID ; 
   FCB * OI_fcb ; 
 
+  PCB* curproc = CURPROC;
+  SleepMutex_Lock(& curproc->files_lock);
+
   if (!FCB_reserve(1, &FID, &OI_fcb)) { // If the fids are exhausted   	
+  	SleepMutex_Unlock(& curproc->files_lock);
   	return NOFILE;
   }
   else
   {    
       OICB* new_OI_ctrl_block = (OICB*) xmalloc(sizeof(OICB));
-      new_OI_ctrl_block->PCB_counter = 0 ; 
       new_OI_ctrl_block->reader = OI_fcb ;    
+      new_OI_ctrl_block->lock = SLEEPMUTEX_INIT;
+      new_OI_ctrl_block->left = 0;
+      rlnode_init(& new_OI_ctrl_block->cursor.node, & new_OI_ctrl_block->cursor);
+      new_OI_ctrl_block->cursor.last = & live_pcbs;
+      RWLock_WriteLock(& tables_lock);
+      rlist_push_back(& info_cursors, & new_OI_ctrl_block->cursor.node);
+      RWLock_WriteUnlock(& tables_lock);
       OI_fcb->streamobj = new_OI_ctrl_block ;
       OI_fcb->streamfunc = &openInfo_fops ;
 
+      SleepMutex_Unlock(& curproc->files_lock);
       return FID ;
   }  
 
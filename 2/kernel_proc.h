@@ -17,6 +17,7 @@
 
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_arena.h"
 
 /**
   @brief PID state
@@ -37,17 +38,31 @@ typedef enum pid_state_e {
  */
 typedef struct process_control_block {
   pid_state  pstate;      /**< The pid state for this PCB */
+  Pid_t pid;              /**< The pid of this PCB (fixed) */
+  rlnode live_node;       /**< Intrusive node in the list of non-free PCBs */
 
   PCB* parent;            /**< Parent's pcb. */
   int exitval;            /**< The exit value */
 
+  Pid_t pgid;             /**< The process group */
+  int killed;             /**< Set (atomically) by @c KillGroup, or by @c Exit to stop the other threads */
+  int exit_requested;     /**< Set by @c Exit, if the other threads must stop first; @c exitval holds the status */
+
+  usageinfo usage;        /**< The resource usage of all the threads, updated atomically */
+
   TCB* main_thread;       /**< The main thread */
   Task main_task;         /**< The main thread's function */
   int argl;               /**< The main thread's argument length */
   void* args;             /**< The main thread's argument string */
+  SharedArgs* argbuf;     /**< The buffer of @c args, maybe shared with other processes */
+
+  arena mem;              /**< The memory of @c MemAlloc, released at exit */
+
+  int detached;           /**< Non-zero if the process is released at exit, without a zombie */
 
   rlnode children_list;   /**< List of children */
   rlnode exited_list;     /**< List of exited children */
+  rlnode detached_list;   /**< List of detached children (linked by @c children_node) */
 
   rlnode children_node;   /**< Intrusive node for @c children_list */
   rlnode exited_node;     /**< Intrusive node for @c exited_list */
@@ -58,6 +73,13 @@ typedef struct process_control_block {
   rlnode NT;              /*List of new control block*/
   int ntcb_count;
   int active_thread_count;
+  CondVar thread_exit;    /**< Condition variable for the main thread to wait for the other threads */
+
+  SleepMutex lock;        /**< Protects the children, the threads and the condition variables */
+  SleepMutex files_lock;  /**< Protects @c FIDT */
+
+  rlnode sleepers;        /**< The killable waits of the threads, for @c KillGroup */
+  Mutex sleepers_lock;    /**< Protects @c sleepers */
 
 } PCB;
 
@@ -69,6 +91,16 @@ void release_NTCB(NTCB* ntcb);
 
 
 
+/**
+  @brief The limits on the number of processes and threads.
+
+  The process table and the thread table are allocated in chunks, on demand, up to
+  these limits. They are set by @c boot(), from the environment variables
+  @c TINYOS_MAX_PROC and @c TINYOS_MAX_THREADS, and may not exceed @c MAX_PROC and
+  @c MAX_NTCB respectively. 
+ */
+extern unsigned int max_proc, max_ntcb;
+
 /**
   @brief Initialize the process table.
 
@@ -77,6 +109,13 @@ void release_NTCB(NTCB* ntcb);
 */
 void initialize_processes();
 
+/**
+  @brief Release the process table.
+
+  This is called by @c boot() after the kernel has stopped.
+ */
+void finalize_processes();
+
 /**
   @brief Get the PCB for a PID.
 
@@ -84,6 +123,10 @@ void initialize_processes();
   the process with a given PID. If the PID does not
   correspond to a process, the function returns @c NULL.
 
+  The result is only a hint, unless the caller holds @c tables_lock.
+  A parent can check that the PCB is still its child, by checking its
+  @c parent field while holding its own @c lock.
+
   @param pid the pid of the process 
   @returns A pointer to the PCB of the process, or NULL.
 */
@@ -101,6 +144,45 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Terminate the main thread of the current process.
+
+  This waits for the other threads of the process to exit, and then it
+  exits the process with status @c exitval. It does not return.
+ */
+void main_thread_exit(int exitval);
+
+/**
+  @brief Release the records (NTCBs) of the exited threads of a process.
+
+  This is called by @c Exit, for the threads that were never joined.
+ */
+void release_thread_records(PCB* pcb);
+
+/**
+  @brief Terminate the current thread, because its process was killed.
+
+  The main thread waits for the other threads of the process and then exits
+  the process, with exit status -1. Any other thread calls @c ThreadExit(-1).
+  This does not return.
+ */
+void kill_current_thread();
+
+/**
+  @brief Check whether the current thread must die.
+
+  This is called at kernel entry (at the start of the system calls that may 
+  block or create processes), and at quantum expiry. Nothing happens if the
+  thread is in a kernel section.
+ */
+static inline void kill_point()
+{
+  TCB* tcb = CURTHREAD;
+  if(tcb != NULL && tcb->kernel_depth == 0 && tcb->owner_pcb != NULL && 
+     __atomic_load_n(& tcb->owner_pcb->killed, __ATOMIC_RELAXED))
+    kill_current_thread();
+}
+
 /** @} */
 
 #endif
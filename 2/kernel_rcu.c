@@ -0,0 +1,115 @@
+
+#include <assert.h>
+#include <limits.h>
+
+#include "kernel_sched.h"
+#include "kernel_rcu.h"
+
+/**
+	@file kernel_rcu.c
+
+	@brief The implementation of epoch-based reclamation.
+  */
+
+/* The epoch of a core in the extended quiescent state */
+#define RCU_IDLE ULONG_MAX
+
+/* The global epoch */
+static unsigned long rcu_epoch;
+
+/* Per-core state. Only 'qs' is read by other cores. The deferred list is
+   only accessed by its own core, with preemption off. */
+typedef struct {
+  unsigned long qs;        /* The epoch of the last quiescent state */
+  rcu_head* head;          /* The deferred list, in epoch order */
+  rcu_head* tail;
+} rcu_core;
+
+static rcu_core RCU[MAX_CORES];
+
+
+void initialize_rcu()
+{
+  rcu_epoch = 1;
+  for(int c=0; c<MAX_CORES; c++)
+    RCU[c] = (rcu_core){ .qs = RCU_IDLE, .head = NULL, .tail = NULL };
+}
+
+
+void rcu_call(rcu_head* head, void (*release)(rcu_head*))
+{
+  int preempt = preempt_off;
+  rcu_core* rc = & RCU[cpu_core_id];
+
+  head->release = release;
+  head->next = NULL;
+  head->epoch = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+
+  if(rc->tail) rc->tail->next = head; else rc->head = head;
+  rc->tail = head;
+
+  if(preempt) preempt_on;
+}
+
+
+/* The oldest epoch that a core may still be reading in */
+static unsigned long rcu_oldest()
+{
+  unsigned long oldest = RCU_IDLE;
+  for(uint c=0; c<cpu_cores(); c++) {
+    unsigned long qs = __atomic_load_n(& RCU[c].qs, __ATOMIC_SEQ_CST);
+    if(qs < oldest) oldest = qs;
+  }
+  return oldest;
+}
+
+
+/* Release the objects queued before the oldest epoch */
+static void rcu_process(rcu_core* rc)
+{
+  if(rc->head == NULL) return;
+
+  /* Start a grace period for the newest objects, if needed */
+  unsigned long epoch = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+  if(rc->tail->epoch == epoch)
+    __atomic_compare_exchange_n(&rcu_epoch, &epoch, epoch+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+  unsigned long oldest = rcu_oldest();
+  while(rc->head && rc->head->epoch < oldest) {
+    rcu_head* head = rc->head;
+    rc->head = head->next;
+    if(rc->head == NULL) rc->tail = NULL;
+    head->release(head);
+  }
+}
+
+
+void rcu_quiescent()
+{
+  rcu_core* rc = & RCU[cpu_core_id];
+  __atomic_store_n(& rc->qs, __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  rcu_process(rc);
+}
+
+
+void rcu_idle_enter()
+{
+  int preempt = preempt_off;
+  rcu_core* rc = & RCU[cpu_core_id];
+  __atomic_store_n(& rc->qs, RCU_IDLE, __ATOMIC_SEQ_CST);
+  rcu_process(rc);
+  if(preempt) preempt_on;
+}
+
+
+void rcu_drain()
+{
+  rcu_core* rc = & RCU[cpu_core_id];
+  while(rc->head) {
+    rcu_head* head = rc->head;
+    rc->head = head->next;
+    head->release(head);
+  }
+  rc->tail = NULL;
+  rc->qs = RCU_IDLE;
+}
@@ -0,0 +1,95 @@
+#ifndef __KERNEL_RCU_H
+#define __KERNEL_RCU_H
+
+/**
+  @file kernel_rcu.h
+  @brief TinyOS kernel: Epoch-based memory reclamation.
+
+  @defgroup rcu Epoch-based reclamation
+  @ingroup kernel
+  @brief Deferred freeing of objects that are read without locks.
+
+  A kernel object that is reached through a shared pointer (e.g., a listener
+  socket in @c PORTS_TABLE) may be read without holding the lock that
+  protects the pointer, as long as
+  - the reader is inside a read-side section, i.e., between @c rcu_read_lock()
+    and @c rcu_read_unlock(), and
+  - the writer, after it unpublishes the object (under the lock), releases
+    it with @c rcu_call() instead of freeing it directly.
+
+  A read-side section runs with preemption off, and must not sleep or yield.
+  Therefore, a core that passes through @c gain() is in a _quiescent state_:
+  none of the read-side sections that it ran before is still running.
+  Each core reports its quiescent states, by recording the current value of a
+  global epoch counter. A core that is halted in its idle thread is in an
+  extended quiescent state, and does not hold back anything.
+
+  An object released by @c rcu_call() is tagged with the current epoch @c e, and
+  queued on a per-core deferred-free list. The epoch is then advanced, and
+  once every core has reported a quiescent state in epoch @c e+1 or later, no
+  reader may still hold a reference to the object, and it is released.
+  The deferred lists are processed by their own core, at @c gain().
+
+  @{
+*/
+
+#include "kernel_cc.h"
+
+/**
+  @brief A deferred release request.
+
+  This is embedded in the object to be released.
+ */
+typedef struct rcu_head {
+  struct rcu_head* next;                    /**< Next in the deferred-free list */
+  void (*release)(struct rcu_head*);        /**< Called to release the object */
+  unsigned long epoch;                      /**< The epoch when it was queued */
+} rcu_head;
+
+
+/** @brief Initialize the epochs. This is called at kernel startup. */
+void initialize_rcu();
+
+/**
+  @brief Enter a read-side section.
+
+  Return the previous preemption state, to be passed to @c rcu_read_unlock().
+  Sections may nest.
+ */
+static inline int rcu_read_lock() { return preempt_off; }
+
+/** @brief Leave a read-side section. */
+static inline void rcu_read_unlock(int preempt) { if(preempt) preempt_on; }
+
+/**
+  @brief Release an object after a grace period.
+
+  The object must have been unpublished, so that no new reader can find it.
+  After every read-side section that might hold it has finished, the
+  @c release function is called with @c head, on the same core.
+  This may be called with or without locks held.
+ */
+void rcu_call(rcu_head* head, void (*release)(rcu_head*));
+
+/**
+  @brief Report a quiescent state for the current core.
+
+  This is called by @c gain(), with preemption off. It releases the
+  objects of the core's list whose grace period has expired.
+ */
+void rcu_quiescent();
+
+/** @brief Enter the extended quiescent state of a halted core. */
+void rcu_idle_enter();
+
+/**
+  @brief Release all the deferred objects of the current core.
+
+  This is called when the core leaves the scheduler, and there are no
+  more threads (hence, no readers).
+ */
+void rcu_drain();
+
+/** @} */
+
+#endif
@@ -1,11 +1,16 @@
 
 #include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
 #include <sys/mman.h>
 
 #include "tinyos.h"
 #include "kernel_cc.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_trace.h"
+#include "kernel_rcu.h"
 
 #ifndef NVALGRIND
 #include <valgrind/valgrind.h>
@@ -56,7 +61,12 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 
 #define THREAD_SIZE  (THREAD_TCB_SIZE+THREAD_STACK_SIZE)
 
-//#define MMAPPED_THREAD_MEM 
+/*
+  Thread stacks are mmapped, so that they can be executable without making
+  heap memory executable: a GCC nested function that refers to its enclosing
+  frame (as many tests do) is called through a trampoline built on the stack.
+ */
+#define MMAPPED_THREAD_MEM 
 #ifdef MMAPPED_THREAD_MEM 
 
 /*
@@ -155,9 +165,15 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
   tcb->thread_func = func;
 
   tcb->priority = 0;
+  tcb->kernel_depth = 0;
+  tcb->exiting = 0;
+  memset(& tcb->usage, 0, sizeof(usageinfo));
+  tcb->kernel_slice = 0;
 
-  tcb->owner_ntcb=(NTCB*)acquire_NTCB();  
-  tcb->owner_ntcb=(&pcb->NT)->ntcb;
+  for(int i=0; i<MCS_NODES; i++)
+    tcb->mcs_nodes[i].lock = NULL;
+
+  tcb->owner_ntcb = NULL;   /* Set by CreateThread, NULL for a main thread */
   
   rlnode_init(& tcb->sched_node, tcb);  /* Intrusive list node */
 
@@ -185,9 +201,6 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
   return tcb;
 }
 
-/*
-  This is called with tcb->state_spinlock locked !
- */
 void release_TCB(TCB* tcb)
 {
 #ifndef NVALGRIND
@@ -201,6 +214,15 @@ void release_TCB(TCB* tcb)
   Mutex_Unlock(&active_threads_spinlock);
 }
 
+/*
+  Release the TCB and the stack of an exited thread. This is deferred work,
+  queued by gain() on the core that switched away from the thread.
+ */
+static void release_TCB_work(defer_work* work)
+{
+  release_TCB((TCB*) ((char*) work - offsetof(TCB, reap)));
+}
+
 /*
  *
  * Scheduler
@@ -229,10 +251,83 @@ Mutex sched_spinlock = MUTEX_INIT;    /* spinlock for scheduler queue */
 rlnode queueArray [MAX_LEVELS] ;
 int QUANTUM_COUNTER ; 
 
+/*
+  Resource usage accounting. The counters of a thread are only updated by
+  the thread itself (except for 'wakeups', which is updated under its state 
+  spinlock), but the counters of a process are shared by its threads, and
+  they are updated atomically.
+ */
+static inline uint64_t usage_clock()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec*1000000000ull + t.tv_nsec;
+}
+
+#define USAGE_ADD(pcb, field, n) __atomic_add_fetch(& (pcb)->usage.field, (n), __ATOMIC_RELAXED)
+
+/*
+  The kernel time of a slice is the sum of the intervals between the start of
+  an outermost kernel section and its end (or the end of the slice).
+ */
+void usage_kernel_enter(TCB* tcb)
+{
+  tcb->kernel_since = usage_clock();
+}
+
+void usage_kernel_leave(TCB* tcb)
+{
+  tcb->kernel_slice += usage_clock() - tcb->kernel_since;
+}
+
+/* 
+  Charge the time slice that ends now to the current thread, split into
+  kernel and user time. The PCB of an exiting thread may already have been 
+  released, so it is left alone.
+ */
+static void usage_charge(TCB* tcb, int preempted, int switched, int exiting)
+{
+  uint64_t now = usage_clock();
+  unsigned long slice = now - tcb->slice_start;
+  unsigned long kernel = tcb->kernel_slice;
+  if(tcb->kernel_depth > 0) kernel += now - tcb->kernel_since;
+  if(kernel > slice) kernel = slice;
+  unsigned long user = slice - kernel;
+  PCB* pcb = exiting ? NULL : tcb->owner_pcb;
+
+  tcb->usage.user_time += user;
+  tcb->usage.kernel_time += kernel;
+  if(pcb) {
+    USAGE_ADD(pcb, user_time, user);
+    USAGE_ADD(pcb, kernel_time, kernel);
+  }
+
+  if(switched) {
+    if(preempted) tcb->usage.preemptions++; else tcb->usage.switches++;
+    if(pcb) {
+      if(preempted) USAGE_ADD(pcb, preemptions, 1); else USAGE_ADD(pcb, switches, 1);
+    }
+  }
+
+  /* Sample the stack, which grows down from the end of the thread's memory */
+  unsigned long stack = (uintptr_t)((void*)tcb + THREAD_SIZE) - (uintptr_t) __builtin_frame_address(0);
+  if(stack > tcb->usage.stack_peak) {
+    tcb->usage.stack_peak = stack;
+    if(pcb) {
+      unsigned long peak = __atomic_load_n(& pcb->usage.stack_peak, __ATOMIC_RELAXED);
+      while(stack > peak && 
+        !__atomic_compare_exchange_n(& pcb->usage.stack_peak, &peak, stack, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+  }
+}
+
 /* Interrupt handler for ALARM */
 void yield_handler()
 {
   yield(0,1);
+
+  /* A killed thread exits at quantum expiry, unless it is in the kernel */
+  kill_point();
 }
 
 /* Interrupt handle for inter-core interrupts */
@@ -256,8 +351,9 @@ void sched_queue_add(TCB* tcb)
   rlist_push_back(&queueArray[tcb->priority],&tcb->sched_node);
   Mutex_Unlock(&sched_spinlock);
 
-  /* Restart possibly halted cores */
-  cpu_core_restart_one();
+  /* Restart a possibly halted core, preferably one sharing a cache with
+     this core, since the woken thread probably uses data produced here */
+  cpu_core_restart_near(cpu_core_id);
 }
 
 /*
@@ -291,6 +387,12 @@ void wakeup(TCB* tcb)
   Mutex_Lock(& tcb->state_spinlock);
   assert(tcb->state==STOPPED || tcb->state==INIT); 
 
+  SCHED_TRACE_EVENT(tcb, TRACE_WAKEUP, (tcb->state==INIT) ? TRACE_FLAG_NEW : 0);
+
+  if(tcb->state == STOPPED) {
+    tcb->usage.wakeups++;
+    USAGE_ADD(tcb->owner_pcb, wakeups, 1);
+  }
   tcb->state = READY;
 
   /* Possibly add to the scheduler queue */
@@ -305,6 +407,37 @@ void wakeup(TCB* tcb)
   if(oldpre) preempt_on;
 }
 
+/*
+  Make a number of new threads ready. Since no other thread can wake them up,
+  their state can be changed before they are queued.
+ */
+void wakeup_spawned(TCB* tcbs[], int n)
+{
+  int oldpre = preempt_off;
+
+  for(int i=0; i<n; i++) {
+    TCB* tcb = tcbs[i];
+    Mutex_Lock(& tcb->state_spinlock);
+    assert(tcb->state==INIT && tcb->phase==CTX_CLEAN);
+    SCHED_TRACE_EVENT(tcb, TRACE_WAKEUP, TRACE_FLAG_NEW);
+    tcb->state = READY;
+    Mutex_Unlock(& tcb->state_spinlock);
+  }
+
+  Mutex_Lock(& sched_spinlock);
+  for(int i=0; i<n; i++)
+    rlist_push_back(&queueArray[tcbs[i]->priority], &tcbs[i]->sched_node);
+  Mutex_Unlock(& sched_spinlock);
+
+  /* Restart as many halted cores as there are new threads */
+  if(n > 0)
+    cpu_core_restart_near(cpu_core_id);
+  for(int i=1; i<n && i<(int) cpu_cores(); i++)
+    cpu_core_restart_one();
+
+  if(oldpre) preempt_on;
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -325,6 +458,11 @@ void sleep_releasing(Thread_state state, Mutex* mx,int I_O)
   /* mark the process as stopped */
   tcb->state = state;
 
+  if(state==EXITED)
+    SCHED_TRACE_EVENT(tcb, TRACE_EXIT, 0);
+  else
+    SCHED_TRACE_EVENT(tcb, TRACE_BLOCK, I_O ? TRACE_FLAG_IO : 0);
+
   /* Release mx */
   if(mx!=NULL) Mutex_Unlock(mx);
 
@@ -418,6 +556,7 @@ void yield(int I_O,int ComplQuantum)
   TCB* current = CURTHREAD;  /* Make a local copy of current process, for speed */
 
   int current_ready = 0;
+  int current_exit = 0;
 
   Mutex_Lock(& current->state_spinlock);
 
@@ -470,12 +609,16 @@ void yield(int I_O,int ComplQuantum)
   switch(current->state)
   {
     case RUNNING:
+      SCHED_TRACE_EVENT(current, TRACE_YIELD, 
+        (I_O ? TRACE_FLAG_IO : 0) | (ComplQuantum ? TRACE_FLAG_QUANTUM : 0));
       current->state = READY;
     case READY: /* We were awakened before we managed to sleep! */
       current_ready = 1;
       break;
     case STOPPED:
+      break;
     case EXITED:
+      current_exit = 1;
       break; 
     default:
       fprintf(stderr, "BAD STATE for current thread %p in yield: %d\n", current, current->state);
@@ -496,6 +639,9 @@ void yield(int I_O,int ComplQuantum)
       next = &CURCORE.idle_thread;
   }
 
+  if(current->type != IDLE_THREAD)
+    usage_charge(current, ComplQuantum, current != next, current_exit);
+
   /* ok, link the current and next TCB, for the gain phase */
   current->next = next;
   next->prev = current;
@@ -534,8 +680,15 @@ void gain(int preempt)
   Mutex_Lock(& current->state_spinlock);
   current->state = RUNNING;
   current->phase = CTX_DIRTY;
+  SCHED_TRACE_EVENT(current, TRACE_DISPATCH, 0);
   Mutex_Unlock(& current->state_spinlock);
 
+  /* Start a new time slice */
+  if(current->type != IDLE_THREAD) {
+    current->slice_start = current->kernel_since = usage_clock();
+    current->kernel_slice = 0;
+  }
+
   /* Take care of the previous thread */
   if(current != prev) {
     int prev_exit = 0;
@@ -557,9 +710,15 @@ void gain(int preempt)
         assert(0);  /* It should not be READY or EXITED ! */
     }
     Mutex_Unlock(& prev->state_spinlock);
-    if(prev_exit) release_TCB(prev);
+    if(prev_exit) defer_call(& prev->reap, release_TCB_work);
   }
 
+  /* A context switch is a quiescent state for epoch-based reclamation */
+  rcu_quiescent();
+
+  /* Free some exited threads, if they have piled up */
+  defer_switch();
+
   /* Reset preemption as needed */
   if(preempt) preempt_on;
 
@@ -573,8 +732,11 @@ static void idle_thread()
   /* When we first start the idle thread */
   yield(0,0);
 
-  /* We come here whenever we cannot find a ready thread for our core */
-  while(active_threads>0) {
+  /* We come here whenever we cannot find a ready thread for our core. 
+     Exited threads count as active until their deferred release, so the
+     deferred work must be done before the test. */
+  for(defer_idle(); active_threads>0; defer_idle()) {
+    rcu_idle_enter();
     cpu_core_halt();
     yield(0,0);
   }
@@ -591,9 +753,15 @@ static void idle_thread()
 void initialize_scheduler()
 {
 	QUANTUM_COUNTER = 0 ;
+#ifdef SCHED_TRACE
+	sched_trace_init();
+#endif
 	// rlnode_init(&SCHED, NULL);
 	for (int i= 0 ; i< MAX_LEVELS ; i ++)
   		rlnode_init(&queueArray[i], NULL);
+
+	Mutex_Register(&sched_spinlock, "sched");
+	Mutex_Register(&active_threads_spinlock, "active_threads");
 }
 
 void run_scheduler()
@@ -622,6 +790,8 @@ void run_scheduler()
 
   /* Finished scheduling */
   assert(CURTHREAD == &CURCORE.idle_thread);
+  rcu_drain();
+  defer_idle();
   cpu_interrupt_handler(ALARM, NULL);
   cpu_interrupt_handler(ICI, NULL);
 }
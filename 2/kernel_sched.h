@@ -25,6 +25,8 @@
 #include "util.h"
 #include "bios.h"
 #include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_defer.h"
 
 /*****************************
  *
@@ -92,6 +94,22 @@ typedef struct thread_control_block
 
   int priority ; 
 
+  int kernel_depth;       /**< Non-zero while the thread may not be killed (see @c kernel_enter) */
+  int exiting;            /**< Set when the thread starts to exit; a kill does not cut its waits short */
+
+  usageinfo usage;        /**< Resource usage (see @c GetUsage) */
+  uint64_t slice_start;   /**< When the current time slice started, in nsec */
+  uint64_t kernel_since;  /**< When the thread last entered the kernel, in nsec */
+  unsigned long kernel_slice;  /**< The kernel time of the current slice, up to the last exit from the kernel */
+
+  mcs_node mcs_nodes[MCS_NODES];  /**< MCS lock nodes, used in the preemptive domain */
+
+  defer_work reap;        /**< Deferred work that releases the TCB, after it exits */
+
+#ifdef SCHED_TRACE
+  unsigned trace_id;     /**< The thread id used in the scheduler trace */
+#endif
+
   struct thread_control_block * prev;  /**< previous context */
   struct thread_control_block * next;  /**< next context */
   
@@ -100,12 +118,15 @@ typedef struct thread_control_block
 typedef struct new_thread_control_block {
 
   PCB* parent;            /**< Parent's pcb. */
-  NTCB* ntcb_next;
-  TCB* ntcb_thread;       /**< The thread */
+  NTCB* ntcb_next;        /**< Next in the free list */
+  rlnode ntcb_node;       /**< Intrusive node in the @c NT list of the process */
+  TCB* ntcb_thread;       /**< The thread (its TCB is released soon after it exits) */
   Task main_task;         /**< The thread's function */
   int argl;               /**< The thread's argument length */
   void* args;             /**< The thread's argument string */
   int exitval;            /**< The exit value */
+  int exited;             /**< Set by @c ThreadExit */
+  int joiners;            /**< The number of threads waiting in @c ThreadJoin */
   CondVar join_var;     /**< Condition variable for @c ThreadJoin */
   int flag_detach;
 
@@ -133,6 +154,8 @@ typedef struct core_control_block {
   TCB idle_thread;            /**< Used by the scheduler to handle the core's idle thread */
   sig_atomic_t preemption;    /**< Marks preemption, used by the locking code */
 
+  mcs_node mcs_nodes[MCS_NODES];  /**< MCS lock nodes, used in the non-preemptive domain */
+
 } CCB;
  
 
@@ -159,6 +182,41 @@ extern CCB cctx[MAX_CORES];
 #define CURPROC  (CURTHREAD->owner_pcb)
 
 
+/**
+  @brief Record that a thread enters the kernel.
+
+  This is called when the outermost kernel section of @c tcb starts, to
+  split its time slices into user and kernel time (see @c usageinfo).
+ */
+void usage_kernel_enter(TCB* tcb);
+
+/** @brief Record that a thread leaves the kernel (see @c usage_kernel_enter). */
+void usage_kernel_leave(TCB* tcb);
+
+/**
+  @brief Enter a kernel section.
+
+  While the current thread is in a kernel section, it is not killed at quantum
+  expiry, even if its process has been killed (see @c KillGroup). Sections nest.
+  A thread is in a section while it holds a lock (a @c Mutex, @c SleepMutex or
+  @c RWLock); kernel code that changes shared state without holding one (e.g., 
+  while it holds a reference to an FCB) must be bracketed by @c kernel_enter() 
+  and @c kernel_leave().
+ */
+static inline void kernel_enter() 
+{ 
+  TCB* tcb = CURTHREAD;
+  if(tcb->kernel_depth++ == 0) usage_kernel_enter(tcb);
+}
+
+/** @brief Leave a kernel section. */
+static inline void kernel_leave() 
+{ 
+  TCB* tcb = CURTHREAD;
+  if(--tcb->kernel_depth == 0) usage_kernel_leave(tcb);
+}
+
+
 /**
   @brief Create a new thread.
 
@@ -179,6 +237,18 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 void wakeup(TCB* tcb);
 
+/**
+  @brief Start a number of new threads.
+
+  This call is equivalent to calling @c wakeup() on each thread, but it adds them
+  to the scheduler queue at once. The threads must be new, i.e., in the @c INIT
+  state, and not yet known to any other thread.
+
+  @param tcbs the threads to start
+  @param n the number of threads
+*/
+void wakeup_spawned(TCB* tcbs[], int n);
+
 
 /** 
   @brief Block the current thread.
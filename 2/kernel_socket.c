@@ -1,10 +1,14 @@
 
+#include <stddef.h>
+
 #include "tinyos.h"
 #include "kernel_streams.h"
 #include "kernel_proc.h"
 #include "kernel_sched.h"
 #include "kernel_cc.h"
 
+SleepMutex port_lock = { 0, MUTEX_INIT, NULL, NULL };
+
 int socket_read(void* ctrl_block, char *buf, unsigned int size) {
 	
 	SCB* socket= (SCB*) ctrl_block;
@@ -12,9 +16,10 @@ int socket_read(void* ctrl_block, char *buf, unsigned int size) {
 	PCB* pcb= CURPROC;
 	if (accept_flag)
 		pcb= CURPROC->parent;
+	SleepMutex_Lock(& pcb->files_lock);
 	FCB* fcb= pcb->FIDT[socket->pe->receive];
-	
 	pipe_ctrl_block* pipe= fcb->streamobj;
+	SleepMutex_Unlock(& pcb->files_lock);
 	
 	return pipe_read(pipe, buf, size);	
 }
@@ -25,13 +30,22 @@ int socket_write(void* ctrl_block, const char* buf, unsigned int size) {
 	PCB* pcb= CURPROC;
 	if (accept_flag)
 		pcb= CURPROC->parent;
+	SleepMutex_Lock(& pcb->files_lock);
 	FCB* fcb= pcb->FIDT[socket->pe->send];
-	
 	pipe_ctrl_block* pipe= fcb->streamobj;
+	SleepMutex_Unlock(& pcb->files_lock);
 	
 	return pipe_write(pipe, buf, size);
 }
 
+/* Release a listener, after the readers of PORTS_TABLE are done with it */
+static void listener_release(rcu_head* rcu) {
+
+	SCB* socket= (SCB*) ((char*) rcu - offsetof(SCB, rcu));
+	free(socket->lis);
+	free(socket);
+}
+
 int socket_close(void* ctrl_block) {
 
 	SCB* socket= (SCB*) ctrl_block;
@@ -39,15 +53,20 @@ int socket_close(void* ctrl_block) {
 	if (socket== NULL)
 		goto error_socket_close;
 
+	/* The socket calls use the socket while holding port_lock */
+	SleepMutex_Lock(& port_lock);
+
 	if (socket->soc_t== LISTENER) {
-		PORTS_TABLE[socket->port]= NULL;
-		free(socket->lis);
+		__atomic_store_n(& PORTS_TABLE[socket->port], NULL, __ATOMIC_RELEASE);
+		rcu_call(& socket->rcu, listener_release);
 	}
-	
-	if (socket->soc_t== PEER)
-		free(socket->pe);
-	
-	free(socket);
+	else {
+		if (socket->soc_t== PEER)
+			free(socket->pe);
+		free(socket);
+	}
+
+	SleepMutex_Unlock(& port_lock);
 	
 	return 0; 
 
@@ -55,6 +74,18 @@ int socket_close(void* ctrl_block) {
 		return -1;
 }
 
+/* 
+	Return the listener of a port, or NULL. The caller must hold port_lock, or
+	be in an RCU read-side section.
+ */
+static inline SCB* port_listener(port_t port) {
+
+	if (port< 0 || port> MAX_PORT)
+		return NULL;
+	return __atomic_load_n(& PORTS_TABLE[port], __ATOMIC_ACQUIRE);
+}
+
+
 file_ops Socket_fops = {
   .Open = NULL,
   .Read = socket_read,
@@ -63,24 +94,45 @@ file_ops Socket_fops = {
 };
 
 
+/* 
+	Return the stream object of a fid of a process. The caller must hold port_lock, 
+	so that the socket is not freed by socket_close() while it is used. 
+ */
+static void* fid_streamobj(PCB* pcb, Fid_t fid) {
+
+	void* obj= NULL;
+
+	if (fid< 0 || fid>= MAX_FILEID)
+		return NULL;
+
+	SleepMutex_Lock(& pcb->files_lock);
+	FCB* fcb= pcb->FIDT[fid];
+	if (fcb!= NULL)
+		obj= fcb->streamobj;
+	SleepMutex_Unlock(& pcb->files_lock);
+
+	return obj;
+}
+
+
 Fid_t Socket(port_t port) {
 
 	FCB* fcb;
 	Fid_t fid;
 
-	Mutex_Lock(&kernel_mutex);
-
 	PCB* pcb = CURPROC;
 
 	if (accept_flag) 
 		pcb= CURPROC->parent;
 
+	SleepMutex_Lock(& pcb->files_lock);
+
 	if((port<0 || port>MAX_PORT))
 		goto error_socket;
 
 	if(!FCB_reserve(1, &fid, &fcb)) { // If the fids are exhausted 
 		error_socket:
-		Mutex_Unlock(&kernel_mutex);
+		SleepMutex_Unlock(& pcb->files_lock);
 		return NOFILE;
 	}
 	else {
@@ -98,7 +150,7 @@ Fid_t Socket(port_t port) {
 		fcb->streamobj = socket ;
 		fcb->streamfunc = &Socket_fops ;   
 		   
-		Mutex_Unlock(&kernel_mutex);	
+		SleepMutex_Unlock(& pcb->files_lock);
 
 		return fid ; 
 	}
@@ -106,20 +158,15 @@ Fid_t Socket(port_t port) {
 
 int Listen(Fid_t sock) {
 	
-	Mutex_Lock(&kernel_mutex);
+	SleepMutex_Lock(& port_lock);
 
 	if (sock== NOFILE || sock< 0 || sock> MAX_FILEID)
 		goto error_listen;
 
-	if (PORTS_TABLE[sock]!= NULL)
+	if (port_listener(sock)!= NULL)
 		goto error_listen;
 
-	FCB* fcb= get_fcb(sock);
-	
-	if (fcb== NULL)
-		goto error_listen;
-
-	SCB* socket=  fcb->streamobj;
+	SCB* socket= fid_streamobj(CURPROC, sock);
 
 	if (socket== NULL)
 		goto error_listen;
@@ -127,7 +174,7 @@ int Listen(Fid_t sock) {
 	if (socket->port== NOPORT) 
 		goto error_listen;
 
-	if (PORTS_TABLE[socket->port]!= NULL)
+	if (port_listener(socket->port)!= NULL)
 		goto error_listen;
 
 	if (socket->soc_t!= UNBOUND)
@@ -138,20 +185,22 @@ int Listen(Fid_t sock) {
 	socket->lis->requests=*(rlnode_init(&(socket->lis->requests), NULL));
 	socket->lis->cv=COND_INIT;
 	socket->lis->refcount= 0;
-	PORTS_TABLE[socket->port]=socket;
+	__atomic_store_n(& PORTS_TABLE[socket->port], socket, __ATOMIC_RELEASE);
 
-	Mutex_Unlock(&kernel_mutex);
+	SleepMutex_Unlock(& port_lock);
 	return 0;
 	
 	error_listen:
-	Mutex_Unlock(&kernel_mutex);
+	SleepMutex_Unlock(& port_lock);
 		return -1;
 }
 
 
 Fid_t Accept(Fid_t lsock) {
 
-	Mutex_Lock(&kernel_mutex);
+	kill_point();
+	kernel_enter();
+	SleepMutex_Lock(& port_lock);
 
 	if (lsock>MAX_FILEID-1 || lsock<0)
 		goto error_accept_without_req;
@@ -161,12 +210,7 @@ Fid_t Accept(Fid_t lsock) {
 	if (accept_flag) 
 		pcb= CURPROC->parent;
 
-	FCB* fcb= pcb->FIDT[lsock];
-	
-	if (fcb== NULL)
-		goto error_accept_without_req;
-	
-	SCB* lsocket= fcb->streamobj;
+	SCB* lsocket= fid_streamobj(pcb, lsock);
 
 	if (lsocket== NULL)
 		goto error_accept_without_req;
@@ -174,22 +218,14 @@ Fid_t Accept(Fid_t lsock) {
 	if (lsocket->soc_t!= LISTENER)
 		goto error_accept_without_req;
 	
-	port_t port;
-	int found=0;
-	for (port=0; port<MAX_PORT; port++) {
-		if (PORTS_TABLE[port]== lsocket) {
-			found=1;
-			break;
-		}
-	}
-	
-	if (!found)
+	if (port_listener(lsocket->port)!= lsocket)
 		goto error_accept_without_req;
 
-	SCB* listener= PORTS_TABLE[port];
+	SCB* listener= lsocket;
 
 	if (listener->lis->refcount== 0)
-		Cond_Wait(&kernel_mutex, &(listener->lis->cv), 0);
+		if (!SleepMutex_Wait(& port_lock, &(listener->lis->cv), 0))
+			goto error_accept_without_req;	/* The process was killed */
 
 	rlnode* node=(rlnode*)xmalloc(sizeof(rlnode));
 	node= rlist_pop_front(&(listener->lis->requests));
@@ -201,23 +237,18 @@ Fid_t Accept(Fid_t lsock) {
 	
 	SCB* connected_soc;
 
-	Mutex_Unlock(&kernel_mutex);
+	SleepMutex_Unlock(& port_lock);
 	Fid_t fid= Socket(connecting_soc->port);
-	Mutex_Lock(&kernel_mutex);
+	SleepMutex_Lock(& port_lock);
 	
 	if (fid==NOFILE)
 		goto error_accept_ref;
 
-	FCB* fcb1=get_fcb(fid);
+	connected_soc= fid_streamobj(pcb, fid);
 
-	if (accept_flag)
-		fcb1= pcb->FIDT[fid];
-
-	if (fcb1== NULL)
+	if (connected_soc== NULL)
 		goto error_accept_ref;
 
-	connected_soc= fcb1->streamobj;
-
 	FCB_incref(connected_soc->socket_fcb);
 	
 	connected_soc->pe=(peer*)xmalloc(sizeof(peer));
@@ -227,15 +258,15 @@ Fid_t Accept(Fid_t lsock) {
 	pipe_t pipe2;
 
 	//int tmp= accept_flag; //!!!
-	Mutex_Unlock(&kernel_mutex);
+	SleepMutex_Unlock(& port_lock);
 	//accept_flag=0;//!!!
 	
 	if (Pipe(&pipe1)==-1 || Pipe(&pipe2)==-1) { 
-		Mutex_Lock(&kernel_mutex);
+		SleepMutex_Lock(& port_lock);
 		goto error_accept_ref;
 	}
 	//accept_flag= tmp;//!!!
-	Mutex_Lock(&kernel_mutex);
+	SleepMutex_Lock(& port_lock);
 	
 	connected_soc->soc_t=PEER;
 	connecting_soc->soc_t=PEER;
@@ -248,26 +279,39 @@ Fid_t Accept(Fid_t lsock) {
 
 	Cond_Signal(&req->cv);
 
-	Mutex_Unlock(&kernel_mutex);
-	return connected_soc->sid;
+	Fid_t sid= connected_soc->sid;
+	SleepMutex_Unlock(& port_lock);
+	kernel_leave();
+	return sid;
 
 	error_accept_ref:
 		listener->lis->refcount--;
+		req->served=0;
 		Cond_Signal(&req->cv);
 	error_accept_without_req:
-		Mutex_Unlock(&kernel_mutex);
+		SleepMutex_Unlock(& port_lock);
+		kernel_leave();
 		return NOFILE;
 }
 
 
 int Connect(Fid_t sock, port_t port, timeout_t timeout) {
 
-	Mutex_Lock(&kernel_mutex);
+	kill_point();
 
-	if (port> MAX_PORT || port< 0)
-		goto error_connect;
+	/* Fail without taking port_lock, if there is no listener */
+	int rcu= rcu_read_lock();
+	SCB* lsocket= port_listener(port);
+	int listening= (lsocket!= NULL && lsocket->soc_t== LISTENER);
+	rcu_read_unlock(rcu);
 
-	if (PORTS_TABLE[port]== NULL)
+	if (!listening)
+		return -1;
+
+	SleepMutex_Lock(& port_lock);
+	kernel_enter();		/* The request must not be left behind by a kill */
+
+	if (port_listener(port)== NULL)
 		goto error_connect;
 
 	PCB* pcb= CURPROC;
@@ -275,12 +319,7 @@ int Connect(Fid_t sock, port_t port, timeout_t timeout) {
 	if (accept_flag) 
 		pcb= CURPROC->parent;
 
-	FCB* fcb= pcb->FIDT[sock];
-
-	if (fcb== NULL)
-		goto error_connect;
-
-	SCB* socket= fcb->streamobj;
+	SCB* socket= fid_streamobj(pcb, sock);
 
 	if (socket== NULL)
 		goto error_connect;
@@ -289,7 +328,7 @@ int Connect(Fid_t sock, port_t port, timeout_t timeout) {
 		goto error_connect;
 
 	rlnode* node=(rlnode*)xmalloc(sizeof(rlnode));
-	SCB* listener= PORTS_TABLE[port];
+	SCB* listener= port_listener(port);
 	request* req= (request*)xmalloc(sizeof(request));
 	req->socket= socket;
 	req->cv= COND_INIT;
@@ -301,30 +340,43 @@ int Connect(Fid_t sock, port_t port, timeout_t timeout) {
 		Cond_Broadcast(&listener->lis->cv);
 	listener->lis->refcount++;
 
-	Cond_Wait(&kernel_mutex, &req->cv, 0);
+	/* If the process is killed, withdraw the request, unless Accept has taken 
+	   it; then, wait for Accept to serve it, which does not wait for us */
+	while (req->served== -1) {
+		if (SleepMutex_Wait(& port_lock, &req->cv, 0))
+			continue;
+		if (node->next!= node) {
+			if (port_listener(port)== listener) {
+				rlist_remove(node);
+				listener->lis->refcount--;
+			}
+			break;
+		}
+		while (req->served== -1)
+			SleepMutex_WaitUnkillable(& port_lock, &req->cv);
+	}
 
-	if (req->served== -1)
+	if (req->served!= 1)
 		goto error_connect;
 
-	Mutex_Unlock(&kernel_mutex);
+	kernel_leave();
+	SleepMutex_Unlock(& port_lock);
 	return 0;
 
 	error_connect:
-		Mutex_Unlock(&kernel_mutex);
+		kernel_leave();
+		SleepMutex_Unlock(& port_lock);
 		return -1;
 }
 
 
 int ShutDown(Fid_t sock, shutdown_mode how) {
 	
-	Mutex_Lock(&kernel_mutex);
-
-	FCB* fcb= get_fcb(sock);
+	SleepMutex_Lock(& port_lock);
 
-	if (fcb== NULL)
-		goto error_shutdown;
+	PCB* pcb= CURPROC;
 
-	SCB* socket= (SCB*) fcb->streamobj;
+	SCB* socket= (SCB*) fid_streamobj(pcb, sock);
 	
 	if (socket== NULL)
 		goto error_shutdown;
@@ -332,15 +384,12 @@ int ShutDown(Fid_t sock, shutdown_mode how) {
 	if (socket->soc_t!= PEER)
 		goto error_shutdown; 
 
-	FCB* fcbr= get_fcb(socket->pe->receive);
-	FCB* fcbs= get_fcb(socket->pe->send);
+	pipe_ctrl_block* PipeCBreceive= fid_streamobj(pcb, socket->pe->receive);
+	pipe_ctrl_block* PipeCBsend= fid_streamobj(pcb, socket->pe->send);
 
-	if (fcbr== NULL || fcbs== NULL)
+	if (PipeCBreceive== NULL || PipeCBsend== NULL)
 		goto error_shutdown;
 	
-	pipe_ctrl_block* PipeCBreceive= fcbr->streamobj;
-	pipe_ctrl_block* PipeCBsend= fcbs->streamobj;
-	
 	if (how== SHUTDOWN_READ)
 		pipe_reader_close(PipeCBreceive);
 	
@@ -352,10 +401,10 @@ int ShutDown(Fid_t sock, shutdown_mode how) {
 		pipe_writer_close(PipeCBsend);	
 	}
 
-	Mutex_Unlock(&kernel_mutex);
+	SleepMutex_Unlock(& port_lock);
 	return 0;
 	
 	error_shutdown:
-		Mutex_Unlock(&kernel_mutex);
+		SleepMutex_Unlock(& port_lock);
 		return -1;
 }
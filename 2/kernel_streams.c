@@ -10,6 +10,7 @@
 
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
+static Mutex FCB_freelist_lock = MUTEX_INIT;
 
 void initialize_files()
 {
@@ -23,34 +24,38 @@ void initialize_files()
 
   for (port_t i=0; i<= MAX_PORT; i++)
     PORTS_TABLE[i]= NULL;
+
+  Mutex_Register(& FCB_freelist_lock, "fcb_freelist");
+  SleepMutex_Register(& port_lock, "port_lock");
 }
 
 FCB* acquire_FCB()
 {
+  FCB* fcb = NULL;
+  Mutex_Lock(& FCB_freelist_lock);
   if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
-    return fcb;
   }
-  else
-    return NULL;
+  Mutex_Unlock(& FCB_freelist_lock);
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  Mutex_Lock(& FCB_freelist_lock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Unlock(& FCB_freelist_lock);
 }
 
 void FCB_incref(FCB* fcb)
 {
-  fcb->refcount++;
+  __atomic_add_fetch(& fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
-  fcb->refcount --;
-  
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(& fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -59,8 +64,6 @@ int FCB_decref(FCB* fcb)
     return 0;
 }
 
-
-
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb) {
 
   PCB* cur = CURPROC;
@@ -110,6 +113,82 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
     }
 }
 
+/* Open a device into a new FCB, holding one reference, or return NULL */
+static FCB* open_fcb(Device_type major, unsigned int minor)
+{
+  FCB* fcb = acquire_FCB();
+  if(fcb == NULL) return NULL;
+  if(device_open(major, minor, & fcb->streamobj, &fcb->streamfunc)) {
+    release_FCB(fcb);
+    return NULL;
+  }
+  FCB_incref(fcb);
+  return fcb;
+}
+
+
+int fidt_build(const file_action* actions, FCB* fidt[])
+{
+  PCB* curproc = CURPROC;
+
+  /* Copy the table of the current process */
+  SleepMutex_Lock(& curproc->files_lock);
+  for(int i=0; i<MAX_FILEID; i++) {
+    fidt[i] = curproc->FIDT[i];
+    if(fidt[i]) 
+      FCB_incref(fidt[i]);
+  }
+  SleepMutex_Unlock(& curproc->files_lock);
+
+  /* The copy is private, so the actions need no lock */
+  for(const file_action* a = actions; a != NULL && a->kind != FILE_ACTION_END; a++) {
+    if(a->fid < 0 || a->fid >= MAX_FILEID)
+      goto fail;
+
+    FCB* fcb = NULL;
+    switch(a->kind) {
+      case FILE_ACTION_DUP:
+        if(a->arg < 0 || a->arg >= MAX_FILEID || fidt[a->arg] == NULL)
+          goto fail;
+        fcb = fidt[a->arg];
+        FCB_incref(fcb);
+        break;
+      case FILE_ACTION_CLOSE:
+        break;
+      case FILE_ACTION_OPEN_NULL:
+        if((fcb = open_fcb(DEV_NULL, 0)) == NULL)
+          goto fail;
+        break;
+      case FILE_ACTION_OPEN_TERMINAL:
+        if(a->arg < 0 || (fcb = open_fcb(DEV_SERIAL, a->arg)) == NULL)
+          goto fail;
+        break;
+      default:
+        goto fail;
+    }
+
+    if(fidt[a->fid])
+      FCB_decref(fidt[a->fid]);
+    fidt[a->fid] = fcb;
+  }
+  return 0;
+
+fail:
+  fidt_release(fidt);
+  return -1;
+}
+
+
+void fidt_release(FCB* fidt[])
+{
+  for(int i=0; i<MAX_FILEID; i++)
+    if(fidt[i]) {
+      FCB_decref(fidt[i]);
+      fidt[i] = NULL;
+    }
+}
+
+
 /*
  *
  *   I/O routines
@@ -134,10 +213,15 @@ PCB* get_parent(Fid_t fid)
 int Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
+  int (*devread)(void*,char*,uint) = NULL;
+  void* sobj = NULL;
+
+  /* A killed thread exits here. Past this point, it may hold a reference to an FCB */
+  kill_point();
+  kernel_enter();
 
-  Mutex_Lock(&kernel_mutex);
+  PCB* curproc = CURPROC;
+  SleepMutex_Lock(& curproc->files_lock);
   
   /* Get the fields from the stream */
   FCB* fcb = get_fcb(fd);
@@ -149,24 +233,25 @@ int Read(Fid_t fd, char *buf, unsigned int size)
     /* make sure that the stream will not be closed (by another thread) 
        while we are using it! */
     FCB_incref(fcb);
-  
-    /* We must not go into non-preemptive domain with kernel_mutex locked */
-    Mutex_Unlock(&kernel_mutex);  
+  }
 
+  /* We must not go into non-preemptive domain with files_lock locked */
+  SleepMutex_Unlock(& curproc->files_lock);
+
+  if(fcb) {
     if(devread)
       retcode = devread(sobj, buf, size);
 
+    if(retcode > 0) {
+      CURTHREAD->usage.bytes_read += retcode;
+      __atomic_add_fetch(& curproc->usage.bytes_read, retcode, __ATOMIC_RELAXED);
+    }
+
     /* Need to decrease the reference to FCB */
-    Mutex_Lock(& kernel_mutex);
     FCB_decref(fcb);
-
   }
-  
-  Mutex_Unlock(&kernel_mutex);  
-
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
+  kernel_leave();
   return retcode;
 }
 
@@ -177,34 +262,42 @@ int Write(Fid_t fd, const char *buf, unsigned int size)
   int (*devwrite)(void*, const char*, uint) = NULL;
   void* sobj = NULL;
 
-  Mutex_Lock(&kernel_mutex);
+  /* A killed thread exits here. Past this point, it may hold a reference to an FCB */
+  kill_point();
+  kernel_enter();
+
+  PCB* curproc = CURPROC;
+  SleepMutex_Lock(& curproc->files_lock);
   
   /* Get the fields from the stream */
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
-
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
     /* make sure that the stream will not be closed (by another thread) 
        while we are using it! */
     FCB_incref(fcb);
-  
-    /* We must not go into non-preemptive domain with kernel_mutex locked */
-    Mutex_Unlock(&kernel_mutex);  
+  }
 
+  /* We must not go into non-preemptive domain with files_lock locked */
+  SleepMutex_Unlock(& curproc->files_lock);
+
+  if(fcb) {
     if(devwrite)
       retcode = devwrite(sobj, buf, size);
 
+    if(retcode > 0) {
+      CURTHREAD->usage.bytes_written += retcode;
+      __atomic_add_fetch(& curproc->usage.bytes_written, retcode, __ATOMIC_RELAXED);
+    }
+
     /* Need to decrease the reference to FCB */
-    Mutex_Lock(& kernel_mutex);
     FCB_decref(fcb);
-
   }
 
-  Mutex_Unlock(& kernel_mutex);
-
+  kernel_leave();
   return retcode;
 }
 
@@ -212,16 +305,18 @@ int Write(Fid_t fd, const char *buf, unsigned int size)
 int Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
-  Mutex_Lock(&kernel_mutex);
-
+  kernel_enter();
+  PCB* curproc = CURPROC;
+  SleepMutex_Lock(& curproc->files_lock);
   FCB* fcb = get_fcb(fd);
+  if(fcb)
+    curproc->FIDT[fd] = NULL;
+  SleepMutex_Unlock(& curproc->files_lock);
 
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  if(fcb)
     retcode = FCB_decref(fcb);    
-  }
 
-  Mutex_Unlock(&kernel_mutex);  
+  kernel_leave();
   return retcode;
 }
 
@@ -238,22 +333,30 @@ int Dup2(int oldfd, int newfd)
   int retcode=0;
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
-  Mutex_Lock(&kernel_mutex);
+
+  kernel_enter();
+  PCB* curproc = CURPROC;
+  SleepMutex_Lock(& curproc->files_lock);
 
   FCB* old = get_fcb(oldfd);
   FCB* new = get_fcb(newfd);
+  FCB* closed = NULL;
 
   if(old==NULL) {
     retcode = -1;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
+    closed = new;
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    curproc->FIDT[newfd] = old;
   }
 
-  Mutex_Unlock(&kernel_mutex);  
+  SleepMutex_Unlock(& curproc->files_lock);
+
+  /* Close the stream previously at newfd, without holding files_lock */
+  if(closed)
+    FCB_decref(closed);
+  kernel_leave();
   return retcode;
 }
 
@@ -272,8 +375,8 @@ Fid_t open_stream(Device_type major, unsigned int minor)
 {
   Fid_t fid;
   FCB* fcb;
-  Mutex_Lock(&kernel_mutex);
-
+  PCB* curproc = CURPROC;
+  SleepMutex_Lock(& curproc->files_lock);
 
   if(! FCB_reserve(1, &fid, &fcb))
       goto finerr;
@@ -287,7 +390,7 @@ Fid_t open_stream(Device_type major, unsigned int minor)
 finerr:
   fid = NOFILE;
 finok:
-  Mutex_Unlock(&kernel_mutex);
+  SleepMutex_Unlock(& curproc->files_lock);
   return fid;
 }
 
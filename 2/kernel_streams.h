@@ -3,6 +3,8 @@
 
 #include "tinyos.h"
 #include "kernel_dev.h"
+#include "kernel_cc.h"
+#include "kernel_rcu.h"
 
 /**
 	@file kernel_streams.h
@@ -60,6 +62,7 @@ typedef struct socket_control_block {
   socket_t soc_t;
   FCB* socket_fcb; //to be erased
   rlnode freelist_node;
+  rcu_head rcu;         /**< @brief For the deferred release of a listener */
   union {
     listener* lis;
     peer* pe;
@@ -85,9 +88,17 @@ typedef struct req {
   CondVar cv;
 } request;
 
-int write_flag;
+/**
+  @brief The listener sockets, by port.
+
+  The table is updated under @c port_lock. It may also be read without the
+  lock, inside an RCU read-side section (see @c rcu_read_lock()): a listener
+  removed from the table is released by @c rcu_call().
+ */
+SCB* PORTS_TABLE[MAX_PORT+1];
 
-SCB* PORTS_TABLE[MAX_PORT];
+/** @brief The lock of @c PORTS_TABLE and of the listener and request state of sockets */
+extern SleepMutex port_lock;
 
 /** 
   @brief Initialization for files and streams.
@@ -100,6 +111,9 @@ void initialize_files();
 /**
 	@brief Increase the reference count of an fcb 
 
+	The reference count is updated atomically. To take a new reference from
+	a file table, @c files_lock of the process must be held.
+
 	@param fcb the fcb whose reference count will be increased
 */
 void FCB_incref(FCB* fcb);
@@ -112,6 +126,9 @@ void FCB_incref(FCB* fcb);
 	Close method and returning its return value.
 	If the reference count is still >0, return 0. 
 
+	This must be called without holding any kernel locks, since the @c Close() 
+	operation may sleep, or lock the resources of the stream.
+
 	@param fcb  the fcb whose reference count is decreased
 	@returns if the reference count is still >0, return 0, else return the value returned by the
 	     `Close()` operation
@@ -131,6 +148,10 @@ int FCB_decref(FCB* fcb);
    If these resources are not needed, the operation can be
    reversed by calling @ref FCB_unreserve.
 
+   This must be called with @c files_lock of the current process locked. The 
+   lock should be held until the FCBs are initialized, so that other threads 
+   never see a half-opened stream.
+
    @param num the number of resources to reserve.
    @param fid array of size at least `num` of `Fid_t`.
    @param fcb array of size at least `num` of `FCB*`.
@@ -161,7 +182,8 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 /** @brief Translate an fid to an FCB.
 
-	This routine will return NULL if the fid is not legal.
+	This routine will return NULL if the fid is not legal. It must be called 
+	with @c files_lock of the current process locked.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -169,6 +191,26 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Build a file table for a new process.
+
+	The table is a copy of the file table of the current process, taken
+	under its @c files_lock, to which the @c actions are then applied 
+	(see @c ExecWithFiles). Every stream in the table holds a reference,
+	to be dropped by @ref fidt_release.
+
+	This must be called without any locks held, since it may close streams.
+
+	@param actions the file actions, or NULL
+	@param fidt an array of @c MAX_FILEID entries, to hold the table
+	@returns 0 on success, or -1 if an action failed, in which case the 
+	  table holds nothing.
+ */
+int fidt_build(const file_action* actions, FCB* fidt[]);
+
+/** @brief Drop the references of a table built by @ref fidt_build. */
+void fidt_release(FCB* fidt[]);
+
+
 SCB* acquire_SCB();
 
 void release_SCB(SCB* scb);
@@ -189,7 +231,7 @@ typedef struct pipe_control_block // Pipe () has to create one of these
 
   char buffer[BUF_SIZE] ;
 
-    Mutex mut ; 
+    SleepMutex mut ; 
 
   int head ; 
     int numOfElements ; 
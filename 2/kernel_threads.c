@@ -5,38 +5,69 @@
 #include "kernel_cc.h"
 
 Mutex exitmutex = MUTEX_INIT; 
+
+/*
+  Find the record of thread tid in the NT list of pcb, or return NULL.
+  This only compares the Tids, so it never touches the TCB of a thread
+  that has exited (which may have been released).
+  Must be called with pcb->lock held.
+ */
+static NTCB* find_thread(PCB* pcb, Tid_t tid)
+{
+  for(rlnode* n = pcb->NT.next; n != &pcb->NT; n = n->next)
+    if((Tid_t) n->ntcb->ntcb_thread == tid)
+      return n->ntcb;
+  return NULL;
+}
+
+/*
+  Drop the record of a thread from its process.
+  Must be called with pcb->lock held.
+ */
+static void drop_thread(PCB* pcb, NTCB* ntcb)
+{
+  rlist_remove(& ntcb->ntcb_node);
+  pcb->ntcb_count--;
+  release_NTCB(ntcb);
+}
+
 /** 
   @brief Create a new thread in the current process.
   */
 Tid_t CreateThread(Task task, int argl, void* args) {
 
-  Mutex_Lock(&kernel_mutex);
-
+  kill_point();
   PCB* current_proc=CURPROC;
+  SleepMutex_Lock(& current_proc->lock);
     
-  NTCB* curntcb;
-  curntcb=(NTCB*)acquire_NTCB();
-  curntcb->parent=current_proc;
-  curntcb->main_task=task; 
-  curntcb->argl=argl;
-  curntcb->args=args;
-  rlnode* node=(rlnode*)xmalloc(sizeof(rlnode));
-  node=rlnode_init(node, curntcb);
-  (&current_proc->NT)->ntcb=(NTCB*)acquire_NTCB();
-  current_proc->NT=*node;
-  rlist_push_front(&current_proc->NT,node);
+  NTCB* ntcb = acquire_NTCB();
+  if(ntcb == NULL) {
+    SleepMutex_Unlock(& current_proc->lock);
+    return NOTHREAD;
+  }
+
+  ntcb->parent=current_proc;
+  ntcb->main_task=task; 
+  ntcb->argl=argl;
+  ntcb->args=args;
+  ntcb->exitval=0;
+  ntcb->exited=0;
+  ntcb->joiners=0;
+  ntcb->flag_detach=0;
+  ntcb->join_var=COND_INIT;
+  rlnode_init(& ntcb->ntcb_node, ntcb);
+  rlist_push_back(& current_proc->NT, & ntcb->ntcb_node);
   current_proc->ntcb_count++;
   current_proc->active_thread_count++; 
 
-  (&current_proc->NT)->ntcb->ntcb_thread=spawn_thread(current_proc, start_thread);
-  wakeup((&current_proc->NT)->ntcb->ntcb_thread);
+  TCB* tcb = spawn_thread(current_proc, start_thread);
+  tcb->owner_ntcb = ntcb;
+  ntcb->ntcb_thread = tcb;
+  wakeup(tcb);
   
-  Mutex_Unlock(&kernel_mutex);
+  SleepMutex_Unlock(& current_proc->lock);
 
-  Tid_t tid=(Tid_t)(&current_proc->NT)->ntcb->ntcb_thread;
-  release_NTCB(curntcb);
-
-  return tid;
+  return (Tid_t) tcb;
 }
 
 /**
@@ -51,46 +82,40 @@ Tid_t ThreadSelf() {
   */
 int ThreadJoin(Tid_t tid, int* exitval) {
   
-  Mutex_Lock(& kernel_mutex);
-  
-  rlnode* NT = &CURPROC->NT;
-  TCB *tcb_tmp = (TCB*)tid;
-  NTCB* owner;
-  owner=(NTCB*)acquire_NTCB();
-  owner=tcb_tmp->owner_ntcb;
+  kill_point();
+  PCB* curproc = CURPROC;
+  SleepMutex_Lock(& curproc->lock);
   
-  rlnode* node=(rlnode*)xmalloc(sizeof(rlnode));
-  rlnode* fail=(rlnode*)xmalloc(sizeof(rlnode));
-  node=rlnode_init(node, owner);
-  fail=rlnode_init(fail, owner);
-  if (CURPROC->ntcb_count==0)
-    goto unsuccessful;
-  node=rlist_find(NT, owner, fail);
+  NTCB* owner = find_thread(curproc, tid);
 
   /* Legality checks */
-  if (CURTHREAD==tcb_tmp || owner->flag_detach==1 || node==fail ) { 
-    goto unsuccessful;
+  if (owner==NULL || tid==ThreadSelf() || owner->flag_detach==1) { 
+    SleepMutex_Unlock(& curproc->lock);
+    return -1;
   }
   
-  /* Wait for it to exit. */
-  Cond_Wait(&kernel_mutex, &owner->join_var,0); 
-
-  if (owner->flag_detach!=1) {
-    *exitval=owner->exitval;  
+  /* Wait for it to exit, or to be detached, or for a kill. We must not be 
+     killed while we count as a joiner. */
+  kernel_enter();
+  owner->joiners++;
+  while (!owner->exited && !owner->flag_detach)
+    if(! SleepMutex_Wait(& curproc->lock, &owner->join_var, 0))
+      break;
+  owner->joiners--;
+
+  int ret = -1;
+  if (owner->exited && owner->flag_detach!=1) {
+    if(exitval) *exitval=owner->exitval;  
+    ret = 0;
   }
-  else {
-    goto unsuccessful;
-  }
-  
-  /*success*/
-  Mutex_Unlock(& kernel_mutex);
-  release_NTCB(owner);
-  return 0;
 
-  unsuccessful:
-    Mutex_Unlock(& kernel_mutex);
-    release_NTCB(owner);
-    return -1;
+  /* The last joiner of an exited thread drops its record */
+  if (owner->exited && owner->joiners==0)
+    drop_thread(curproc, owner);
+
+  kernel_leave();
+  SleepMutex_Unlock(& curproc->lock);
+  return ret;
 }
 
 /**
@@ -98,35 +123,21 @@ int ThreadJoin(Tid_t tid, int* exitval) {
   */
 int ThreadDetach(Tid_t tid) { 
 
-  Mutex_Lock(& kernel_mutex);
-
-  TCB *tcb_tmp = (TCB*)tid;
-  NTCB* owner;
-  owner=(NTCB*)acquire_NTCB();
-  owner=tcb_tmp->owner_ntcb;
+  PCB* curproc = CURPROC;
+  SleepMutex_Lock(& curproc->lock);
 
-  rlnode* NT = &CURPROC->NT;
-  rlnode* node=(rlnode*)xmalloc(sizeof(rlnode));
-  rlnode* fail=(rlnode*)xmalloc(sizeof(rlnode));
-  node=rlnode_init(node, NULL);
-  fail=rlnode_init(fail, NULL);
-  node=rlist_find(NT, tcb_tmp, fail);
+  NTCB* owner = find_thread(curproc, tid);
 
-	if (tcb_tmp->state==EXITED || node==fail) {
-    goto unsuccessful;
+	if (owner==NULL || owner->exited) {
+    SleepMutex_Unlock(& curproc->lock);
+    return -1;
   }
 
   owner->flag_detach=1;
   Cond_Broadcast(&owner->join_var);
 
-  Mutex_Unlock(& kernel_mutex);
-  release_NTCB(owner);
+  SleepMutex_Unlock(& curproc->lock);
   return 0;
-
-  unsuccessful:
-    Mutex_Unlock(& kernel_mutex);
-    release_NTCB(owner);
-    return -1;
 }
 
 /**
@@ -134,13 +145,44 @@ int ThreadDetach(Tid_t tid) {
   */
 void ThreadExit(int exitval) { 
   
-  Mutex_Lock(& kernel_mutex); 
+  /* The thread is leaving: it may not be killed any more */
+  kernel_enter();
   TCB* thread=CURTHREAD;
-  CondVar* cv=&thread->owner_ntcb->join_var;
-  CURPROC->active_thread_count--;
-  Cond_Broadcast(cv);
+  thread->exiting=1;
+  NTCB* owner=thread->owner_ntcb;
+
+  /* The main thread has no record; it exits the process */
+  if(owner == NULL)
+    main_thread_exit(exitval);
+
+  PCB* curproc = CURPROC;
+  SleepMutex_Lock(& curproc->lock); 
+  owner->exitval=exitval;
+  owner->exited=1;
+  curproc->active_thread_count--;
+  Cond_Broadcast(&owner->join_var);
+  Cond_Broadcast(&curproc->thread_exit);
+
+  /* Nobody will join a detached thread */
+  if(owner->flag_detach && owner->joiners==0)
+    drop_thread(curproc, owner);
   
-  sleep_releasing(EXITED, & kernel_mutex,0);
+  SleepMutex_Unlock(& curproc->lock);
+  sleep_releasing(EXITED, NULL, 0);
+}
+
+
+void release_thread_records(PCB* pcb)
+{
+  SleepMutex_Lock(& pcb->lock);
+  rlnode* n = pcb->NT.next;
+  while(n != &pcb->NT) {
+    NTCB* ntcb = n->ntcb;
+    n = n->next;
+    if(ntcb->exited && ntcb->joiners==0)
+      drop_thread(pcb, ntcb);
+  }
+  SleepMutex_Unlock(& pcb->lock);
 }
 
 
@@ -0,0 +1,134 @@
+
+#include <assert.h>
+#include <time.h>
+
+#include "kernel_sched.h"
+#include "kernel_trace.h"
+
+/**
+	@file kernel_trace.c
+
+	@brief The implementation of the scheduler trace recorder.
+  */
+
+#ifdef SCHED_TRACE
+
+/* Per-core trace buffer */
+typedef struct {
+  sched_trace_record* rec;
+  uint64_t count;
+  uint64_t dropped;
+} trace_buffer;
+
+static trace_buffer TRACEBUF[MAX_CORES];
+
+/* The time the trace started, and the thread id counter */
+static struct timespec trace_epoch;
+static uint32_t trace_next_id;
+
+
+static inline uint64_t trace_now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)(t.tv_sec - trace_epoch.tv_sec)*1000000000ull
+    + t.tv_nsec - trace_epoch.tv_nsec;
+}
+
+
+void sched_trace_init()
+{
+  for(int c=0; c<MAX_CORES; c++) {
+    TRACEBUF[c].rec = NULL;
+    TRACEBUF[c].count = TRACEBUF[c].dropped = 0;
+  }
+  trace_next_id = 0;
+  CHECK(clock_gettime(CLOCK_MONOTONIC, &trace_epoch));
+}
+
+
+void sched_trace(TCB* tcb, sched_trace_event event, int flags)
+{
+  if(tcb->type == IDLE_THREAD) return;
+
+  /* New threads get their id at the first wakeup */
+  if(flags & TRACE_FLAG_NEW)
+    tcb->trace_id = __atomic_add_fetch(&trace_next_id, 1, __ATOMIC_RELAXED);
+
+  trace_buffer* buf = & TRACEBUF[cpu_core_id];
+
+  /* Allocate lazily, so that unused cores cost nothing */
+  if(buf->rec == NULL)
+    buf->rec = xmalloc(SCHED_TRACE_RECORDS * sizeof(sched_trace_record));
+
+  if(buf->count == SCHED_TRACE_RECORDS) {
+    buf->dropped++;
+    return;
+  }
+
+  sched_trace_record* r = & buf->rec[buf->count++];
+  r->time = trace_now();
+  r->thread = tcb->trace_id;
+  r->event = event;
+  r->core = cpu_core_id;
+  r->priority = tcb->priority;
+  r->flags = flags;
+}
+
+
+void sched_trace_dump()
+{
+  const char* fname = getenv("TINYOS_SCHED_TRACE");
+  if(fname==NULL) fname = SCHED_TRACE_FILE;
+
+  FILE* f = fopen(fname, "w");
+  if(f==NULL) {
+    perror("sched_trace_dump");
+    goto cleanup;
+  }
+
+  sched_trace_header hdr = {
+    .magic = SCHED_TRACE_MAGIC,
+    .version = SCHED_TRACE_VERSION,
+    .ncores = cpu_cores(),
+    .quantum = QUANTUM,
+    .max_levels = MAX_LEVELS,
+    .boost_period = MAX_QUANTUM_COUNTER,
+    .nrecords = 0,
+    .dropped = 0
+  };
+
+  for(int c=0; c<MAX_CORES; c++) {
+    hdr.nrecords += TRACEBUF[c].count;
+    hdr.dropped += TRACEBUF[c].dropped;
+  }
+
+  CHECK_CONDITION(fwrite(&hdr, sizeof(hdr), 1, f)==1);
+
+  /* Merge the per-core buffers by time. The per-core buffers are already
+     sorted, so we just pick the smallest head each time. */
+  uint64_t pos[MAX_CORES] = { 0 };
+  for(uint64_t n=0; n<hdr.nrecords; n++) {
+    int best = -1;
+    for(int c=0; c<MAX_CORES; c++) {
+      if(pos[c] == TRACEBUF[c].count) continue;
+      if(best==-1 || TRACEBUF[c].rec[pos[c]].time < TRACEBUF[best].rec[pos[best]].time)
+        best = c;
+    }
+    assert(best != -1);
+    CHECK_CONDITION(fwrite(& TRACEBUF[best].rec[pos[best]++], sizeof(sched_trace_record), 1, f)==1);
+  }
+
+  fclose(f);
+
+  if(hdr.dropped)
+    fprintf(stderr, "sched_trace: %lu records dropped (buffers full)\n", (unsigned long)hdr.dropped);
+
+cleanup:
+  for(int c=0; c<MAX_CORES; c++) {
+    free(TRACEBUF[c].rec);
+    TRACEBUF[c].rec = NULL;
+  }
+}
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef __KERNEL_TRACE_H
+#define __KERNEL_TRACE_H
+
+/**
+  @file kernel_trace.h
+  @brief TinyOS kernel: The scheduler trace recorder.
+
+  @defgroup trace Scheduler trace
+  @ingroup kernel
+  @brief The scheduler trace recorder.
+
+  When the kernel is compiled with @c SCHED_TRACE defined (e.g., by
+  `make SCHED_TRACE=1`), the scheduler records a compact binary trace of
+  the life of every normal thread: wakeups, dispatches, yields, blocks and
+  exits, each with a timestamp.
+
+  Each core records into its own buffer (the recording happens in the
+  non-preemptive domain, so no locking is needed). When the scheduler stops,
+  the per-core buffers are merged by time and written to the file
+  named by the @c TINYOS_SCHED_TRACE environment variable, or to
+  @c SCHED_TRACE_FILE if it is not set.
+
+  The file format is defined in this header, so that offline tools
+  (see @c sched_sim.c) can read it without linking to the kernel.
+  A trace file consists of a @c sched_trace_header followed by
+  @c nrecords objects of type @c sched_trace_record, in non-decreasing
+  order of time.
+
+  @{
+*/
+
+#include <stdint.h>
+
+/** @brief The magic number at the start of a trace file ("TSTR"). */
+#define SCHED_TRACE_MAGIC  0x52545354u
+
+/** @brief The version of the trace file format. */
+#define SCHED_TRACE_VERSION 1
+
+/** @brief The default trace file name. */
+#define SCHED_TRACE_FILE "sched.trace"
+
+/** @brief Maximum number of records kept per core. Further records are dropped. */
+#define SCHED_TRACE_RECORDS (1<<18)
+
+/** @brief Scheduler trace event types. */
+typedef enum {
+  TRACE_WAKEUP,     /**< The thread became @c READY (flag @c TRACE_FLAG_NEW if it was @c INIT) */
+  TRACE_DISPATCH,   /**< The thread started a new timeslice on a core */
+  TRACE_YIELD,      /**< The thread gave up the core, but remains @c READY */
+  TRACE_BLOCK,      /**< The thread blocked (became @c STOPPED) */
+  TRACE_EXIT        /**< The thread exited */
+} sched_trace_event;
+
+/** @brief Event flags */
+enum {
+  TRACE_FLAG_NEW = 1,       /**< A wakeup of a new thread */
+  TRACE_FLAG_IO = 2,        /**< The yield or block came from an I/O wait */
+  TRACE_FLAG_QUANTUM = 4    /**< The yield was caused by quantum expiry */
+};
+
+/** @brief The trace file header. */
+typedef struct {
+  uint32_t magic;        /**< Must be @c SCHED_TRACE_MAGIC */
+  uint16_t version;      /**< Must be @c SCHED_TRACE_VERSION */
+  uint16_t ncores;       /**< Number of cores of the traced run */
+  uint32_t quantum;      /**< The quantum in usec */
+  uint16_t max_levels;   /**< Number of MLFQ levels */
+  uint16_t boost_period; /**< The MLFQ boost period (in yields) */
+  uint64_t nrecords;     /**< The number of records following the header */
+  uint64_t dropped;      /**< The number of records that did not fit in the buffers */
+} sched_trace_header;
+
+/** @brief A trace record (16 bytes). */
+typedef struct {
+  uint64_t time;         /**< Nanoseconds since the trace started */
+  uint32_t thread;       /**< A unique thread id (never re-used during a trace) */
+  uint8_t  event;        /**< A @c sched_trace_event */
+  uint8_t  core;         /**< The core that recorded the event */
+  uint8_t  priority;     /**< The MLFQ level of the thread at the time of the event */
+  uint8_t  flags;        /**< A bitmask of @c TRACE_FLAG_... values */
+} sched_trace_record;
+
+
+#ifdef SCHED_TRACE
+
+#include "util.h"
+
+/**
+  @brief Initialize the trace buffers.
+
+  This is called by @c initialize_scheduler().
+ */
+void sched_trace_init(void);
+
+/**
+  @brief Record an event for a thread.
+
+  This must be called in the non-preemptive domain. Idle threads
+  are not traced.
+ */
+void sched_trace(TCB* tcb, sched_trace_event event, int flags);
+
+/**
+  @brief Write the trace to a file and release the buffers.
+
+  This is called by core 0, after the scheduler has stopped.
+ */
+void sched_trace_dump(void);
+
+/** @brief Record a trace event, if tracing is compiled in. */
+#define SCHED_TRACE_EVENT(tcb, event, flags)  sched_trace((tcb), (event), (flags))
+
+#else
+
+#define SCHED_TRACE_EVENT(tcb, event, flags)
+
+#endif
+
+/** @} */
+
+#endif
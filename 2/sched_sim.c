@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "kernel_trace.h"
+#include "bench.h"
+
+/*
+  A standalone scheduler simulator.
+
+  This program reads a scheduler trace recorded by a kernel built with
+  SCHED_TRACE=1 (see kernel_trace.h) and replays the recorded workload
+  through the MLFQ logic of the kernel and through some alternative policies.
+
+  The trace is first turned into a workload: for each thread, its arrival time
+  and a sequence of segments, each consisting of a CPU burst followed by a
+  blocking period. The workload is then replayed on a simulated machine with
+  the same number of cores, and the following are reported for each policy:
+  - response time percentiles (time from wakeup to dispatch)
+  - mean turnaround time (from thread creation to exit)
+  - makespan, throughput (threads/sec) and core utilization
+
+  The row named 'recorded' is computed directly from the trace, so that the
+  simulated numbers can be compared with the real run.
+ */
+
+
+/*
+  Workload
+ */
+
+typedef struct {
+  uint64_t cpu;      /* CPU demand of the burst (nsec) */
+  uint64_t sleep;    /* Time blocked after the burst (nsec) */
+  int io;            /* The burst ended with an I/O block */
+} segment;
+
+typedef struct sim_thread {
+  uint32_t id;
+  int valid;
+  uint64_t arrival;
+
+  segment* seg;
+  int nseg, segcap;
+
+  /* Used while reading the trace */
+  int running, blocked, exited;
+  uint64_t run_start, block_time, wake_time;
+
+  /* Used by the simulation */
+  int cur;                   /* current segment */
+  uint64_t remaining;        /* CPU left in current segment */
+  int level;                 /* MLFQ level */
+  uint64_t ready_since;      /* time of last wakeup */
+  int pending_response;      /* a wakeup has not been dispatched yet */
+  uint64_t finish;
+  struct sim_thread* qnext;  /* ready queue link */
+} sim_thread;
+
+
+static sim_thread* THR = NULL;
+static uint32_t nthr = 0, thrcap = 0;
+static sched_trace_header HDR;
+
+
+/* A growable array of time intervals, used for percentiles */
+typedef struct {
+  uint64_t* v;
+  size_t n, cap;
+} samples;
+
+static void samples_add(samples* s, uint64_t x)
+{
+  if(s->n == s->cap) {
+    s->cap = s->cap ? 2*s->cap : 1024;
+    s->v = realloc(s->v, s->cap*sizeof(uint64_t));
+    if(s->v == NULL) { perror("realloc"); exit(1); }
+  }
+  s->v[s->n++] = x;
+}
+
+/* A percentile of the (sorted) samples, in usec */
+static double samples_pct(samples* s, double p)
+{
+  return percentile(s->v, s->n, p) / 1000.0;
+}
+
+
+static sim_thread* get_thread(uint32_t id)
+{
+  if(id >= thrcap) {
+    uint32_t newcap = thrcap ? thrcap : 1024;
+    while(newcap <= id) newcap *= 2;
+    THR = realloc(THR, newcap*sizeof(sim_thread));
+    if(THR == NULL) { perror("realloc"); exit(1); }
+    memset(THR+thrcap, 0, (newcap-thrcap)*sizeof(sim_thread));
+    thrcap = newcap;
+  }
+  if(id >= nthr) nthr = id+1;
+  return & THR[id];
+}
+
+static segment* new_segment(sim_thread* t)
+{
+  if(t->nseg == t->segcap) {
+    t->segcap = t->segcap ? 2*t->segcap : 4;
+    t->seg = realloc(t->seg, t->segcap*sizeof(segment));
+    if(t->seg == NULL) { perror("realloc"); exit(1); }
+  }
+  segment* s = & t->seg[t->nseg++];
+  s->cpu = s->sleep = 0;
+  s->io = 0;
+  return s;
+}
+
+
+/*
+  Read the trace and build the workload. The response times of the
+  recorded run are added to 'resp'.
+ */
+static void read_trace(const char* fname, samples* resp)
+{
+  FILE* f = fopen(fname, "r");
+  if(f == NULL) { perror(fname); exit(1); }
+
+  if(fread(&HDR, sizeof(HDR), 1, f) != 1
+    || HDR.magic != SCHED_TRACE_MAGIC || HDR.version != SCHED_TRACE_VERSION) {
+    fprintf(stderr, "%s: not a scheduler trace (or wrong version)\n", fname);
+    exit(1);
+  }
+
+  sched_trace_record r;
+  for(uint64_t n=0; n<HDR.nrecords; n++) {
+    if(fread(&r, sizeof(r), 1, f) != 1) {
+      fprintf(stderr, "%s: truncated trace\n", fname);
+      exit(1);
+    }
+
+    sim_thread* t = get_thread(r.thread);
+
+    if(r.event == TRACE_WAKEUP && (r.flags & TRACE_FLAG_NEW)) {
+      t->id = r.thread;
+      t->valid = 1;
+      t->arrival = t->wake_time = r.time;
+      new_segment(t);
+      continue;
+    }
+    if(! t->valid || t->exited) continue;
+
+    segment* s = & t->seg[t->nseg-1];
+
+    switch(r.event) {
+      case TRACE_WAKEUP:
+        if(t->blocked) {
+          s->sleep = r.time - t->block_time;
+          t->blocked = 0;
+          new_segment(t);
+        }
+        t->wake_time = r.time;
+        break;
+      case TRACE_DISPATCH:
+        if(t->wake_time) {
+          samples_add(resp, r.time - t->wake_time);
+          t->wake_time = 0;
+        }
+        t->run_start = r.time;
+        t->running = 1;
+        break;
+      case TRACE_YIELD:
+      case TRACE_BLOCK:
+      case TRACE_EXIT:
+        if(t->running) {
+          s->cpu += r.time - t->run_start;
+          t->running = 0;
+        }
+        if(r.event == TRACE_BLOCK) {
+          s->io = (r.flags & TRACE_FLAG_IO) != 0;
+          t->blocked = 1;
+          t->block_time = r.time;
+        }
+        if(r.event == TRACE_EXIT) {
+          t->exited = 1;
+          t->finish = r.time;
+        }
+        break;
+    }
+  }
+
+  fclose(f);
+}
+
+
+/*
+  Policies.
+
+  All policies are expressed as parameters of a multilevel feedback queue,
+  which is the kernel's algorithm: round-robin is a single level, and fcfs
+  is round-robin with an infinite quantum.
+ */
+
+typedef struct {
+  const char* name;
+  int levels;            /* number of levels */
+  uint64_t quantum;      /* quantum in nsec */
+  int boost_period;      /* boost every this many slices, 0 for never */
+  int boost_direct;      /* boost directly to level 0 (else, step-by-step) */
+} policy;
+
+#define MAX_SIM_LEVELS 64
+#define MAX_SIM_CORES 256
+
+
+/* A binary heap of timed events (arrivals and wakeups) */
+typedef struct { uint64_t time; sim_thread* t; } timed;
+static timed* heap;
+static size_t heapn, heapcap;
+
+static void heap_push(uint64_t time, sim_thread* t)
+{
+  if(heapn == heapcap) {
+    heapcap = heapcap ? 2*heapcap : 1024;
+    heap = realloc(heap, heapcap*sizeof(timed));
+    if(heap == NULL) { perror("realloc"); exit(1); }
+  }
+  size_t i = heapn++;
+  while(i>0 && heap[(i-1)/2].time > time) {
+    heap[i] = heap[(i-1)/2];
+    i = (i-1)/2;
+  }
+  heap[i] = (timed){ time, t };
+}
+
+static timed heap_pop()
+{
+  timed top = heap[0], last = heap[--heapn];
+  size_t i = 0;
+  for(;;) {
+    size_t c = 2*i+1;
+    if(c >= heapn) break;
+    if(c+1 < heapn && heap[c+1].time < heap[c].time) c++;
+    if(last.time <= heap[c].time) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  if(heapn) heap[i] = last;
+  return top;
+}
+
+
+/* Ready queues */
+static sim_thread *qhead[MAX_SIM_LEVELS], *qtail[MAX_SIM_LEVELS];
+
+static void enqueue(sim_thread* t)
+{
+  t->qnext = NULL;
+  if(qtail[t->level]) qtail[t->level]->qnext = t;
+  else qhead[t->level] = t;
+  qtail[t->level] = t;
+}
+
+static sim_thread* dequeue(int levels)
+{
+  for(int l=0; l<levels; l++)
+    if(qhead[l]) {
+      sim_thread* t = qhead[l];
+      qhead[l] = t->qnext;
+      if(qhead[l]==NULL) qtail[l] = NULL;
+      return t;
+    }
+  return NULL;
+}
+
+static void boost(policy* p)
+{
+  for(int l=1; l<p->levels; l++) {
+    int to = p->boost_direct ? 0 : l-1;
+    while(qhead[l]) {
+      sim_thread* t = qhead[l];
+      qhead[l] = t->qnext;
+      t->level = to;
+      enqueue(t);
+    }
+    qtail[l] = NULL;
+  }
+}
+
+
+typedef struct {
+  samples resp;
+  double turnaround;   /* mean, in usec */
+  uint64_t first, last;
+  unsigned long completed;
+  uint64_t busy;
+} result;
+
+
+static void simulate(policy* p, int ncores, result* res)
+{
+  struct { sim_thread* t; uint64_t start, end; } core[MAX_SIM_CORES];
+  uint64_t now = 0;
+  unsigned long slices = 0;
+  double tsum = 0.0;
+
+  memset(res, 0, sizeof(result));
+  memset(qhead, 0, sizeof(qhead));
+  memset(qtail, 0, sizeof(qtail));
+  heapn = 0;
+  for(int c=0; c<ncores; c++) core[c].t = NULL;
+
+  res->first = UINT64_MAX;
+  for(uint32_t i=0; i<nthr; i++) {
+    sim_thread* t = & THR[i];
+    if(! t->valid) continue;
+    t->cur = 0;
+    t->remaining = t->seg[0].cpu;
+    t->level = 0;
+    t->pending_response = 0;
+    heap_push(t->arrival, t);
+    if(t->arrival < res->first) res->first = t->arrival;
+  }
+
+  for(;;) {
+    /* Dispatch to idle cores */
+    for(int c=0; c<ncores; c++) {
+      if(core[c].t) continue;
+      sim_thread* t = dequeue(p->levels);
+      if(t == NULL) break;
+      if(t->pending_response) {
+        samples_add(& res->resp, now - t->ready_since);
+        t->pending_response = 0;
+      }
+      uint64_t slice = t->remaining < p->quantum ? t->remaining : p->quantum;
+      core[c].t = t;
+      core[c].start = now;
+      core[c].end = now + slice;
+    }
+
+    /* Find the next event */
+    uint64_t next = UINT64_MAX;
+    for(int c=0; c<ncores; c++)
+      if(core[c].t && core[c].end < next) next = core[c].end;
+    if(heapn && heap[0].time < next) next = heap[0].time;
+    if(next == UINT64_MAX) break;
+    now = next;
+
+    /* Expire slices */
+    for(int c=0; c<ncores; c++) {
+      sim_thread* t = core[c].t;
+      if(t == NULL || core[c].end > now) continue;
+      core[c].t = NULL;
+
+      uint64_t ran = core[c].end - core[c].start;
+      t->remaining -= ran;
+      res->busy += ran;
+
+      if(p->boost_period && ++slices > p->boost_period) {
+        slices = 0;
+        boost(p);
+      }
+
+      if(t->remaining > 0) {
+        /* Quantum expired: demote */
+        if(t->level < p->levels-1) t->level++;
+        enqueue(t);
+      }
+      else if(t->cur == t->nseg-1) {
+        /* The thread exits */
+        t->finish = now;
+        res->completed++;
+        tsum += now - t->arrival;
+        res->last = now;
+      }
+      else {
+        /* The thread blocks; I/O-bound threads are promoted */
+        segment* s = & t->seg[t->cur];
+        if(s->io && t->level > 0) t->level--;
+        t->cur++;
+        t->remaining = t->seg[t->cur].cpu;
+        heap_push(now + s->sleep, t);
+      }
+    }
+
+    /* Wakeups */
+    while(heapn && heap[0].time <= now) {
+      sim_thread* t = heap_pop().t;
+      t->ready_since = now;
+      t->pending_response = 1;
+      enqueue(t);
+    }
+  }
+
+  res->turnaround = res->completed ? tsum / res->completed / 1000.0 : 0.0;
+}
+
+
+static void print_header()
+{
+  printf("%-12s %10s %10s %10s %10s %12s %12s %10s %6s\n",
+    "policy", "resp_p50", "resp_p90", "resp_p99", "resp_max",
+    "turnaround", "makespan", "thr/sec", "util");
+}
+
+static void print_result(const char* name, result* r, int ncores)
+{
+  samples* s = & r->resp;
+  sort_u64(s->v, s->n);
+  uint64_t makespan = (r->last > r->first) ? r->last - r->first : 0;
+  double secs = makespan / 1e9;
+  printf("%-12s %10.0f %10.0f %10.0f %10.0f %12.0f %12.0f %10.1f %5.1f%%\n",
+    name,
+    samples_pct(s, 0.5), samples_pct(s, 0.9), samples_pct(s, 0.99), samples_pct(s, 1.0),
+    r->turnaround, makespan/1000.0,
+    secs>0 ? r->completed/secs : 0.0,
+    makespan ? 100.0*r->busy/((double)makespan*ncores) : 0.0);
+}
+
+
+void usage(const char* pname)
+{
+  printf("usage:\n  %s [-c <cores>] [-q <quantum>] [-l <levels>] [-b <boost>] [-p <policy>] <tracefile>\n\n\
+    Replay a scheduler trace through several scheduling policies.\n\
+    All times are reported in microseconds.\n\n\
+    where:\n\
+    <cores> is the number of simulated cores (default: as recorded),\n\
+    <quantum> is the quantum in usec (default: as recorded),\n\
+    <levels> is the number of MLFQ levels (default: as recorded),\n\
+    <boost> is the MLFQ boost period in slices (default: as recorded),\n\
+    <policy> is one of mlfq, mlfq-direct, rr, fcfs (default: all).\n",
+    pname);
+  exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+  int ncores = 0, levels = 0, bperiod = -1;
+  long quantum = 0;
+  const char* only = NULL;
+  int opt;
+
+  while((opt = getopt(argc, argv, "c:q:l:b:p:")) != -1) {
+    switch(opt) {
+      case 'c': ncores = atoi(optarg); break;
+      case 'q': quantum = atol(optarg); break;
+      case 'l': levels = atoi(optarg); break;
+      case 'b': bperiod = atoi(optarg); break;
+      case 'p': only = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if(optind != argc-1) usage(argv[0]);
+
+  result rec;
+  memset(&rec, 0, sizeof(rec));
+  read_trace(argv[optind], & rec.resp);
+
+  if(ncores <= 0) ncores = HDR.ncores;
+  if(ncores <= 0 || ncores > MAX_SIM_CORES) usage(argv[0]);
+  if(levels <= 0) levels = HDR.max_levels;
+  if(levels > MAX_SIM_LEVELS) usage(argv[0]);
+  if(quantum <= 0) quantum = HDR.quantum;
+  if(bperiod < 0) bperiod = HDR.boost_period;
+
+  /* Statistics of the recorded run */
+  double tsum = 0.0;
+  rec.first = UINT64_MAX;
+  unsigned long nvalid = 0;
+  for(uint32_t i=0; i<nthr; i++) {
+    sim_thread* t = & THR[i];
+    if(! t->valid) continue;
+    nvalid++;
+    if(t->arrival < rec.first) rec.first = t->arrival;
+    for(int s=0; s<t->nseg; s++) rec.busy += t->seg[s].cpu;
+    if(t->exited) {
+      rec.completed++;
+      tsum += t->finish - t->arrival;
+      if(t->finish > rec.last) rec.last = t->finish;
+    }
+  }
+  rec.turnaround = rec.completed ? tsum / rec.completed / 1000.0 : 0.0;
+
+  printf("trace %s: %lu records (%lu dropped), %lu threads, %u cores, quantum=%u, levels=%u, boost=%u\n",
+    argv[optind], (unsigned long)HDR.nrecords, (unsigned long)HDR.dropped, nvalid,
+    HDR.ncores, HDR.quantum, HDR.max_levels, HDR.boost_period);
+  printf("simulating %d cores, quantum=%ld, levels=%d, boost=%d\n\n",
+    ncores, quantum, levels, bperiod);
+
+  policy policies[] = {
+    { "mlfq", levels, quantum*1000ull, bperiod, 0 },
+    { "mlfq-direct", levels, quantum*1000ull, bperiod, 1 },
+    { "rr", 1, quantum*1000ull, 0, 0 },
+    { "fcfs", 1, UINT64_MAX, 0, 0 },
+    { NULL }
+  };
+
+  print_header();
+  if(only == NULL)
+    print_result("recorded", &rec, HDR.ncores);
+
+  int found = 0;
+  for(policy* p = policies; p->name; p++) {
+    if(only && strcmp(only, p->name)!=0) continue;
+    found = 1;
+    result res;
+    simulate(p, ncores, &res);
+    print_result(p->name, &res, ncores);
+    free(res.resp.v);
+  }
+  if(! found) usage(argv[0]);
+
+  return 0;
+}
@@ -0,0 +1,229 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "util.h"
+#include "bench.h"
+#include "bios.h"
+#include "tinyos.h"
+
+
+/*
+ 	A benchmark of semaphores and barriers, against the equivalent
+ 	constructions with a Mutex and a CondVar.
+
+ 	The workloads are:
+
+ 	- sem:     producer threads take batches of free slots from a bounded
+ 	           buffer and pass them as items to consumer threads, which take
+ 	           them in batches of a different size.
+ 	- barrier: all threads go through a barrier repeatedly.
+
+ 	Each workload is implemented twice:
+
+ 	- native:  with Semaphore (Sem_P/Sem_V) and Barrier (Barrier_Wait)
+ 	- condvar: with a Mutex and CondVars. Since waiters need different numbers
+ 	           of units, a counting semaphore must broadcast on every V, and
+ 	           a barrier broadcasts to release every phase.
+
+ 	The benchmark reports the throughput, in P operations (sem) or barrier
+ 	phases (barrier) per second.
+ */
+
+typedef enum { W_SEM, W_BARRIER, W_COUNT } workload_t;
+static const char* workload_name[W_COUNT] = { "sem", "barrier" };
+
+typedef struct {
+	workload_t w;          /* the workload */
+	int condvar;           /* use the condvar implementation */
+	int threads;           /* the number of threads */
+	int ops;               /* loop iterations per thread */
+	double elapsed;        /* returned by the boot task (sec) */
+} bench_t;
+
+
+
+/* A counting semaphore and a barrier, made of a Mutex and a CondVar */
+
+typedef struct { Mutex mx; CondVar cv; unsigned long value; } cv_sem;
+
+static void cv_sem_P(cv_sem* s, unsigned int n)
+{
+	Mutex_Lock(& s->mx);
+	while(s->value < n)
+		Cond_Wait(& s->mx, & s->cv, 0);
+	s->value -= n;
+	Mutex_Unlock(& s->mx);
+}
+
+static void cv_sem_V(cv_sem* s, unsigned int n)
+{
+	Mutex_Lock(& s->mx);
+	s->value += n;
+	Cond_Broadcast(& s->cv);
+	Mutex_Unlock(& s->mx);
+}
+
+typedef struct { Mutex mx; CondVar cv; int n, arrived; unsigned long phase; } cv_barrier;
+
+static void cv_barrier_wait(cv_barrier* b)
+{
+	Mutex_Lock(& b->mx);
+	if(++b->arrived == b->n) {
+		b->arrived = 0;
+		b->phase++;
+		Cond_Broadcast(& b->cv);
+	} else {
+		unsigned long phase = b->phase;
+		while(phase == b->phase)
+			Cond_Wait(& b->mx, & b->cv, 0);
+	}
+	Mutex_Unlock(& b->mx);
+}
+
+
+/* The shared state of a run */
+static bench_t* B;
+static int next_id;
+static Semaphore space, items;
+static cv_sem cv_space, cv_items;
+static Barrier barrier;
+static cv_barrier cv_bar;
+
+#define SLOTS 16
+#define PBATCH 3
+#define CBATCH 2
+
+/* Half of the threads are producers and half are consumers. Each of them
+   moves ops*PBATCH*CBATCH units, so that they all finish */
+static int bench_thread(int argl, void* args)
+{
+	int id = __atomic_fetch_add(&next_id, 1, __ATOMIC_SEQ_CST);
+	int producer = (id % 2 == 0);
+
+	switch(B->w) {
+	case W_SEM:
+		if(producer) {
+			for(int i=0; i<B->ops*CBATCH; i++)
+				if(B->condvar) {
+					cv_sem_P(&cv_space, PBATCH);
+					cv_sem_V(&cv_items, PBATCH);
+				} else {
+					Sem_P(&space, PBATCH);
+					Sem_V(&items, PBATCH);
+				}
+		} else {
+			for(int i=0; i<B->ops*PBATCH; i++)
+				if(B->condvar) {
+					cv_sem_P(&cv_items, CBATCH);
+					cv_sem_V(&cv_space, CBATCH);
+				} else {
+					Sem_P(&items, CBATCH);
+					Sem_V(&space, CBATCH);
+				}
+		}
+		break;
+
+	case W_BARRIER:
+		for(int i=0; i<B->ops; i++)
+			if(B->condvar) cv_barrier_wait(&cv_bar); else Barrier_Wait(&barrier);
+		break;
+
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* The threads are joined implicitly, when the main thread returns */
+static int bench_proc(int argl, void* args)
+{
+	for(int i=0; i<B->threads; i++)
+		CreateThread(bench_thread, 0, NULL);
+	return 0;
+}
+
+static int boot_bench(int argl, void* args)
+{
+	next_id = 0;
+	space = SEMAPHORE_INIT(SLOTS);
+	items = SEMAPHORE_INIT(0);
+	cv_space = (cv_sem){ MUTEX_INIT, COND_INIT, SLOTS };
+	cv_items = (cv_sem){ MUTEX_INIT, COND_INIT, 0 };
+	barrier = BARRIER_INIT(B->threads);
+	cv_bar = (cv_barrier){ MUTEX_INIT, COND_INIT, B->threads, 0, 0 };
+
+	uint64_t t0 = now_nsec();
+	Exec(bench_proc, 0, NULL);
+	WaitChild(NOPROC, NULL);
+	B->elapsed = (now_nsec() - t0) / 1e9;
+	return 0;
+}
+
+
+/* Run the benchmark and return the throughput */
+static double run(uint ncores, bench_t* bench)
+{
+	B = bench;
+	boot(ncores, 0, boot_bench, 0, NULL);
+	if(B->w == W_SEM)
+		return (double) (B->threads/2) * B->ops * (CBATCH+PBATCH) / B->elapsed;
+	else
+		return (double) B->ops / B->elapsed;
+}
+
+
+void usage(const char* pname)
+{
+	printf("usage:\n  %s [-c <ncores>] [-t <threads>] [-n <ops>] [-w <workload>]\n\n\
+    where:\n\
+    <ncores> is the number of cpu cores to use (default 4),\n\
+    <threads> is the number of threads, an even number (default 4*ncores),\n\
+    <ops> is the number of loop iterations per thread (default 2000),\n\
+    <workload> is one of sem, barrier (default: both of them).\n",
+		pname);
+	exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned int ncores = 4;
+	int threads = 0, ops = 2000;
+	int wfirst = 0, wlast = W_COUNT-1;
+	int opt;
+
+	while((opt = getopt(argc, argv, "c:t:n:w:")) != -1) {
+		switch(opt) {
+			case 'c': ncores = atoi(optarg); break;
+			case 't': threads = atoi(optarg); break;
+			case 'n': ops = atoi(optarg); break;
+			case 'w':
+				for(wfirst=0; wfirst<W_COUNT; wfirst++)
+					if(strcmp(optarg, workload_name[wfirst])==0) break;
+				if(wfirst==W_COUNT) usage(argv[0]);
+				wlast = wfirst;
+				break;
+			default: usage(argv[0]);
+		}
+	}
+	if(threads == 0) threads = 4*ncores;
+
+	if(optind != argc || ncores < 1 || ncores > MAX_CORES || threads < 2 || threads % 2 || ops < 1)
+		usage(argv[0]);
+
+	printf("%-8s %8s %8s %8s %14s\n", "workload", "impl", "cores", "threads", "ops/sec");
+	for(int w=wfirst; w<=wlast; w++)
+		for(int condvar=0; condvar<=1; condvar++) {
+			bench_t bench = { .w = w, .condvar = condvar, .threads = threads, .ops = ops };
+			double tput = run(ncores, &bench);
+			printf("%-8s %8s %8u %8d %14.0f\n", workload_name[w], condvar ? "condvar" : "native",
+				ncores, threads, tput);
+			fflush(stdout);
+		}
+
+	return 0;
+}
@@ -53,10 +53,13 @@ int RIGHT(int i, int N) { return (i+N-1) % N; }
 
 /* Prints the current state given a change (described by fmt) for
  philosopher ph */
-void print_state(int N, PHIL* state, const char* fmt, int ph)
+void print_state(SymposiumTable* S, const char* fmt, int ph)
 {
 #if QUIET==0
+  int N = S->symp->N;
+  PHIL* state = S->state;
   int i;
+  if(S->quiet) return;
   if(N<100) {
     for(i=0;i<N;i++) {
       char c= (".THE")[state[i]];
@@ -80,8 +83,9 @@ void trytoeat(SymposiumTable* S, int i)
 
   if(state[i]==HUNGRY && state[LEFT(i,N)]!=EATING && state[RIGHT(i,N)]!=EATING) {
     state[i] = EATING;
-    print_state(N, state, "     %d is eating\n",i);
-    Cond_Signal(&(S->hungry[i]));
+    print_state(S, "     %d is eating\n",i);
+    if(! S->herd)
+      Cond_Signal(&(S->hungry[i]));
   }
 }
 
@@ -95,38 +99,47 @@ void SymposiumTable_philosopher(SymposiumTable* S, int i)
   int fmax = S->symp->fmax;
   PHIL* state = S->state;
 
-  Mutex_Lock(& S->mx);		/* Philosopher arrives in thinking state */
+  SleepMutex_Lock(& S->mx);		/* Philosopher arrives in thinking state */
   state[i] = THINKING;
-  print_state(N, state, "     %d has arrived\n",i);
-  Mutex_Unlock(& S->mx);
+  print_state(S, "     %d has arrived\n",i);
+  SleepMutex_Unlock(& S->mx);
 
   for(int j=0; j<bites; j++) {	/* Number of bites (mpoykies) */
     think(fmin, fmax);
 
-    Mutex_Lock(& S->mx);
+    SleepMutex_Lock(& S->mx);
     state[i] = HUNGRY;
     trytoeat(S,i);		/* This may not succeed */
     while(state[i]==HUNGRY) {
-      print_state(N, state, "     %d waits hungry\n",i);
-      Cond_Wait(& S->mx, &(S->hungry[i]),0); /* If hungry we sleep. trytoeat(i) will wake us. */
+      print_state(S, "     %d waits hungry\n",i);
+      if(S->herd) {
+        SleepMutex_Wait(& S->mx, &(S->changed), 0);  /* Somebody stopped eating, check again */
+        trytoeat(S,i);
+        if(state[i]==HUNGRY) S->futile++;
+      } else
+        SleepMutex_Wait(& S->mx, &(S->hungry[i]),0); /* If hungry we sleep. trytoeat(i) will wake us. */
     }
     assert(state[i]==EATING); 
-    Mutex_Unlock(& S->mx);
+    SleepMutex_Unlock(& S->mx);
     
     eat(fmin, fmax);
 
-    Mutex_Lock(& S->mx);
+    SleepMutex_Lock(& S->mx);
     state[i] = THINKING;	/* We are done eating, think again */
-    print_state(N, state, "     %d is thinking\n",i);
-    trytoeat(S, LEFT(i,N));		/* Check if our left and right can eat NOW. */
-    trytoeat(S, RIGHT(i,N));
-    Mutex_Unlock(& S->mx);
+    print_state(S, "     %d is thinking\n",i);
+    if(S->herd)
+      Cond_Broadcast(&(S->changed));	/* Let everyone check */
+    else {
+      trytoeat(S, LEFT(i,N));		/* Check if our left and right can eat NOW. */
+      trytoeat(S, RIGHT(i,N));
+    }
+    SleepMutex_Unlock(& S->mx);
   }
 
-  Mutex_Lock(& S->mx);
+  SleepMutex_Lock(& S->mx);
   state[i] = NOTHERE;		/* We are done (eaten all the bites) */
-  print_state(N, state, "     %d is leaving\n",i);
-  Mutex_Unlock(& S->mx);
+  print_state(S, "     %d is leaving\n",i);
+  SleepMutex_Unlock(& S->mx);
 }
 
 
@@ -134,9 +147,16 @@ void SymposiumTable_philosopher(SymposiumTable* S, int i)
 void SymposiumTable_init(SymposiumTable* table, symposium_t* symp)
 {
 	table->symp = symp;
-	table->mx = MUTEX_INIT;
-	table->state = (PHIL*) xmalloc(symp->N * sizeof(PHIL));
-	table->hungry = (CondVar*) xmalloc(symp->N * sizeof(CondVar));
+	table->mx = SLEEPMUTEX_INIT;
+	table->changed = COND_INIT;
+	table->herd = 0;
+	table->quiet = 0;
+	table->futile = 0;
+	table->seats = 0;
+	/* The table is freed with the process, if destroy is never called */
+	table->state = (PHIL*) MemAlloc(symp->N * sizeof(PHIL));
+	table->hungry = (CondVar*) MemAlloc(symp->N * sizeof(CondVar));
+	assert(table->state != NULL && table->hungry != NULL);
 	for(int i=0; i<symp->N; i++) {
 		table->state[i] = NOTHERE;
 		table->hungry[i] = COND_INIT;
@@ -145,20 +165,20 @@ void SymposiumTable_init(SymposiumTable* table, symposium_t* symp)
 
 void SymposiumTable_destroy(SymposiumTable* table)
 {
-	free(table->state);
-	free(table->hungry);
+	MemFree(table->state);
+	MemFree(table->hungry);
 }
 
 
 
-typedef struct { int i; SymposiumTable* S; } philosopher_args;
-
-/* Philosopher process */
+/* Philosopher process. All philosophers share the same arguments (the table),
+   and each one takes the next free seat. */
 int PhilosopherProcess(int argl, void* args)
 {
-	assert(argl == sizeof(philosopher_args));
-	philosopher_args* A = args;
-	SymposiumTable_philosopher(A->S, A->i);
+	assert(argl == sizeof(SymposiumTable*));
+	SymposiumTable* S = *(SymposiumTable**) args;
+	int i = __atomic_fetch_add(& S->seats, 1, __ATOMIC_RELAXED);
+	SymposiumTable_philosopher(S, i);
 	return 0;
 }
 
@@ -177,12 +197,11 @@ int SymposiumOfProcesses(int argl, void* args)
   SymposiumTable_init(&S, symp);
   
   /* Execute philosophers */
-  for(int i=0;i<N;i++) {
-    philosopher_args Args;
-    Args.i = i;
-    Args.S = &S;
-    Exec(PhilosopherProcess, sizeof(Args), &Args);
-  }  
+  SymposiumTable* table = &S;
+  SharedArgs* Args = SharedArgs_Create(sizeof(table), &table);
+  for(int i=0;i<N;i++)
+    ExecShared(PhilosopherProcess, Args);
+  SharedArgs_Release(Args);
 
   /* Wait for philosophers to exit */  
   for(int i=0;i<N;i++) {
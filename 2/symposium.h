@@ -111,15 +111,27 @@ void adjust_symposium(symposium_t* table, int dBASE, int dGAP);
 	threads/processes.
 */
 typedef struct {
-	Mutex mx;			/**< Monitor mutex */
+	SleepMutex mx;		/**< Monitor mutex */
 	symposium_t* symp; 	/**< The symposium definition */
 	PHIL* state;		/**< state[i] i=1...N]: Philosopher state */
 	CondVar* hungry;    /**< hungry[i] i=...N: condition var for philosophers */
+	CondVar changed;	/**< In a herd symposium, all hungry philosophers wait here */
+	int herd;			/**< Non-zero for a herd symposium */
+	int quiet;			/**< Non-zero to suppress printing */
+	unsigned long futile;	/**< Wakeups of hungry philosophers that could not eat */
+	int seats;			/**< The next seat taken by a philosopher process */
 } SymposiumTable;
 
 
 /** @brief Initialize a symposium monitor.
 
+	The monitor is initialized with @c herd and @c quiet set to 0.
+	In a herd symposium, a philosopher who stops eating does not
+	check whether its neighbors can eat; instead it wakes up all hungry
+	philosophers (by broadcasting @c changed), and each of them checks
+	for itself. Most of them just go back to sleep; this is the classic
+	"thundering herd", which is used to benchmark condition variables.
+
 	Note: this method allocates memory.
 	Therefore, @ref SymposiumTable_destroy must be called 
 
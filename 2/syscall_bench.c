@@ -0,0 +1,197 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "util.h"
+#include "bench.h"
+#include "bios.h"
+#include "tinyos.h"
+
+
+/*
+ 	A multi-core benchmark of system call scalability.
+
+ 	A number of unrelated processes (none is the parent of another,
+ 	and they share no streams) run the same system call loop in
+ 	parallel. Since each process has its own file table and child
+ 	lists, the only kernel locks they share are the free lists of
+ 	FCBs and PCBs (and the process table, for exec). Therefore, the
+ 	throughput should grow with the number of processes, up to the
+ 	number of cores.
+
+ 	The workloads are:
+
+ 	- open:  OpenNull() and Close()
+ 	- pipe:  Pipe(), a one-byte Write() and Read(), and two Close()
+ 	- rw:    Write() and Read() of one byte, on a pipe opened once
+ 	- exec:  Exec() of an empty process and WaitChild()
+ 	- spawn: Exec() of SPAWN_BATCH empty processes in a loop, then WaitChild()
+ 	         for each of them (an iteration is one process)
+ 	- spawnmany: the same, with a single ExecMany() per batch, and
+ 	         WaitChildren() to reap the batch
+
+ 	For each workload and number of processes, the benchmark reports the
+ 	total throughput in loop iterations per second, and the speedup over
+ 	a single process.
+ */
+
+typedef enum { W_OPEN, W_PIPE, W_RW, W_EXEC, W_SPAWN, W_SPAWNMANY, W_COUNT } workload_t;
+
+static const char* workload_name[W_COUNT] = { "open", "pipe", "rw", "exec", "spawn", "spawnmany" };
+
+#define SPAWN_BATCH 16
+
+typedef struct {
+	workload_t w;          /* the workload */
+	int procs;             /* the number of processes */
+	int ops;               /* loop iterations per process */
+	double elapsed;        /* returned by the boot task (sec) */
+} bench_t;
+
+
+
+static int empty_proc(int argl, void* args)
+{
+	return 0;
+}
+
+static int bench_proc(int argl, void* args)
+{
+	bench_t* B = (bench_t*) args;
+	char c = 'x';
+	pipe_t p;
+
+	switch(B->w) {
+	case W_OPEN:
+		for(int i=0; i<B->ops; i++)
+			Close(OpenNull());
+		break;
+
+	case W_PIPE:
+		for(int i=0; i<B->ops; i++) {
+			if(Pipe(&p) == -1) return 1;
+			Write(p.write, &c, 1);
+			Read(p.read, &c, 1);
+			Close(p.read);
+			Close(p.write);
+		}
+		break;
+
+	case W_RW:
+		if(Pipe(&p) == -1) return 1;
+		for(int i=0; i<B->ops; i++) {
+			Write(p.write, &c, 1);
+			Read(p.read, &c, 1);
+		}
+		Close(p.read);
+		Close(p.write);
+		break;
+
+	case W_EXEC:
+		for(int i=0; i<B->ops; i++) {
+			Exec(empty_proc, 0, NULL);
+			WaitChild(NOPROC, NULL);
+		}
+		break;
+
+	case W_SPAWN:
+	case W_SPAWNMANY:
+		for(int i=0; i<B->ops; i+=SPAWN_BATCH) {
+			if(B->w == W_SPAWN) {
+				for(int k=0; k<SPAWN_BATCH; k++)
+					Exec(empty_proc, 0, NULL);
+				for(int k=0; k<SPAWN_BATCH; k++)
+					WaitChild(NOPROC, NULL);
+			} else {
+				Pid_t pids[SPAWN_BATCH];
+				ExecMany(empty_proc, SPAWN_BATCH, 0, NULL, NULL);
+				for(int k=0; k<SPAWN_BATCH; )
+					k += WaitChildren(pids, NULL, SPAWN_BATCH-k);
+			}
+		}
+		break;
+
+	default:
+		return 1;
+	}
+	return 0;
+}
+
+static int boot_bench(int argl, void* args)
+{
+	bench_t* B = *(bench_t**) args;
+
+	/* Each process gets its own copy of *B */
+	uint64_t t0 = now_nsec();
+	for(int i=0; i<B->procs; i++)
+		Exec(bench_proc, sizeof(*B), B);
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	B->elapsed = (now_nsec() - t0) / 1e9;
+	return 0;
+}
+
+
+/* Run the benchmark and return the throughput */
+static double run(uint ncores, bench_t* B)
+{
+	boot(ncores, 0, boot_bench, sizeof(B), &B);
+	return (double) B->procs * B->ops / B->elapsed;
+}
+
+
+void usage(const char* pname)
+{
+	printf("usage:\n  %s [-c <ncores>] [-p <procs>] [-n <ops>] [-w <workload>]\n\n\
+    where:\n\
+    <ncores> is the number of cpu cores to use (default 4),\n\
+    <procs> is the maximum number of processes (default ncores),\n\
+    <ops> is the number of loop iterations per process (default 20000),\n\
+    <workload> is one of open, pipe, rw, exec, spawn, spawnmany (default: all of them).\n",
+		pname);
+	exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned int ncores = 4;
+	int maxprocs = 0, ops = 20000;
+	int wfirst = 0, wlast = W_COUNT-1;
+	int opt;
+
+	while((opt = getopt(argc, argv, "c:p:n:w:")) != -1) {
+		switch(opt) {
+			case 'c': ncores = atoi(optarg); break;
+			case 'p': maxprocs = atoi(optarg); break;
+			case 'n': ops = atoi(optarg); break;
+			case 'w':
+				for(wfirst=0; wfirst<W_COUNT; wfirst++)
+					if(strcmp(optarg, workload_name[wfirst])==0) break;
+				if(wfirst==W_COUNT) usage(argv[0]);
+				wlast = wfirst;
+				break;
+			default: usage(argv[0]);
+		}
+	}
+	if(maxprocs == 0) maxprocs = ncores;
+
+	if(optind != argc || ncores < 1 || ncores > MAX_CORES || maxprocs < 1 || ops < 1)
+		usage(argv[0]);
+
+	printf("%-8s %8s %8s %14s %10s\n", "workload", "cores", "procs", "ops/sec", "speedup");
+	for(int w=wfirst; w<=wlast; w++) {
+		double base = 0.0;
+		for(int procs=1; procs<=maxprocs; procs*=2) {
+			bench_t B = { .w = w, .procs = procs, .ops = ops };
+			double tput = run(ncores, &B);
+			if(procs == 1) base = tput;
+			printf("%-8s %8u %8d %14.0f %10.2f\n", workload_name[w], ncores, procs, tput, tput/base);
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}
@@ -31,9 +31,12 @@ typedef int Pid_t;		/* The PID type  */
 /** @brief The invalid PID */
 #define NOPROC (-1)
 
-/** @brief The maximum number of processes */
+/** @brief The maximum number of processes.
+    A lower limit may be set at boot, by the environment variable @c TINYOS_MAX_PROC. */
 #define MAX_PROC 65536
 
+/** @brief The maximum number of threads (other than main threads).
+    A lower limit may be set at boot, by the environment variable @c TINYOS_MAX_THREADS. */
 #define MAX_NTCB 98304
 
 /** @brief The type of a file ID. */
@@ -66,11 +69,15 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    The mutex is a single machine word, whose meaning depends on the lock
+    algorithm used by the kernel (a test-and-set flag, a pair of tickets
+    or the tail of an MCS queue). In all cases, 0 means unlocked.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef unsigned long Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -103,19 +110,41 @@ void Mutex_Lock(Mutex*);
 */
 void Mutex_Unlock(Mutex*);
 
+/** @brief Name a mutex, for the lock contention profiler.
+
+  The name must be a string that remains valid while TinyOS runs (e.g., a literal). 
+  Only the registered mutexes are profiled separately; the rest are counted 
+  together, under "(other)".
+  This call does nothing if the profiler is disabled.
+  @see OpenLockInfo
+  @see Mutex_Unregister
+ */
+void Mutex_Register(Mutex* mx, const char* name);
+
+/** @brief Release the name of a mutex, before its memory is freed or reused.
+
+  The statistics of the mutex are dropped, and its entry becomes available
+  to other mutexes.
+  @see Mutex_Register
+ */
+void Mutex_Unregister(Mutex* mx);
+
 
 /** @brief Condition variables.
 
   A condition variable is used for longer synchronization. This implementation
   can be used both in the pre-emptive and in the non-preemptive domain.
 
+  Waiters are woken in FIFO order: @c Cond_Signal wakes the thread that has
+  waited the longest.
+
   @see Cond_Wait
   @see Cond_Signal
   @see Cond_Broadcast
   @see COND_INIT
  */
 typedef struct {
-  void *waitset;        /**< The set of waiting threads */
+  void *waitset;        /**< The queue of waiting threads (points to its tail) */
   Mutex waitset_lock;   /**< A mutex to protect `waitset` */
 } CondVar;
 
@@ -141,6 +170,8 @@ typedef struct {
   A thread may wake up if,
   - another thread called @c Cond_Signal or @c Cond_Broadcast
   - the thread becomes interrupted
+  - its process is killed (see @c KillGroup); then the thread does not 
+    sleep any more, and it exits right away, unless it holds other locks
   - other reasons, not specified
 
   Note that, it may be possible for both a signal and an interrupt
@@ -150,6 +181,7 @@ typedef struct {
   @param mx The mutex to be unlocked as the thread sleeps.
   @param cv The condition variable to sleep on.
   @returns 1 if this thread was woken up by signal/broadcast, 0 otherwise
+    (e.g., if its process was killed)
   @see Cond_Signal
   @see Cond_Broadcast
   */
@@ -173,7 +205,244 @@ void Cond_Signal(CondVar*);
   @see Cond_Wait
   @see Cond_Signal
 */
-void Cond_Broadcast(CondVar*); 
+void Cond_Broadcast(CondVar*);
+
+
+/**
+  @brief A sleeping mutex.
+
+  A thread that finds the mutex locked spins for a little while, but only 
+  as long as the owner is running on another core. Then, it joins a FIFO
+  wait queue and sleeps. When the owner unlocks the mutex, it wakes up
+  the first waiter, which tries to lock the mutex again.
+
+  The @c owner word holds the owner thread, with its lowest bit set if 
+  there are waiters. When there are no waiters, locking and unlocking cost a 
+  single atomic operation each.
+
+  A sleeping mutex can be used in user-space and in the preemptive domain
+  of the kernel, but not in the non-preemptive domain.
+
+  @see SleepMutex_Lock
+  @see SleepMutex_Unlock
+  @see SleepMutex_Wait
+ */
+typedef struct {
+  uintptr_t owner;     /**< The owner thread (0 if unlocked), ORed with 1 if there are waiters */
+  Mutex spinlock;      /**< Protects the wait queue */
+  void* head;          /**< The head of the wait queue */
+  void* tail;          /**< The tail of the wait queue */
+} SleepMutex;
+
+/** @brief Initializer for sleeping mutexes */
+#define SLEEPMUTEX_INIT ((SleepMutex){ 0, MUTEX_INIT, NULL, NULL })
+
+/** @brief Lock a sleeping mutex */
+void SleepMutex_Lock(SleepMutex* mx);
+
+/** @brief Unlock a sleeping mutex, waking up the first waiter, if any */
+void SleepMutex_Unlock(SleepMutex* mx);
+
+/** 
+  @brief Wait on a condition variable, atomically releasing a sleeping mutex.
+
+  This is the equivalent of @c Cond_Wait for sleeping mutexes, with one difference:
+  unless wait morphing is disabled, a signal does not wake the waiter up while the
+  mutex is locked. Instead, the waiter is moved from the condition variable to the 
+  wait queue of the mutex, and it is woken up when the mutex is unlocked. Thus, a 
+  broadcast does not cause a thundering herd of threads, all contending for the mutex.
+
+  @see Cond_Wait
+  @see cv_wait_morphing
+ */
+int SleepMutex_Wait(SleepMutex* mx, CondVar* cv, int I_O);
+
+/** @brief Name a sleeping mutex, for the lock contention profiler.
+  @see Mutex_Register
+ */
+void SleepMutex_Register(SleepMutex* mx, const char* name);
+
+/** @brief Release the name of a sleeping mutex.
+  @see Mutex_Unregister
+ */
+void SleepMutex_Unregister(SleepMutex* mx);
+
+/**
+  @brief Enables wait morphing in @c SleepMutex_Wait (the default).
+
+  It is set by @c boot() to 0, if the environment variable @c TINYOS_WAIT_MORPHING
+  is "0". It must not change while any thread waits on a condition variable.
+ */
+extern int cv_wait_morphing;
+
+
+/** @brief The number of reader counters of a reader-writer lock */
+#define RWLOCK_SLOTS 32
+
+/** @brief A reader-writer lock.
+
+  A reader-writer lock can be held either by any number of readers, or
+  by a single writer. It is meant for data that is read much more often
+  than it is written.
+
+  Each reader increments (and later decrements) only the counter of the core
+  it runs on, so that readers on different cores do not contend for the same
+  cache line. A writer announces itself (new readers then wait for it), and
+  waits until the sum of all counters drops to zero.
+
+  This implementation can be used in user-space and in the pre-emptive domain
+  of the kernel.
+
+  @see RWLock_ReadLock
+  @see RWLock_ReadUnlock
+  @see RWLock_WriteLock
+  @see RWLock_WriteUnlock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  struct {
+    long count;                     /**< Readers that locked on this core, minus those that unlocked */
+    char pad[64-sizeof(long)];
+  } readers[RWLOCK_SLOTS];          /**< Per-core reader counters, each in its own cache line */
+  int writer;                       /**< Non-zero while a writer holds, or waits for, the lock */
+  Mutex lock;                       /**< Protects the slow paths */
+  CondVar readers_cv;               /**< Readers wait here for the writer to leave */
+  CondVar writers_cv;               /**< Writers wait here for readers and other writers to leave */
+} RWLock;
+
+/** @brief  This macro is used to initialize reader-writer locks.
+
+   It is used as follows:
+  @code
+  RWLock my_rwlock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RWLock){ .writer = 0, .lock = MUTEX_INIT, .readers_cv = COND_INIT, .writers_cv = COND_INIT })
+
+/** @brief Lock a reader-writer lock for reading.
+
+  This call waits as long as a writer holds, or waits for, the lock.
+  @see RWLock_ReadUnlock
+ */
+void RWLock_ReadLock(RWLock* rw);
+
+/** @brief Unlock a reader-writer lock that was locked for reading.
+  @see RWLock_ReadLock
+ */
+void RWLock_ReadUnlock(RWLock* rw);
+
+/** @brief Lock a reader-writer lock for writing.
+
+  This call waits until there are no other readers or writers.
+  @see RWLock_WriteUnlock
+ */
+void RWLock_WriteLock(RWLock* rw);
+
+/** @brief Unlock a reader-writer lock that was locked for writing.
+  @see RWLock_WriteLock
+ */
+void RWLock_WriteUnlock(RWLock* rw);
+
+
+/** @brief A counting semaphore.
+
+  A semaphore holds a number of units. @c Sem_P takes some units, waiting
+  until they are available, and @c Sem_V returns units. Both can move many
+  units at once (batch P/V).
+
+  Waiters are served in FIFO order: a waiter that needs many units is not
+  overtaken by later waiters that need fewer. @c Sem_V wakes up exactly those
+  waiters whose units it can provide, and gives the units to them directly, so
+  the woken threads never need to check again. When nobody waits, both 
+  operations cost a single atomic operation.
+
+  This implementation can be used in user-space and in the pre-emptive domain
+  of the kernel.
+
+  @see Sem_P
+  @see Sem_V
+  @see SEMAPHORE_INIT
+ */
+typedef struct {
+  unsigned long value;  /**< The available units, ORed with the top bit if there are waiters */
+  Mutex lock;           /**< Protects the wait queue */
+  void* head;           /**< The head of the wait queue */
+  void* tail;           /**< The tail of the wait queue */
+} Semaphore;
+
+/** @brief  This macro is used to initialize semaphores.
+
+   It is used as follows:
+  @code
+  Semaphore my_sem = SEMAPHORE_INIT(10);
+  @endcode
+ */
+#define SEMAPHORE_INIT(n) ((Semaphore){ (n), MUTEX_INIT, NULL, NULL })
+
+/** @brief Take @c n units from a semaphore, waiting until they are available.
+
+  If the process of the thread is killed (see @c KillGroup), the wait is cut
+  short, and the thread exits right away, unless it holds other locks.
+
+  @returns 1 if the units were taken, or 0 if the wait was cut short by a kill.
+  @see Sem_V
+ */
+int Sem_P(Semaphore* sem, unsigned int n);
+
+/** @brief Return @c n units to a semaphore, waking up the waiters that they satisfy.
+  @see Sem_P
+ */
+void Sem_V(Semaphore* sem, unsigned int n);
+
+
+/** @brief The fan-out of the wakeup tree of a barrier */
+#define BARRIER_FANOUT 4
+
+/** @brief A barrier.
+
+  A barrier synchronizes a fixed number of threads in phases: each thread
+  calls @c Barrier_Wait, and waits until all of them have called it.
+
+  The waiters of a phase form a tree, in their order of arrival, where 
+  each waiter has up to @c BARRIER_FANOUT children. The last thread to arrive 
+  wakes up only the root, and each waiter wakes up its own children as
+  soon as it wakes up. Thus, no thread performs more than a few wakeups, and
+  all threads resume in a number of steps logarithmic to their number.
+  
+  This implementation can be used in user-space and in the pre-emptive domain
+  of the kernel.
+
+  @see Barrier_Wait
+  @see BARRIER_INIT
+ */
+typedef struct {
+  unsigned int n;       /**< The number of threads that synchronize */
+  unsigned int arrived; /**< The number of waiters in the current phase */
+  Mutex lock;           /**< Protects the barrier */
+  void* root;           /**< The first waiter of the current phase */
+  void* last;           /**< The last waiter of the current phase */
+  void* attach;         /**< The waiter that the next waiter becomes a child of */
+} Barrier;
+
+/** @brief  This macro is used to initialize barriers for @c n threads.
+
+   It is used as follows:
+  @code
+  Barrier my_barrier = BARRIER_INIT(8);
+  @endcode
+ */
+#define BARRIER_INIT(n) ((Barrier){ (n), 0, MUTEX_INIT, NULL, NULL, NULL })
+
+/** @brief Wait at a barrier, until all its threads have arrived.
+
+  If the process of the thread is killed (see @c KillGroup), the thread leaves
+  the current phase, which then waits for one more thread to arrive, and it 
+  exits right away, unless it holds other locks.
+
+  @returns 1 for exactly one thread of each phase (the last to arrive), 0 for the others,
+    or -1 if the wait was cut short by a kill.
+ */
+int Barrier_Wait(Barrier* b);
 
 
 /*******************************************
@@ -215,10 +484,141 @@ typedef int (*Task)(int, void*);
 Pid_t Exec(Task task, int argl, void* args);
 
 
+/** @brief A shared, reference-counted argument buffer.
+
+  A process created by @c Exec gets its own copy of its arguments. When many
+  processes are created with the same arguments, the caller can instead create
+  the arguments once, in a shared buffer, and pass it to @c ExecShared. Each
+  process then holds a reference to the buffer, which is released when the
+  process exits.
+
+  The contents of the buffer can be filled in by the creator, until it is first
+  passed to @c ExecShared. After that, the buffer is immutable.
+
+  @see ExecShared
+  @see SharedArgs_Create
+ */
+typedef struct shared_args {
+  unsigned int refcount;  /**< The number of references */
+  int argl;               /**< The length of @c args */
+  char args[];            /**< The argument bytes */
+} SharedArgs;
+
+
+/** @brief Create a shared argument buffer.
+
+  The new buffer holds a copy of the @c argl bytes at @c args (if @c args is not NULL),
+  and it has a single reference, owned by the caller.
+
+  @param argl the length of the buffer
+  @param args the initial contents, or NULL to leave the buffer uninitialized
+  @returns the new buffer
+ */
+SharedArgs* SharedArgs_Create(int argl, const void* args);
+
+
+/** @brief Release a reference to a shared argument buffer.
+
+  When the last reference is released, the buffer is freed.
+ */
+void SharedArgs_Release(SharedArgs* sargs);
+
+
+/** @brief Create a new process with shared arguments.
+
+  This call is like @c Exec, except that @c task is passed the 
+  bytes of @c sargs, without copying them. The new process takes a reference
+  to the buffer; the caller keeps its own. A process must not modify the
+  arguments that it was passed by @c ExecShared.
+
+  @param task the main function of the new process
+  @param sargs the arguments, or NULL for no arguments
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+  @see Exec
+ */
+Pid_t ExecShared(Task task, SharedArgs* sargs);
+
+
+/** @brief Create a number of new processes.
+
+  This call is equivalent to calling @c Exec @c n times, with the same @c task,
+  but it creates the processes in batches, taking the kernel locks once per batch.
+  Process @c i is passed a copy of the @c argl bytes at @c args[i]. If @c args
+  is NULL, or @c args[i] is NULL, process @c i is passed @c (argl,NULL). As with
+  @c Exec, every process gets its own copy, even if the same pointer is passed
+  to several of them; to create processes that share one copy, use @c ExecShared.
+
+  @param task the main function of the new processes
+  @param n the number of processes to create
+  @param argl the length of each argument
+  @param args an array of @c n arguments, or NULL
+  @param pids if not NULL, an array of @c n pids, where the pids of the new
+     processes are stored, or NOPROC for those that were not created
+  @returns the number of processes created. This is less than @c n if the maximum
+     number of processes was reached.
+  @see Exec
+ */
+int ExecMany(Task task, int n, int argl, void* args[], Pid_t pids[]);
+
+
+/** @brief The kinds of file actions of @c ExecWithFiles. */
+typedef enum file_action_kind {
+  FILE_ACTION_END = 0,        /**< @brief The end of the list of actions */
+  FILE_ACTION_DUP,            /**< @brief Make @c fid a copy of file id @c arg, like @c Dup2(arg,fid) */
+  FILE_ACTION_CLOSE,          /**< @brief Close @c fid (which may be closed already) */
+  FILE_ACTION_OPEN_NULL,      /**< @brief Open the null device at @c fid, like @c OpenNull */
+  FILE_ACTION_OPEN_TERMINAL   /**< @brief Open terminal @c arg at @c fid, like @c OpenTerminal */
+} file_action_kind;
+
+/** @brief An action on the file table of a new process. 
+  @see ExecWithFiles
+ */
+typedef struct file_action {
+  file_action_kind kind;  /**< @brief What to do */
+  Fid_t fid;              /**< @brief The file id of the new process that is set */
+  int arg;                /**< @brief The source file id, or the terminal number */
+} file_action;
+
+/** @brief Create a new process, with a file table built by a list of actions.
+
+  This call is like @c Exec, except for the file table of the new process. This
+  starts as a copy of the file table of the caller, taken in one pass, and then the
+  actions are applied to it, in order. The file table of the caller is not changed.
+
+  For example, the following makes a child whose standard input and output are 
+  the ends of two pipes, without the other fids of the pipes:
+  @code
+  file_action actions[] = {
+    { FILE_ACTION_DUP, 0, in.read },
+    { FILE_ACTION_DUP, 1, out.write },
+    { FILE_ACTION_CLOSE, in.read },
+    { FILE_ACTION_CLOSE, out.write },
+    { FILE_ACTION_END }
+  };
+  Pid_t pid = ExecWithFiles(task, argl, args, actions);
+  @endcode
+
+  @param task the main function of the new process
+  @param argl the length of the argument
+  @param args the argument, copied as by @c Exec
+  @param actions an array of actions, ending with @c FILE_ACTION_END, or NULL
+    for none
+  @returns the PID of the new process, or NOPROC on error. Possible errors:
+    - an action has a fid out of range, or it duplicates a closed fid
+    - a device cannot be opened
+    - the maximum number of processes has been reached.
+  @see Exec
+ */
+Pid_t ExecWithFiles(Task task, int argl, void* args, const file_action* actions);
+
+
 /** @brief Exit the current process.
 
   When this function is called by a process thread, the process terminates
-  and sets its exit code to @c val. 
+  and sets its exit code to @c val. The other threads of the process are
+  stopped first, as by a kill (see @c KillGroup); the process exits with the
+  status of the first call to @c Exit, once they are gone.
 
   @note Alternatively, the process may terminate by returning (with an integer 
   return value) from its main function, in which case the return value of the
@@ -253,6 +653,70 @@ void Exit(int val);
 */
 Pid_t WaitChild(Pid_t pid, int* exitval);
 
+/** @brief Option of @c WaitPid: do not block. */
+#define WNOHANG 1
+
+/** @brief Wait on a terminating child, with options.
+
+   This call is like @c WaitChild, except that if @c options contains @c WNOHANG,
+   it does not block. If the requested child (or, if @c pid is @c NOPROC,
+   every child) has not exited yet, it returns 0. Since PID 0 is never a child,
+   this is not confused with a child's pid. @c WaitChild(pid,exitval) is 
+   equivalent to @c WaitPid(pid,exitval,0).
+
+   @param pid the process ID of the child to wait on, or @c NOPROC to
+           designate waiting for any child.
+   @param exitval a location whithin which the exit status of the child is stored, or NULL
+   @param options 0, or @c WNOHANG
+   @return the pid of an exited child, 0 if no child has exited and @c WNOHANG
+   was given, or @c NOPROC on error (as for @c WaitChild).
+   @see WaitChild
+ */
+Pid_t WaitPid(Pid_t pid, int* exitval, int options);
+
+/** @brief Wait on many terminating children.
+
+   This call waits until some child of the current process exits, as
+   @c WaitChild(NOPROC,...) does. Then, it reaps up to @c max exited children 
+   at once, storing their pids in @c pids[] and, if @c exitval is not NULL, 
+   their exit status in @c exitval[].
+
+   @param pids an array of at least @c max locations for the pids
+   @param exitval an array of at least @c max locations for the exit status, or NULL
+   @param max the maximum number of children to reap
+   @return the number of children reaped. This is 0 if the process has no
+   children (or if @c max is not positive).
+   @see WaitChild
+ */
+int WaitChildren(Pid_t pids[], int exitval[], int max);
+
+/** @brief Create a new detached process.
+
+  This call is like @c Exec, except that the new process is _detached_:
+  nobody waits for it. When it exits, its PCB (and its PID) is released
+  at once, instead of staying a zombie until its parent reaps it, and its
+  exit status is lost. A detached process remains a child of its parent
+  (see @c GetPPid), but @c WaitChild does not return it. Still, the 
+  initial task waits for it to exit, before the system shuts down.
+
+  @returns the PID of the new process, or NOPROC on error.
+  @see Exec
+  @see DetachChild
+ */
+Pid_t ExecDetached(Task task, int argl, void* args);
+
+/** @brief Detach a child process.
+
+  After this call, the child with the given @c pid is detached, as if it had been
+  created by @c ExecDetached. If it has already exited, it is released immediately.
+
+  @param pid the PID of a child of the current process
+  @returns 0 on success, or -1 if @c pid is not a child of the current process
+     that can be waited for.
+  @see ExecDetached
+ */
+int DetachChild(Pid_t pid);
+
 /** @brief Return the PID of the caller.
 
  This function returns the pid of the current process 
@@ -265,6 +729,102 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+/** @brief Resource usage statistics.
+
+  These are kept for each thread and, aggregated over all its threads, for each
+  process. They are returned by @c GetUsage and, for every process, in the
+  @c usage field of @c procinfo.
+
+  The CPU time of a thread is measured at each context switch. Each time slice
+  is split into kernel time, spent inside the kernel (while the thread holds a
+  kernel lock, or is otherwise in a kernel section), and user time, the rest.
+  Thus, a thread that yields or blocks in a system call is charged as user
+  time for what it did before the call.
+
+  The stack use is sampled at each context switch, so the peak may be missed
+  by a call that does not block and is not preempted.
+
+  @see GetUsage
+ */
+typedef struct usageinfo {
+  unsigned long user_time;      /**< @brief CPU time outside the kernel, in nsec */
+  unsigned long kernel_time;    /**< @brief CPU time inside the kernel, in nsec */
+  unsigned long switches;       /**< @brief Voluntary context switches (blocking or yielding) */
+  unsigned long preemptions;    /**< @brief Involuntary context switches (at quantum expiry) */
+  unsigned long wakeups;        /**< @brief The number of times a blocked thread was woken up */
+  unsigned long bytes_read;     /**< @brief Bytes returned by @c Read */
+  unsigned long bytes_written;  /**< @brief Bytes accepted by @c Write */
+  unsigned long stack_peak;     /**< @brief The largest stack use observed, in bytes */
+} usageinfo;
+
+/** @brief Argument of @c GetUsage: the usage of the current thread */
+#define USAGE_THREAD 0
+
+/** @brief Argument of @c GetUsage: the usage of the current process */
+#define USAGE_PROCESS 1
+
+/** @brief Return resource usage statistics.
+
+  The statistics include every time slice up to the last context switch of
+  each thread. For a process, they include the threads that have exited, and
+  @c stack_peak is the largest peak among its threads.
+
+  @param who either @c USAGE_THREAD or @c USAGE_PROCESS
+  @param usage the location to store the statistics
+  @returns 0 on success, or -1 if @c who is not valid or @c usage is NULL.
+ */
+int GetUsage(int who, usageinfo* usage);
+
+/** @brief Return the process group of a process.
+
+  Every process belongs to a process group, identified by a PID (the group
+  _leader_'s). A new process joins the group of its parent; the initial
+  task is in group 1.
+
+  @param pid the PID of a live process, or NOPROC for the current process
+  @returns the process group, or NOPROC if there is no such live process.
+  @see SetPgid
+ */
+Pid_t GetPgid(Pid_t pid);
+
+/** @brief Set the process group of a process.
+
+  Process @c pid, which must be the current process or a live child of it,
+  joins group @c pgid. This must be either @c pid itself (a new group, led by
+  @c pid), the group of the current process, or the group of a live leader.
+
+  @param pid the PID of the process, or NOPROC for the current process
+  @param pgid the process group, or NOPROC for @c pid
+  @returns 0 on success, or -1 on error.
+  @see KillGroup
+ */
+int SetPgid(Pid_t pid, Pid_t pgid);
+
+/** @brief Kill all the processes of a process group.
+
+  Every live process in group @c pgid is marked as killed. Its threads exit
+  at their next kill point:
+  - the next entry to a system call that may block or create processes
+    (e.g., @c Read, @c Write, @c Exec, @c WaitChild, @c CreateThread), or
+  - the end of their current time quantum, unless they are inside the kernel
+    at that time.
+
+  A thread that is blocked on a condition variable (e.g., in @c WaitChild,
+  @c ThreadJoin, @c Accept, @c Connect, in the @c Read or @c Write of a pipe,
+  or in @c Cond_Wait), in @c Sem_P, in @c Barrier_Wait, or in @c SleepMutex_Lock
+  while it holds no other lock, is woken up, and the blocking call fails and 
+  returns to a kill point. When all its threads have exited, the killed process exits 
+  with status -1, and becomes a zombie, to be reaped by its parent as usual. 
+  Any process that a killed process creates is also killed.
+
+  The initial task is never killed, even if it is in the group.
+
+  @param pgid the process group
+  @returns the number of processes killed, or -1 if there are none.
+  @see SetPgid
+ */
+int KillGroup(Pid_t pgid);
+
 /*******************************************
  *
  * Threads
@@ -369,6 +929,81 @@ void ThreadClearInterrupt();
 
 
 
+/*******************************************
+ *
+ * Memory
+ *
+ *******************************************/
+
+/** @brief Memory statistics of a process.
+
+  Every process allocates from its own arena, which is released when the
+  process exits. The counters are returned by @c MemInfo.
+
+  @see MemAlloc
+ */
+typedef struct meminfo {
+  unsigned long in_use;     /**< @brief Bytes allocated and not freed (rounded up to the size class) */
+  unsigned long peak;       /**< @brief The largest value of @c in_use */
+  unsigned long reserved;   /**< @brief Bytes taken by the arena from the host */
+  unsigned long limit;      /**< @brief The limit on @c in_use, or 0 for none */
+  unsigned long allocs;     /**< @brief Successful calls to @c MemAlloc */
+  unsigned long frees;      /**< @brief Successful calls to @c MemFree (with a non-NULL pointer) */
+  unsigned long failures;   /**< @brief Calls to @c MemAlloc that failed (because of the limit, or because the host is out of memory) */
+} meminfo;
+
+/**
+  @brief Allocate memory from the arena of the current process.
+
+  The memory is aligned like that of @c malloc. It is owned by the current
+  process: it may be used by any process, but it may only be freed by the
+  current one, and it is released when the current process exits.
+
+  Small blocks are rounded up to a power of 2 (at least 16 bytes), for
+  reuse after @c MemFree.
+
+  @param size the size of the block in bytes
+  @returns the block, or NULL if @c size is 0, if the limit of the process
+    would be exceeded, or if the host is out of memory.
+  @see MemSetLimit
+ */
+void* MemAlloc(unsigned int size);
+
+/**
+  @brief Free a block returned by @c MemAlloc.
+
+  Any pointer may be passed: the memory around @c ptr is only read if it
+  belongs to the arena of the current process.
+
+  @param ptr the block, or NULL (which is ignored)
+  @returns 0 on success, or -1 if @c ptr is not a live block of the current
+    process.
+ */
+int MemFree(void* ptr);
+
+/**
+  @brief Return the memory statistics of the current process.
+
+  @param info the location to store the statistics
+  @returns 0 on success, or -1 if @c info is NULL.
+ */
+int MemInfo(meminfo* info);
+
+/**
+  @brief Set the limit on the memory in use of the current process.
+
+  Allocations that would exceed the limit fail; memory already allocated is
+  not affected. A new process inherits the limit of its parent. The limit of
+  the initial task is set from the environment variable @c TINYOS_MEM_LIMIT
+  (in bytes) by @c boot().
+
+  @param limit the limit in bytes, or 0 for none
+  @returns 0
+ */
+int MemSetLimit(unsigned long limit);
+
+
+
 /*******************************************
  *
  * Low-level I/O
@@ -736,6 +1371,8 @@ typedef struct procinfo
 
     If the task's argument is longer (as designated by the @c argl field), the
     bytes contained in this field are just the prefix.  */
+
+  usageinfo usage;  /**< @brief The resource usage of the process (see @c GetUsage). */
 } procinfo;
 
 
@@ -747,11 +1384,21 @@ typedef struct procinfo
 	each packed into a block of size @c sizeof(procinfo).
 
 	Each procinfo structure contains information pertaining to some
-	used PCB (active or zombie) during the time of the stream. 
+	used PCB (active or zombie) during the time of the stream. The
+	processes are reported in order of creation; a process created
+	after the stream has passed its predecessor is reported too, and
+	a process that is released before it is reached is not.
+
+	A @c Read returns as many whole records as fit in the buffer. If
+	the buffer is smaller than one record, it returns a prefix of one
+	record, and the following reads return the rest of it, before any
+	other record.
+	Each record is a consistent snapshot of its process, and the
+	records of one @c Read are taken together, in batches of up to 64. 
+	The cost of reading the stream is proportional to the number of
+	processes, not to the size of the process table.
 
 	There is no guarantee of the timeliness of the information.
-	A best-effort approach to return relevant system information is
-	made. 
 
 	@returns a file id on success, or NOFILE on error. Possible reasons
 		for error are:
@@ -760,6 +1407,78 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+  @brief The max. size of the name in a lockinfo structure (including the final 0).
+  */
+#define LOCKINFO_NAME_SIZE (32)
+
+/**
+	@brief Contention statistics of a lock.
+
+	This structure is returned by lock information streams.
+	@see OpenLockInfo
+  */
+typedef struct lockinfo
+{
+	uintptr_t lock;               /**< @brief The address of the lock (0 for "(other)"). */
+	char name[LOCKINFO_NAME_SIZE];  /**< @brief The registered name, or an empty string. */
+	unsigned long acquisitions;   /**< @brief The number of times the lock was taken. */
+	unsigned long contended;      /**< @brief Acquisitions that found the lock taken. */
+	unsigned long spins;          /**< @brief Spin iterations while waiting. */
+	unsigned long yields;         /**< @brief Forced yields (or sleeps) while waiting. */
+	unsigned long hold_time;      /**< @brief The total time the lock was held, in nsec. */
+} lockinfo;
+
+
+/**
+	@brief Open a lock information stream.
+
+	This is a read-only stream that returns a sequence of @c lockinfo 
+	structures, each packed into a block of size @c sizeof(lockinfo), one
+	for each registered lock that has been taken since boot (or since it
+	was registered), and one named "(other)" for the rest.
+
+	The statistics are only collected when the lock contention profiler
+	is enabled, by setting the environment variable @c TINYOS_LOCKSTAT
+	before @c boot(); otherwise, the stream is empty.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+	@see Mutex_Register
+ */
+Fid_t OpenLockInfo();
+
+
+/**
+	@brief Statistics of the deferred cleanup work of the kernel.
+
+	The kernel defers some teardown work (e.g., freeing the stacks of
+	exited threads and the arguments of exited processes) to per-core
+	queues, which are processed by idle cores, or in small batches at
+	context switches when the backlog grows. 
+
+	@see GetDeferInfo
+  */
+typedef struct deferinfo
+{
+	unsigned long queued;       /**< @brief The number of items queued since boot. */
+	unsigned long processed;    /**< @brief The number of items processed since boot. */
+	unsigned long backlog;      /**< @brief The number of items waiting now, over all cores. */
+	unsigned long peak;         /**< @brief The largest backlog of a single core. */
+	unsigned long idle_runs;    /**< @brief The times an idle core processed its queue. */
+	unsigned long switch_runs;  /**< @brief The times a context switch processed a batch. */
+} deferinfo;
+
+/**
+	@brief Return the statistics of the deferred cleanup work, over all cores.
+
+	@param info the location to store the statistics
+	@returns 0 on success, or -1 if @c info is NULL.
+ */
+int GetDeferInfo(deferinfo* info);
+
+
 
 
 /*******************************************
@@ -21,6 +21,8 @@ int Repeat(size_t,const char**);
 int Hanoi(size_t,const char**);
 int HelpMessage(size_t,const char**);
 int SystemInfo(size_t,const char**);
+int LockStat(size_t,const char**);
+int Usage(size_t,const char**);
 int Capitalize(size_t,const char**);
 int LowerCase(size_t,const char**);
 int LineEnum(size_t,const char**);
@@ -38,6 +40,8 @@ COMMANDS[]  =
 	{"help", HelpMessage, 0, "A help message."},
 	{"ls", ListPrograms, 0, "List available programs programs."},
 	{"sysinfo", SystemInfo, 0, "Print some basic info about the current system."},
+	{"lockstat", LockStat, 0, "Print lock contention statistics (boot with TINYOS_LOCKSTAT=1)."},
+	{"usage", Usage, 0, "Print the resource usage of each process."},
 	{"runterm", RunTerm, 2, "runterm <term> <prog>  <args...> : execute '<prog> <args...>' on terminal <term>."},
 	{"sh", Shell, 0, "Run a shell."},
 	{"repeat", Repeat, 2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
@@ -165,41 +169,118 @@ int SystemInfo(size_t argc, const char** argv)
 {
 	printf("Number of cores         = %d\n", cpu_cores());
 	printf("Number of serial devices= %d\n", bios_serial_ports());
+	deferinfo dinfo;
+	GetDeferInfo(&dinfo);
+	printf("Deferred cleanup        = %lu done, %lu waiting (peak %lu)\n",
+		dinfo.processed, dinfo.backlog, dinfo.peak);
 	Fid_t finfo = OpenInfo();
 	if(finfo!=NOFILE) {
 		/* Print per-process info */
-		procinfo info;
+		procinfo infos[16];
+		int n;
 		printf("%5s %5s %6s %8s %20s\n",
 			"PID", "PPID", "State", "Threads", "Main program"
 			);
-		/* Read in next piece of info */		
-		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
+		/* Read in the next batch of info */		
+		while((n = Read(finfo, (char*) infos, sizeof(infos))) > 0)
+		for(procinfo* info = infos; info < infos + n/sizeof(procinfo); info++) {
 			Program prog=NULL;
 			const char* argv[10];
-			int argc = ParseProcInfo(&info, &prog, 10, argv);
+			int argc = ParseProcInfo(info, &prog, 10, argv);
 
 			const char* pname = "-";
 			if(argc>=1)  {
 				pname = argv[0];
 			} else if(argc==-1) {
 				/* Try to give some known names */
-				if(info.pid==1) pname = "init";
+				if(info->pid==1) pname = "init";
 			}
 
 			printf("%5d %5d %6s %8u %20s\n",
-				info.pid,
-				info.ppid,
-				(info.alive?"ALIVE":"ZOMBIE"),
-				info.thread_count,
+				info->pid,
+				info->ppid,
+				(info->alive?"ALIVE":"ZOMBIE"),
+				info->thread_count,
 				pname
 				);
 		}
+		Close(finfo);
 	}
 	printf("\n");
 	return 0;
 }
 
 
+int Usage(size_t argc, const char** argv)
+{
+	Fid_t finfo = OpenInfo();
+	if(finfo==NOFILE) {
+		printf("Cannot open the information stream\n");
+		return 1;
+	}
+
+	procinfo infos[16];
+	int n;
+	printf("%5s %10s %10s %8s %8s %8s %10s %10s %8s\n",
+		"PID", "User(ms)", "Kern(ms)", "Switches", "Preempt", "Wakeups", "Read", "Written", "Stack");
+	while((n = Read(finfo, (char*) infos, sizeof(infos))) > 0)
+	for(procinfo* info = infos; info < infos + n/sizeof(procinfo); info++) {
+		usageinfo* u = &info->usage;
+		printf("%5d %10.3f %10.3f %8lu %8lu %8lu %10lu %10lu %8lu\n",
+			info->pid, u->user_time / 1e6, u->kernel_time / 1e6,
+			u->switches, u->preemptions, u->wakeups,
+			u->bytes_read, u->bytes_written, u->stack_peak);
+	}
+	Close(finfo);
+	return 0;
+}
+
+
+static int lockinfo_cmp(const void* a, const void* b)
+{
+	const lockinfo* A = a;
+	const lockinfo* B = b;
+	if(A->contended != B->contended) return (A->contended < B->contended) ? 1 : -1;
+	if(A->hold_time != B->hold_time) return (A->hold_time < B->hold_time) ? 1 : -1;
+	return 0;
+}
+
+int LockStat(size_t argc, const char** argv)
+{
+	Fid_t finfo = OpenLockInfo();
+	if(finfo==NOFILE) {
+		printf("Cannot open the lock information stream\n");
+		return 1;
+	}
+
+	/* Read all records, to print them by contention */
+	size_t n = 0, cap = 64;
+	lockinfo* info = xmalloc(cap*sizeof(lockinfo));
+	while(Read(finfo, (char*) &info[n], sizeof(lockinfo)) > 0)
+		if(++n == cap) {
+			cap *= 2;
+			info = realloc(info, cap*sizeof(lockinfo));
+			CHECK_CONDITION(info != NULL);
+		}
+	Close(finfo);
+
+	if(n==0)
+		printf("No lock statistics (boot with TINYOS_LOCKSTAT=1)\n");
+	else {
+		qsort(info, n, sizeof(lockinfo), lockinfo_cmp);
+		printf("%-16s %14s %12s %12s %14s %10s %12s\n",
+			"Lock", "Address", "Acquired", "Contended", "Spins", "Yields", "Held(ms)");
+		for(size_t i=0; i<n; i++)
+			printf("%-16s %14lx %12lu %12lu %14lu %10lu %12.3f\n",
+				info[i].name[0] ? info[i].name : "-", (unsigned long) info[i].lock,
+				info[i].acquisitions, info[i].contended, info[i].spins, info[i].yields,
+				info[i].hold_time / 1e6);
+	}
+	free(info);
+	return 0;
+}
+
+
 int HelpMessage(size_t argc, const char** argv)
 {
 	printf("This is a simple shell for tinyos.\n\
@@ -777,15 +858,6 @@ int process_builtin(int argc, const char** argv)
 }
 
 
-static inline Fid_t savefid(Fid_t fsaved)
-{
-	Fid_t savior = OpenNull();
-	assert(savior!=NOFILE);
-	Dup2(fsaved, savior);
-	return savior;
-}
-
-
 int process_line(int argc, const char** argv)
 {
 	/* Split up into pipeline fragments */
@@ -823,36 +895,38 @@ int process_line(int argc, const char** argv)
 		comd[i] = c;
 	}
 
-	/* Construct pipeline */
+	/* Construct pipeline. Each fragment gets its standard input and output
+	   by file actions, so that our own file table is not disturbed. */
 	int child[frag];
-	int savein, saveout;
-
-	savein = savefid(0);
-	saveout = savefid(1);
+	Fid_t prev_read = NOFILE;
 
-	pipe_t pipe;
 	for(int i=0; i<frag; i++) {
+		pipe_t pipe;
+		file_action actions[6];
+		int a = 0;
+
 		if(i<frag-1) {
 			/* Not the last fragment, make a pipe */
 			Pipe(& pipe);
-			Dup2(pipe.write,1);
-			Close(pipe.write);
-		} else {
-			/* Last fragment, restore saved 1 */
-			Dup2(saveout, 1);
-			Close(saveout);				
+			actions[a++] = (file_action){ FILE_ACTION_DUP, 1, pipe.write };
+			actions[a++] = (file_action){ FILE_ACTION_CLOSE, pipe.write, 0 };
+			actions[a++] = (file_action){ FILE_ACTION_CLOSE, pipe.read, 0 };
 		}
+		if(prev_read != NOFILE) {
+			/* Not the first fragment, read the previous pipe */
+			actions[a++] = (file_action){ FILE_ACTION_DUP, 0, prev_read };
+			actions[a++] = (file_action){ FILE_ACTION_CLOSE, prev_read, 0 };
+		}
+		actions[a] = (file_action){ FILE_ACTION_END, 0, 0 };
 
-		child[i] = Execute(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i]);
+		child[i] = ExecuteWithFiles(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i], actions);
 
+		/* The pipe ends now belong to the children */
+		if(prev_read != NOFILE)
+			Close(prev_read);
 		if(i<frag-1) {
-			/* Not the last fragment, make a pipe */
-			Dup2(pipe.read,0);
-			Close(pipe.read);
-		} else {
-			/* Last fragment, restore saved 1 */
-			Dup2(savein, 0);
-			Close(savein);
+			Close(pipe.write);
+			prev_read = pipe.read;
 		}
 	}
 
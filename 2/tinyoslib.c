@@ -144,25 +144,43 @@ int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv )
 
 
 
-int Execute(Program prog, size_t argc, const char** argv)
+/* Pack the prog pointer and the arguments to a new argument buffer */
+static SharedArgs* pack_args(Program prog, size_t argc, const char** argv)
 {
-	/* We will pack the prog pointer and the arguments to 
-	  an argument buffer.
-	  */
-
 	/* compute the argument buffer size */
 	size_t argl = argvlen(argc, argv) + sizeof(prog);
 
-	/* allocate the buffer */
-	char args[argl];
+	/* allocate the buffer, to be handed over to the new process */
+	SharedArgs* sargs = SharedArgs_Create(argl, NULL);
+	char* args = sargs->args;
 
 	/* put the pointer at the start */
 	memcpy(args, &prog, sizeof(prog));
 
 	/* add the string vector */
 	argvpack(args+sizeof(prog), argc, argv);
+	return sargs;
+}
+
+
+int Execute(Program prog, size_t argc, const char** argv)
+{
+	SharedArgs* sargs = pack_args(prog, argc, argv);
 
 	/* Execute the process */
-	return Exec(exec_wrapper, argl, args);
+	Pid_t pid = ExecShared(exec_wrapper, sargs);
+	SharedArgs_Release(sargs);
+	return pid;
+}
+
+
+int ExecuteWithFiles(Program prog, size_t argc, const char** argv, const file_action* actions)
+{
+	SharedArgs* sargs = pack_args(prog, argc, argv);
+
+	/* The arguments are copied by the kernel */
+	Pid_t pid = ExecWithFiles(exec_wrapper, sargs->argl, sargs->args, actions);
+	SharedArgs_Release(sargs);
+	return pid;
 }
 
@@ -44,6 +44,17 @@ typedef int (*Program)(size_t argc, const char** argv);
 int Execute(Program prog, size_t argc, const char** argv);
 
 
+/**
+	@brief Execute a new process, with a file table built by a list of actions.
+
+	This is like @ref Execute, but the new process is created by 
+	@c ExecWithFiles, so that its file table is built from the 
+	file table of the caller by @c actions, leaving the caller's 
+	table unchanged.
+  */
+int ExecuteWithFiles(Program prog, size_t argc, const char** argv, const file_action* actions);
+
+
 /**
 	@brief Try to reclaim the arguments of a process.
 
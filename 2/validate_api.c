@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
@@ -2015,11 +2016,1366 @@ BARE_TEST(dummy_user_test,
 }
 
 
+BOOT_TEST(test_rwlock_exclusion,
+	"Test that a reader-writer lock admits many readers or one writer. "
+	"A process with reader and writer threads checks that readers never "
+	"overlap with a writer, and that writers never overlap with anybody."
+	)
+{
+	static RWLock rw;
+	static int readers_in, writers_in, violations, counter, next_id;
+	const int nreaders = 6, nwriters = 2, rounds = 2000;
+
+	rw = RWLOCK_INIT;
+	readers_in = writers_in = violations = counter = next_id = 0;
+
+	void reader() {
+		RWLock_ReadLock(&rw);
+		__atomic_add_fetch(&readers_in, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&writers_in, __ATOMIC_SEQ_CST)!=0)
+			__atomic_add_fetch(&violations, 1, __ATOMIC_SEQ_CST);
+		__atomic_sub_fetch(&readers_in, 1, __ATOMIC_SEQ_CST);
+		RWLock_ReadUnlock(&rw);
+	}
+
+	void writer() {
+		RWLock_WriteLock(&rw);
+		if(__atomic_add_fetch(&writers_in, 1, __ATOMIC_SEQ_CST)!=1
+			|| __atomic_load_n(&readers_in, __ATOMIC_SEQ_CST)!=0)
+			__atomic_add_fetch(&violations, 1, __ATOMIC_SEQ_CST);
+		counter++;
+		__atomic_sub_fetch(&writers_in, 1, __ATOMIC_SEQ_CST);
+		RWLock_WriteUnlock(&rw);
+	}
+
+	/* Each thread picks its role by its order of arrival */
+	int worker(int argl, void* args) {
+		int id = __atomic_fetch_add(&next_id, 1, __ATOMIC_SEQ_CST);
+		for(int i=0; i<rounds; i++)
+			if(id < nwriters) writer(); else reader();
+		return 0;
+	}
+
+	/* The threads are joined implicitly, when the main thread returns */
+	int mthread(int argl, void* args) {
+		for(int i=0; i<nreaders+nwriters; i++)
+			ASSERT(CreateThread(worker, 0, NULL) != NOTHREAD);
+		return 0;
+	}
+
+	Exec(mthread, 0, NULL);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	ASSERT(violations==0);
+	ASSERT(counter==nwriters*rounds);
+	return 0;
+}
+
+
+BOOT_TEST(test_cond_fifo_morphing,
+	"Test that condition variables wake up their waiters in FIFO order. Waiter "
+	"processes queue up one by one on a condition variable, with a sleeping mutex. "
+	"They are signaled one at a time, and then woken up by a broadcast; with wait "
+	"morphing, the broadcast lets them lock the mutex in FIFO order too."
+	)
+{
+	static SleepMutex mx;
+	static CondVar cv, arrived;
+	static int waiting, tokens, woken, order[8];
+	const int N = 8;
+
+	int waiter(int k, void* args) {
+		SleepMutex_Lock(&mx);
+		waiting++;
+		Cond_Broadcast(&arrived);
+		while(tokens==0)
+			SleepMutex_Wait(&mx, &cv, 0);
+		tokens--;
+		order[woken++] = k;
+		Cond_Broadcast(&arrived);
+		SleepMutex_Unlock(&mx);
+		return 0;
+	}
+
+	/* Start the waiters one at a time, so that they wait in order */
+	void start_waiters() {
+		waiting = woken = 0;
+		for(int k=0; k<N; k++) {
+			Exec(waiter, k, NULL);
+			SleepMutex_Lock(&mx);
+			while(waiting <= k)
+				SleepMutex_Wait(&mx, &arrived, 0);
+			SleepMutex_Unlock(&mx);
+		}
+	}
+
+	mx = SLEEPMUTEX_INIT;
+	cv = arrived = COND_INIT;
+	tokens = 0;
+
+	/* Signal them one at a time */
+	start_waiters();
+	for(int i=0; i<N; i++) {
+		SleepMutex_Lock(&mx);
+		tokens++;
+		Cond_Signal(&cv);
+		while(woken <= i)
+			SleepMutex_Wait(&mx, &arrived, 0);
+		SleepMutex_Unlock(&mx);
+	}
+	for(int i=0; i<N; i++) {
+		ASSERT(order[i]==i);
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	}
+
+	/* Broadcast */
+	start_waiters();
+	SleepMutex_Lock(&mx);
+	tokens = N;
+	Cond_Broadcast(&cv);
+	SleepMutex_Unlock(&mx);
+	for(int i=0; i<N; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	ASSERT(woken==N && tokens==0);
+	if(cv_wait_morphing)
+		for(int i=0; i<N; i++)
+			ASSERT(order[i]==i);
+	return 0;
+}
+
+
+BOOT_TEST(test_semaphore_batch,
+	"Test batch P/V on semaphores. Producer threads take batches of free slots from a "
+	"semaphore and pass them as items to consumer threads, through another semaphore, "
+	"in batches of a different size. The number of items in flight must stay within "
+	"bounds, and all units must be returned at the end."
+	)
+{
+	static Semaphore space, items;
+	static int inflight, violations, next_id;
+	const int K = 7, nproducers = 2, nconsumers = 3, rounds = 600;
+	const int pbatch = 3, cbatch = 2;   /* nproducers*pbatch == nconsumers*cbatch */
+
+	space = SEMAPHORE_INIT(K);
+	items = SEMAPHORE_INIT(0);
+	inflight = violations = next_id = 0;
+
+	void producer() {
+		Sem_P(&space, pbatch);
+		if(__atomic_add_fetch(&inflight, pbatch, __ATOMIC_SEQ_CST) > K)
+			__atomic_add_fetch(&violations, 1, __ATOMIC_SEQ_CST);
+		Sem_V(&items, pbatch);
+	}
+
+	void consumer() {
+		Sem_P(&items, cbatch);
+		if(__atomic_sub_fetch(&inflight, cbatch, __ATOMIC_SEQ_CST) < 0)
+			__atomic_add_fetch(&violations, 1, __ATOMIC_SEQ_CST);
+		Sem_V(&space, cbatch);
+	}
+
+	/* Each thread picks its role by its order of arrival */
+	int worker(int argl, void* args) {
+		int id = __atomic_fetch_add(&next_id, 1, __ATOMIC_SEQ_CST);
+		for(int i=0; i<rounds; i++)
+			if(id < nproducers) producer(); else consumer();
+		return 0;
+	}
+
+	/* The threads are joined implicitly, when the main thread returns */
+	int mthread(int argl, void* args) {
+		for(int i=0; i<nproducers+nconsumers; i++)
+			ASSERT(CreateThread(worker, 0, NULL) != NOTHREAD);
+		return 0;
+	}
+
+	Exec(mthread, 0, NULL);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	ASSERT(violations==0);
+	ASSERT(inflight==0);
+	ASSERT(space.value==K && space.head==NULL);
+	ASSERT(items.value==0 && items.head==NULL);
+	return 0;
+}
+
+
+BOOT_TEST(test_barrier_phases,
+	"Test that no thread leaves a barrier before all threads have arrived. The number "
+	"of threads exceeds the fan-out of the wakeup tree, and exactly one thread per "
+	"phase must be told that it arrived last."
+	)
+{
+	static Barrier b;
+	static int count[2], violations, serial;
+	const int N = 3*BARRIER_FANOUT, rounds = 300;
+
+	b = BARRIER_INIT(N);
+	count[0] = count[1] = violations = serial = 0;
+
+	int worker(int argl, void* args) {
+		for(int r=0; r<rounds; r++) {
+			/* count[r%2] is reset in phase r+1, after everybody has checked it */
+			__atomic_add_fetch(&count[r%2], 1, __ATOMIC_SEQ_CST);
+			if(Barrier_Wait(&b)) {
+				__atomic_add_fetch(&serial, 1, __ATOMIC_SEQ_CST);
+				__atomic_store_n(&count[(r+1)%2], 0, __ATOMIC_SEQ_CST);
+			}
+			if(__atomic_load_n(&count[r%2], __ATOMIC_SEQ_CST) != N)
+				__atomic_add_fetch(&violations, 1, __ATOMIC_SEQ_CST);
+			Barrier_Wait(&b);
+		}
+		return 0;
+	}
+
+	/* The threads are joined implicitly, when the main thread returns */
+	int mthread(int argl, void* args) {
+		for(int i=0; i<N; i++)
+			ASSERT(CreateThread(worker, 0, NULL) != NOTHREAD);
+		return 0;
+	}
+
+	Exec(mthread, 0, NULL);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	ASSERT(violations==0);
+	ASSERT(serial==rounds);
+	ASSERT(b.arrived==0 && b.root==NULL);
+	return 0;
+}
+
+
+BARE_TEST(test_lockstat,
+	"Test the lock contention profiler. A number of threads contend for a "
+	"registered mutex, and the lock information stream must report all the "
+	"acquisitions, under the registered name. Many more mutexes than the table "
+	"holds are registered and unregistered in turn, and they must leave no entries."
+	)
+{
+	static Mutex mx, late, tmp[1024];
+	static int found, found_late, stale, next_id;
+	static lockinfo mine;
+	const int nthreads = 4, rounds = 1000;
+
+	int worker(int argl, void* args) {
+		__atomic_fetch_add(&next_id, 1, __ATOMIC_SEQ_CST);
+		for(int i=0; i<rounds; i++) {
+			Mutex_Lock(&mx);
+			for(volatile int j=0; j<100; j++);
+			Mutex_Unlock(&mx);
+		}
+		return 0;
+	}
+
+	int mthread(int argl, void* args) {
+		for(int i=0; i<nthreads; i++)
+			CreateThread(worker, 0, NULL);
+		return 0;
+	}
+
+	int boot_task(int argl, void* args) {
+		Mutex_Register(&mx, "test_mutex");
+		Exec(mthread, 0, NULL);
+		WaitChild(NOPROC, NULL);
+
+		for(int k=0; k<1024; k++) {
+			tmp[k] = MUTEX_INIT;
+			Mutex_Register(&tmp[k], "test_tmp");
+			Mutex_Lock(&tmp[k]);
+			Mutex_Unlock(&tmp[k]);
+			Mutex_Unregister(&tmp[k]);
+		}
+		Mutex_Register(&late, "test_late");
+		Mutex_Lock(&late);
+		Mutex_Unlock(&late);
+
+		Fid_t f = OpenLockInfo();
+		if(f == NOFILE) return 1;
+		lockinfo info;
+		while(Read(f, (char*) &info, sizeof(info)) == sizeof(info))
+			if(info.lock == (uintptr_t) &mx) {
+				found++;
+				mine = info;
+			} else if(info.lock == (uintptr_t) &late)
+				found_late += (strcmp(info.name, "test_late")==0);
+			else if(strcmp(info.name, "test_tmp")==0)
+				stale++;
+		Close(f);
+		return 0;
+	}
+
+	mx = late = MUTEX_INIT;
+	found = found_late = stale = next_id = 0;
+	ASSERT(setenv("TINYOS_LOCKSTAT", "1", 1)==0);
+	boot(2, 0, boot_task, 0, NULL);
+	ASSERT(unsetenv("TINYOS_LOCKSTAT")==0);
+
+	ASSERT(found==1);
+	ASSERT(strcmp(mine.name, "test_mutex")==0);
+	ASSERT(mine.acquisitions==(unsigned long)nthreads*rounds);
+	ASSERT(mine.contended <= mine.acquisitions);
+	ASSERT(mine.hold_time > 0);
+	ASSERT(found_late==1);
+	ASSERT(stale==0);
+}
+
+
+BOOT_TEST(test_listener_reclaim,
+	"Test that listeners removed from the port table are reclaimed safely. Several "
+	"processes open and close listeners on their own ports, and a Connect to a port "
+	"whose listener was closed must fail, while a new listener may take the port."
+	)
+{
+	const int nprocs = 4, rounds = 200;
+
+	int cycler(int argl, void* args) {
+		port_t port = *(port_t*) args;
+		for(int i=0; i<rounds; i++) {
+			Fid_t lsock = Socket(port);
+			Fid_t sock = Socket(port);
+			ASSERT(Listen(lsock)==0);
+			ASSERT(Listen(sock)==-1);
+			ASSERT(Close(lsock)==0);
+			ASSERT(Connect(sock, port, 10)==-1);
+			ASSERT(Close(sock)==0);
+		}
+		return 0;
+	}
+
+	for(int p=0; p<nprocs; p++) {
+		port_t port = MAX_PORT - p;
+		Exec(cycler, sizeof(port), &port);
+	}
+	for(int p=0; p<nprocs; p++) {
+		int status;
+		ASSERT(WaitChild(NOPROC, &status)!=NOPROC);
+		ASSERT(status==0);
+	}
+	return 0;
+}
+
+
+BARE_TEST(test_process_limit,
+	"Test the process limit set at boot. Zombie children hold their PIDs, so "
+	"Exec must fail once the limit is reached, even though the process table "
+	"is allocated on demand, and it must succeed again once they are reaped."
+	)
+{
+	const int limit = 100;
+	static int created, maxpid, reaped, again;
+
+	int child(int argl, void* args) { return 0; }
+
+	int boot_task(int argl, void* args) {
+		Pid_t pid;
+		while((pid = Exec(child, 0, NULL)) != NOPROC) {
+			created++;
+			if(pid > maxpid) maxpid = pid;
+		}
+		while(WaitChild(NOPROC, NULL) != NOPROC)
+			reaped++;
+		again = (Exec(child, 0, NULL) != NOPROC);
+		return 0;
+	}
+
+	created = maxpid = reaped = again = 0;
+	ASSERT(setenv("TINYOS_MAX_PROC", "100", 1)==0);
+	boot(2, 0, boot_task, 0, NULL);
+	ASSERT(unsetenv("TINYOS_MAX_PROC")==0);
+
+	/* PIDs 0 and 1 are the scheduler and the boot task */
+	ASSERT(created == limit-2);
+	ASSERT(maxpid == limit-1);
+	ASSERT(reaped == created);
+	ASSERT(again);
+}
+
+
+BOOT_TEST(test_exec_shared,
+	"Test that processes created by ExecShared see the same argument buffer, "
+	"without a copy, and that each process holds a reference to it until it exits."
+	)
+{
+	const int nchildren = 8;
+	static void* seen[8];
+	static int next;
+	const char msg[] = "shared arguments";
+
+	int child(int argl, void* args) {
+		ASSERT(argl == sizeof(msg));
+		ASSERT(strcmp(args, msg)==0);
+		seen[__atomic_fetch_add(&next, 1, __ATOMIC_SEQ_CST)] = args;
+		return 0;
+	}
+
+	next = 0;
+	SharedArgs* sargs = SharedArgs_Create(sizeof(msg), msg);
+	for(int i=0; i<nchildren; i++)
+		ASSERT(ExecShared(child, sargs) != NOPROC);
+	ASSERT(sargs->refcount >= 1 && sargs->refcount <= nchildren+1);
+
+	for(int i=0; i<nchildren; i++)
+		ASSERT(WaitChild(NOPROC, NULL) != NOPROC);
+
+	ASSERT(next == nchildren);
+	for(int i=0; i<nchildren; i++)
+		ASSERT(seen[i] == sargs->args);
+	ASSERT(sargs->refcount == 1);
+	SharedArgs_Release(sargs);
+
+	/* Processes created without arguments get none */
+	int noargs(int argl, void* args) { return (argl==0 && args==NULL) ? 0 : 1; }
+	int status;
+	Pid_t pid = ExecShared(noargs, NULL);
+	ASSERT(WaitChild(pid, &status) == pid);
+	ASSERT(status == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_exec_many,
+	"Test that ExecMany creates all the processes, as children of the caller, "
+	"more than fit in a single batch, and passes each one its own copy of "
+	"its arguments."
+	)
+{
+	const int N = 100;
+	int vals[N];
+	void* argv[N];
+	Pid_t pids[N];
+
+	/* A child may change its copy, without affecting the others */
+	int child(int argl, void* args) {
+		ASSERT(argl == sizeof(int));
+		int val = *(int*) args;
+		*(int*) args = -1;
+		return val;
+	}
+
+	for(int i=0; i<N; i++) {
+		vals[i] = i;
+		/* Processes 50..99 are passed the same pointer */
+		argv[i] = (i < 50) ? &vals[i] : &vals[50];
+	}
+	ASSERT(ExecMany(child, N, sizeof(int), argv, pids) == N);
+
+	for(int i=0; i<N; i++) {
+		int status;
+		ASSERT(pids[i] != NOPROC);
+		ASSERT(WaitChild(pids[i], &status) == pids[i]);
+		ASSERT(status == ((i < 50) ? i : 50));
+	}
+	ASSERT(WaitChild(NOPROC, NULL) == NOPROC);
+
+	/* Without arguments */
+	int noargs(int argl, void* args) { return (argl==3 && args==NULL) ? 0 : 1; }
+	ASSERT(ExecMany(noargs, 4, 3, NULL, NULL) == 4);
+	for(int i=0; i<4; i++) {
+		int status;
+		ASSERT(WaitChild(NOPROC, &status) != NOPROC);
+		ASSERT(status == 0);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_wait_nohang_and_batch,
+	"Test that WaitPid with WNOHANG does not block on children that have not "
+	"exited, and that WaitChildren reaps many exited children at once."
+	)
+{
+	static Semaphore go;
+	const int N = 30;
+
+	int blocked(int argl, void* args) { Sem_P(&go, 1); return 7; }
+	int child(int argl, void* args) { return argl; }
+
+	/* No children */
+	ASSERT(WaitPid(NOPROC, NULL, WNOHANG) == NOPROC);
+	Pid_t pids[N];
+	int status[N];
+	ASSERT(WaitChildren(pids, status, N) == 0);
+
+	/* A child that has not exited */
+	go = SEMAPHORE_INIT(0);
+	Pid_t pid = Exec(blocked, 0, NULL);
+	ASSERT(WaitPid(pid, NULL, WNOHANG) == 0);
+	ASSERT(WaitPid(NOPROC, NULL, WNOHANG) == 0);
+	Sem_V(&go, 1);
+	int st;
+	ASSERT(WaitPid(pid, &st, 0) == pid);
+	ASSERT(st == 7);
+
+	/* Many children, reaped in batches */
+	for(int i=0; i<N; i++)
+		ASSERT(Exec(child, i, NULL) != NOPROC);
+	int seen[N];
+	memset(seen, 0, sizeof(seen));
+	int reaped = 0;
+	while(reaped < N) {
+		int n = WaitChildren(pids, status, 8);
+		ASSERT(n >= 1 && n <= 8);
+		for(int k=0; k<n; k++) {
+			ASSERT(pids[k] > 1);
+			ASSERT(status[k] >= 0 && status[k] < N);
+			seen[status[k]]++;
+		}
+		reaped += n;
+	}
+	ASSERT(reaped == N);
+	for(int i=0; i<N; i++)
+		ASSERT(seen[i] == 1);
+	ASSERT(WaitPid(NOPROC, NULL, WNOHANG) == NOPROC);
+	return 0;
+}
+
+
+BARE_TEST(test_exec_detached,
+	"Test that detached processes are not waited for, and that they release "
+	"their PIDs when they exit, so that many more than the process limit can "
+	"be created without reaping them. The system must still wait for them "
+	"to finish before it shuts down."
+	)
+{
+	const int N = 200;
+	static Semaphore done, go;
+	static int created, ppid_ok, waited, detach_ok, finished;
+
+	int worker(int argl, void* args) { 
+		if(GetPPid()==1) __atomic_add_fetch(&ppid_ok, 1, __ATOMIC_RELAXED);
+		Sem_V(&done, 1); 
+		return 0; 
+	}
+	/* Count the blocked processes that finish while init is alive */
+	int blocked(int argl, void* args) { 
+		Sem_P(&go, 1); 
+		for(volatile int i=0; i<10000000; i++);
+		procinfo info;
+		Fid_t finfo = OpenInfo();
+		while(Read(finfo, (char*) &info, sizeof(info)) > 0)
+			if(info.pid == 1 && info.alive)
+				__atomic_add_fetch(&finished, 1, __ATOMIC_RELAXED);
+		Close(finfo);
+		return 0; 
+	}
+
+	int boot_task(int argl, void* args) {
+		/* Fire and forget: a PID may still be held by a worker that has
+		   signalled, but not yet exited, so Exec is retried. */
+		while(created < N) {
+			if(ExecDetached(worker, 0, NULL) == NOPROC) continue;
+			created++;
+			Sem_P(&done, 1);
+		}
+
+		/* Detached processes cannot be waited for */
+		Pid_t pid = ExecDetached(blocked, 0, NULL);
+		waited = (WaitChild(pid, NULL) != NOPROC) 
+			|| (WaitPid(NOPROC, NULL, WNOHANG) != NOPROC);
+
+		/* Detaching a child */
+		Pid_t pid2 = Exec(blocked, 0, NULL);
+		detach_ok = (DetachChild(pid2) == 0) && (DetachChild(pid2) == -1)
+			&& (DetachChild(pid) == -1) && (WaitChild(pid2, NULL) == NOPROC);
+		Sem_V(&go, 2);
+		return 0;
+	}
+
+	done = SEMAPHORE_INIT(0);
+	go = SEMAPHORE_INIT(0);
+	created = ppid_ok = waited = detach_ok = finished = 0;
+	ASSERT(setenv("TINYOS_MAX_PROC", "16", 1)==0);
+	boot(2, 0, boot_task, 0, NULL);
+	ASSERT(unsetenv("TINYOS_MAX_PROC")==0);
+
+	ASSERT(created == N);
+	ASSERT(ppid_ok == N);
+	ASSERT(!waited);
+	ASSERT(detach_ok);
+	ASSERT(finished == 2);
+}
+
+
+BOOT_TEST(test_kill_group,
+	"Test that KillGroup kills the processes of a group, including CPU-bound "
+	"ones, threads, descendants and processes blocked in the kernel, and that "
+	"they exit with status -1, while other processes are not affected."
+	)
+{
+	static Semaphore started, go, release;
+	static pipe_t p;
+
+	int spin(int argl, void* a) { volatile unsigned long n=0; while(1) n++; return 0; }
+	int spinner(int argl, void* a) { Sem_V(&started, 1); return spin(0, NULL); }
+	int reader(int argl, void* a) {
+		char c;
+		Close(p.write);
+		Sem_V(&started, 1);
+		while(1) Read(p.read, &c, 1);
+		return 0;
+	}
+	int leader(int argl, void* a) {
+		Sem_P(&go, 1);
+		ASSERT(Exec(spinner, 0, NULL) != NOPROC);
+		CreateThread(spin, 0, NULL);
+		return spinner(0, NULL);
+	}
+	int bystander(int argl, void* a) { Close(p.write); Sem_P(&release, 1); return 7; }
+
+	started = SEMAPHORE_INIT(0);
+	go = SEMAPHORE_INIT(0);
+	release = SEMAPHORE_INIT(0);
+	ASSERT(Pipe(&p) == 0);
+	ASSERT(GetPgid(NOPROC) == 1);
+
+	/* The group: a leader with a child and a thread, three spinners and a reader */
+	Pid_t lead = Exec(leader, 0, NULL);
+	ASSERT(SetPgid(lead, NOPROC) == 0);
+	ASSERT(GetPgid(lead) == lead);
+	Sem_V(&go, 1);
+	for(int i=0; i<3; i++) {
+		Pid_t pid = Exec(spinner, 0, NULL);
+		ASSERT(SetPgid(pid, lead) == 0);
+	}
+	Pid_t rpid = Exec(reader, 0, NULL);
+	ASSERT(SetPgid(rpid, lead) == 0);
+
+	/* Not in the group */
+	Pid_t other = Exec(bystander, 0, NULL);
+	ASSERT(SetPgid(other, 12345) == -1);
+	ASSERT(SetPgid(1, lead) == -1);
+	ASSERT(GetPgid(other) == 1);
+
+	Sem_P(&started, 6);
+	ASSERT(KillGroup(lead) == 6);
+
+	/* The reader wakes up when the last writer goes away */
+	Close(p.write);
+
+	for(int i=0; i<6; i++) {
+		int status = 0;
+		Pid_t pid = WaitChild(NOPROC, &status);
+		ASSERT(pid != NOPROC && pid != other);
+		ASSERT(status == -1);
+	}
+	ASSERT(KillGroup(lead) == -1);
+
+	ASSERT(WaitPid(other, NULL, WNOHANG) == 0);
+	Sem_V(&release, 1);
+	int status;
+	ASSERT(WaitChild(other, &status) == other);
+	ASSERT(status == 7);
+	Close(p.read);
+	return 0;
+}
+
+
+BOOT_TEST(test_kill_wakes_sleepers,
+	"Test that KillGroup wakes up the threads of the group that are blocked "
+	"in Read, ThreadJoin, Cond_Wait, WaitChild and Accept, so that the "
+	"processes exit."
+	)
+{
+	static Semaphore started;
+	static pipe_t p;
+	static Mutex m;
+	static CondVar never;
+
+	int sleeper(int argl, void* a) {
+		Mutex_Lock(&m);
+		Sem_V(&started, 1);
+		while(1) Cond_Wait(&m, &never, 0);
+		return 0;
+	}
+	int reader(int argl, void* a) {
+		char c;
+		Sem_V(&started, 1);
+		while(1) Read(p.read, &c, 1);
+		return 0;
+	}
+	int joiner(int argl, void* a) {
+		Tid_t t = CreateThread(sleeper, 0, NULL);
+		Sem_V(&started, 1);
+		while(1) ThreadJoin(t, NULL);
+		return 0;
+	}
+	int parent(int argl, void* a) {
+		Exec(sleeper, 0, NULL);
+		Sem_V(&started, 1);
+		while(1) WaitChild(NOPROC, NULL);
+		return 0;
+	}
+	int acceptor(int argl, void* a) {
+		Fid_t lsock = Socket(100);
+		Listen(lsock);
+		Sem_V(&started, 1);
+		while(1) Accept(lsock);
+		return 0;
+	}
+
+	started = SEMAPHORE_INIT(0);
+	m = MUTEX_INIT;
+	never = COND_INIT;
+	ASSERT(Pipe(&p) == 0);
+
+	Pid_t lead = Exec(reader, 0, NULL);
+	ASSERT(SetPgid(lead, NOPROC) == 0);
+	Task tasks[] = { joiner, parent, acceptor };
+	for(int i=0; i<3; i++)
+		ASSERT(SetPgid(Exec(tasks[i], 0, NULL), lead) == 0);
+
+	/* The reader, the joiner and its thread, the parent and its child, the acceptor */
+	Sem_P(&started, 6);
+	ASSERT(KillGroup(lead) == 5);
+
+	/* The child of the parent is reparented to us */
+	int n = 0, status;
+	while(WaitChild(NOPROC, &status) != NOPROC) {
+		ASSERT(status == -1);
+		n++;
+	}
+	ASSERT(n == 5);
+
+	Close(p.read);
+	Close(p.write);
+	return 0;
+}
+
+
+BOOT_TEST(test_kill_wakes_blocked,
+	"Test that KillGroup wakes up the threads of the group that are blocked "
+	"in Sem_P, Barrier_Wait and SleepMutex_Lock, and that the semaphore, the "
+	"barrier and the mutex work normally afterwards."
+	)
+{
+	static Semaphore started, units;
+	static Barrier bar;
+	static SleepMutex sm;
+
+	int taker(int argl, void* a) {
+		Sem_V(&started, 1);
+		Sem_P(&units, 5);
+		return 0;
+	}
+	int arriver(int argl, void* a) {
+		Sem_V(&started, 1);
+		Barrier_Wait(&bar);
+		return 0;
+	}
+	int locker(int argl, void* a) {
+		Sem_V(&started, 1);
+		SleepMutex_Lock(&sm);
+		SleepMutex_Unlock(&sm);
+		return 0;
+	}
+	int helper(int argl, void* a) {
+		return Barrier_Wait(&bar);
+	}
+
+	started = SEMAPHORE_INIT(0);
+	units = SEMAPHORE_INIT(1);
+	bar = BARRIER_INIT(3);
+	sm = SLEEPMUTEX_INIT;
+
+	/* The mutex is held by us, outside the group */
+	SleepMutex_Lock(&sm);
+
+	Pid_t lead = Exec(taker, 0, NULL);
+	ASSERT(SetPgid(lead, NOPROC) == 0);
+	Task tasks[] = { taker, arriver, arriver, locker };
+	for(int i=0; i<4; i++)
+		ASSERT(SetPgid(Exec(tasks[i], 0, NULL), lead) == 0);
+
+	Sem_P(&started, 5);
+	ASSERT(KillGroup(lead) == 5);
+
+	int n = 0, status;
+	while(WaitChild(NOPROC, &status) != NOPROC) {
+		ASSERT(status == -1);
+		n++;
+	}
+	ASSERT(n == 5);
+
+	/* The killed waiters left the queues */
+	ASSERT(units.value == 1 && units.head == NULL);
+	ASSERT(bar.arrived == 0 && bar.root == NULL);
+	SleepMutex_Unlock(&sm);
+	ASSERT(sm.owner == 0 && sm.head == NULL);
+
+	Sem_V(&units, 4);
+	ASSERT(Sem_P(&units, 5) == 1);
+	Tid_t t1 = CreateThread(helper, 0, NULL);
+	Tid_t t2 = CreateThread(helper, 0, NULL);
+	int r1, r2;
+	int r = Barrier_Wait(&bar);
+	ASSERT(ThreadJoin(t1, &r1) == 0 && ThreadJoin(t2, &r2) == 0);
+	ASSERT(r + r1 + r2 == 1);
+	return 0;
+}
+
+
+BOOT_TEST(test_kill_holding_locks,
+	"Test that a killed process does not exit while it holds a lock, so "
+	"that the lock does not stay locked forever."
+	)
+{
+	static Mutex m;
+	static SleepMutex sm;
+	static Semaphore started;
+	const int N = 4;
+
+	int locker(int argl, void* a) {
+		Sem_V(&started, 1);
+		while(1) {
+			Mutex_Lock(&m);
+			for(volatile int i=0; i<100; i++);
+			Mutex_Unlock(&m);
+			SleepMutex_Lock(&sm);
+			for(volatile int i=0; i<100; i++);
+			SleepMutex_Unlock(&sm);
+			GetPgid(1);
+		}
+		return 0;
+	}
+
+	m = MUTEX_INIT;
+	sm = SLEEPMUTEX_INIT;
+	started = SEMAPHORE_INIT(0);
+
+	Pid_t lead = Exec(locker, 0, NULL);
+	ASSERT(SetPgid(lead, NOPROC) == 0);
+	for(int i=1; i<N; i++)
+		ASSERT(SetPgid(Exec(locker, 0, NULL), lead) == 0);
+	Sem_P(&started, N);
+
+	ASSERT(KillGroup(lead) == N);
+	for(int i=0; i<N; i++) {
+		int status = 0;
+		ASSERT(WaitChild(NOPROC, &status) != NOPROC);
+		ASSERT(status == -1);
+	}
+
+	/* The locks are free */
+	Mutex_Lock(&m);
+	Mutex_Unlock(&m);
+	SleepMutex_Lock(&sm);
+	SleepMutex_Unlock(&sm);
+	ASSERT(GetPgid(lead) == NOPROC);
+	return 0;
+}
+
+
+BOOT_TEST(test_usage,
+	"Test the resource usage statistics of threads and processes: CPU time, "
+	"context switches, wakeups, I/O bytes and stack use, through GetUsage "
+	"and the information stream. A thread that computes between blocking "
+	"calls is charged mostly user time."
+	)
+{
+	static Semaphore wake, ping, pong;
+	static pipe_t p;
+	const int N = 1000;
+
+	int spinner(int argl, void* a) {
+		usageinfo u;
+		/* The quantum expires outside the kernel, sooner or later */
+		do { ASSERT(GetUsage(USAGE_THREAD, &u) == 0); } while(u.user_time == 0);
+		return 0;
+	}
+	int writer(int argl, void* a) {
+		char buf[100];
+		memset(buf, 'x', sizeof(buf));
+		Close(p.read);
+		for(int i=0; i<N/100; i++)
+			ASSERT(Write(p.write, buf, 100) == 100);
+		return 0;
+	}
+	int sleeper(int argl, void* a) {
+		Sem_P(&wake, 1);
+		usageinfo u;
+		ASSERT(GetUsage(USAGE_PROCESS, &u) == 0);
+		ASSERT(u.wakeups >= 1 && u.switches >= 1);
+		ASSERT(u.stack_peak > 0 && u.stack_peak < 128*1024);
+		return 0;
+	}
+	int ponger(int argl, void* a) {
+		for(int i=0; i<50; i++) {
+			Sem_P(&ping, 1);
+			Sem_V(&pong, 1);
+		}
+		return 0;
+	}
+	int pinger(int argl, void* a) {
+		Tid_t t = CreateThread(ponger, 0, NULL);
+		for(int i=0; i<50; i++) {
+			for(volatile int j=0; j<200000; j++);
+			Sem_V(&ping, 1);
+			Sem_P(&pong, 1);
+		}
+		usageinfo u;
+		ASSERT(GetUsage(USAGE_THREAD, &u) == 0);
+		ASSERT(u.switches > 0);
+		ASSERT(u.user_time > u.kernel_time);
+		ASSERT(ThreadJoin(t, NULL) == 0);
+		return 0;
+	}
+
+	usageinfo u;
+	ASSERT(GetUsage(USAGE_THREAD, NULL) == -1);
+	ASSERT(GetUsage(42, &u) == -1);
+
+	/* Only the writer may hold the write end of the pipe */
+	wake = SEMAPHORE_INIT(0);
+	Pid_t spid = Exec(sleeper, 0, NULL);
+	Pid_t cpid = Exec(spinner, 0, NULL);
+	ASSERT(Pipe(&p) == 0);
+	Pid_t wpid = Exec(writer, 0, NULL);
+	Close(p.write);
+
+	/* Read everything */
+	char buf[256];
+	int total = 0, n;
+	while((n = Read(p.read, buf, sizeof(buf))) > 0)
+		total += n;
+	ASSERT(total == N);
+	ASSERT(GetUsage(USAGE_PROCESS, &u) == 0);
+	ASSERT(u.bytes_read == (unsigned long) N);
+	ASSERT(GetUsage(USAGE_THREAD, &u) == 0);
+	ASSERT(u.bytes_read == (unsigned long) N);
+
+	Sem_V(&wake, 1);
+	ASSERT(WaitChild(spid, NULL) == spid);
+	ASSERT(WaitChild(cpid, NULL) == cpid);
+
+	/* The writer is a zombie, but its usage is still reported */
+	int found = 0;
+	Fid_t finfo = OpenInfo();
+	procinfo info;
+	while(Read(finfo, (char*) &info, sizeof(info)) > 0)
+		if(info.pid == wpid) {
+			found = 1;
+			ASSERT(info.usage.bytes_written == (unsigned long) N);
+			ASSERT(info.usage.bytes_read == 0);
+		}
+	Close(finfo);
+	ASSERT(found);
+	ASSERT(WaitChild(wpid, NULL) == wpid);
+	Close(p.read);
+
+	ping = pong = SEMAPHORE_INIT(0);
+	Pid_t ppid = Exec(pinger, 0, NULL);
+	ASSERT(WaitChild(ppid, &n) == ppid);
+	ASSERT(n == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_mem_arena,
+	"Test the per-process memory of MemAlloc: reuse of freed blocks, large "
+	"blocks, ownership, the counters and the limit, inherited by children."
+	)
+{
+	static char* shared;
+	meminfo m;
+
+	int child(int argl, void* a) {
+		meminfo cm;
+		ASSERT(MemInfo(&cm) == 0);
+		ASSERT(cm.limit == 64*1024);
+		ASSERT(cm.in_use == 0);
+		/* The block of the parent is not ours */
+		ASSERT(MemFree(shared) == -1);
+		/* Leak, up to the limit; Exit releases everything */
+		int n = 0;
+		while(MemAlloc(1000) != NULL) n++;
+		ASSERT(n == 64);
+		ASSERT(MemInfo(&cm) == 0);
+		ASSERT(cm.failures == 1);
+		return 0;
+	}
+
+	ASSERT(MemInfo(NULL) == -1);
+	ASSERT(MemAlloc(0) == NULL);
+	ASSERT(MemFree(NULL) == 0);
+
+	char* p = MemAlloc(20);
+	ASSERT(p != NULL);
+	ASSERT(((unsigned long) p % 16) == 0);
+	memset(p, 1, 20);
+	ASSERT(MemInfo(&m) == 0);
+	ASSERT(m.in_use == 32);
+	ASSERT(m.allocs == 1);
+
+	/* Pointers that are not blocks of the arena */
+	char local[32];
+	char* heap = malloc(64);
+	ASSERT(MemFree(local+16) == -1);
+	ASSERT(MemFree(heap+16) == -1);
+	ASSERT(MemFree(p+16) == -1);
+	ASSERT(MemFree(p+1) == -1);
+	ASSERT(MemFree((void*) 16) == -1);
+	free(heap);
+
+	/* A freed block is reused by its size class */
+	ASSERT(MemFree(p) == 0);
+	ASSERT(MemFree(p) == -1);
+	char* q = MemAlloc(30);
+	ASSERT(q == p);
+
+	/* A large block */
+	char* big = MemAlloc(100000);
+	ASSERT(big != NULL);
+	memset(big, 2, 100000);
+	ASSERT(MemInfo(&m) == 0);
+	ASSERT(m.in_use == 32 + 100000);
+	ASSERT(m.peak == m.in_use);
+	ASSERT(MemFree(big) == 0);
+	ASSERT(MemInfo(&m) == 0);
+	ASSERT(m.in_use == 32);
+	ASSERT(m.frees == 2);
+
+	/* Many blocks, over many chunks, and many large blocks */
+	static char* blocks[3000];
+	for(int i=0; i<3000; i++) {
+		blocks[i] = MemAlloc(64);
+		ASSERT(blocks[i] != NULL);
+	}
+	ASSERT(MemFree(blocks[1500]+16) == -1);
+	for(int i=0; i<3000; i++)
+		ASSERT(MemFree(blocks[i]) == 0);
+	for(int i=0; i<50; i++) {
+		blocks[i] = MemAlloc(5000 + i);
+		ASSERT(blocks[i] != NULL);
+	}
+	ASSERT(MemFree(blocks[10]+16) == -1);
+	for(int i=49; i>=0; i--)
+		ASSERT(MemFree(blocks[i]) == 0);
+	ASSERT(MemFree(blocks[0]) == -1);
+	ASSERT(MemInfo(&m) == 0);
+	ASSERT(m.in_use == 32);
+
+	/* When the host is out of memory, MemAlloc fails */
+	struct rlimit as_limit, low_limit;
+	ASSERT(getrlimit(RLIMIT_AS, &as_limit) == 0);
+	low_limit = as_limit;
+	low_limit.rlim_cur = 2ul << 30;
+	ASSERT(setrlimit(RLIMIT_AS, &low_limit) == 0);
+	void* huge = MemAlloc(0xF0000000u);
+	ASSERT(setrlimit(RLIMIT_AS, &as_limit) == 0);
+	ASSERT(huge == NULL);
+	ASSERT(MemInfo(&m) == 0);
+	ASSERT(m.failures == 1);
+	ASSERT(m.in_use == 32);
+
+	/* The limit is inherited */
+	shared = q;
+	ASSERT(MemSetLimit(64*1024) == 0);
+	Pid_t pid = Exec(child, 0, NULL);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, NULL) == pid);
+
+	ASSERT(MemAlloc(64*1024) == NULL);
+	ASSERT(MemInfo(&m) == 0);
+	ASSERT(m.failures == 2);
+	ASSERT(m.in_use == 32);
+	ASSERT(MemSetLimit(0) == 0);
+	ASSERT(MemFree(q) == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_exit_stops_threads,
+	"Test that Exit stops the other threads of the process before it releases "
+	"the memory of the process, whether it is called by the main thread or by "
+	"another thread, and that the status of Exit is kept."
+	)
+{
+	static Semaphore never;
+
+	int toucher(int argl, void* a) {
+		char* p = MemAlloc(64);
+		while(1) {
+			memset(p, 1, 64);
+			MemFree(p);
+			p = MemAlloc(64);
+		}
+		return 0;
+	}
+	int sleeper(int argl, void* a) {
+		Sem_P(&never, 1);
+		return 0;
+	}
+	int exiter(int argl, void* a) {
+		Exit(42);
+		return 0;
+	}
+	int main_exits(int argl, void* a) {
+		CreateThread(toucher, 0, NULL);
+		CreateThread(sleeper, 0, NULL);
+		Exit(7);
+		return 0;
+	}
+	int thread_exits(int argl, void* a) {
+		CreateThread(toucher, 0, NULL);
+		CreateThread(exiter, 0, NULL);
+		Sem_P(&never, 1);
+		return 0;
+	}
+
+	never = SEMAPHORE_INIT(0);
+	int status;
+	Pid_t pid = Exec(main_exits, 0, NULL);
+	ASSERT(WaitChild(pid, &status) == pid);
+	ASSERT(status == 7);
+	pid = Exec(thread_exits, 0, NULL);
+	ASSERT(WaitChild(pid, &status) == pid);
+	ASSERT(status == 42);
+	return 0;
+}
+
+
+BOOT_TEST(test_info_batched,
+	"Test that the information stream returns many records per Read, in order "
+	"of creation, and that a stream survives the exit of the processes around "
+	"its cursor."
+	)
+{
+	static Semaphore go;
+	const int N = 150;
+	Pid_t pids[N];
+
+	int sleeper(int argl, void* a) {
+		Sem_P(&go, 1);
+		return 0;
+	}
+
+	for(int i=0; i<N; i++) {
+		pids[i] = Exec(sleeper, sizeof(i), &i);
+		ASSERT(pids[i] != NOPROC);
+	}
+
+	/* One Read returns all the records that fit, in order of creation */
+	static procinfo infos[200];
+	Fid_t f = OpenInfo();
+	ASSERT(f != NOFILE);
+	int n = Read(f, (char*) infos, sizeof(infos));
+	ASSERT(n == (N+2)*sizeof(procinfo));  /* with the scheduler and init */
+	ASSERT(infos[1].pid == 1);
+	for(int i=0; i<N; i++) {
+		ASSERT(infos[i+2].pid == pids[i]);
+		ASSERT(infos[i+2].ppid == 1);
+		ASSERT(infos[i+2].alive);
+		ASSERT(infos[i+2].argl == sizeof(int));
+		ASSERT(*(int*) infos[i+2].args == i);
+	}
+	ASSERT(Read(f, (char*) infos, sizeof(infos)) == 0);
+	Close(f);
+
+	/* A short buffer gets a prefix of one record, and then the rest of it */
+	f = OpenInfo();
+	Pid_t pid;
+	ASSERT(Read(f, (char*) &pid, sizeof(pid)) == sizeof(pid));
+	ASSERT(pid == 0);
+	ASSERT(Read(f, (char*) infos + sizeof(pid), sizeof(infos)) == sizeof(procinfo)-sizeof(pid));
+	ASSERT(infos[0].ppid == NOPROC);
+
+	/* Read a few records, and let the rest of the processes be reaped */
+	ASSERT(Read(f, (char*) infos, 9*sizeof(procinfo)) == 9*sizeof(procinfo));
+	ASSERT(infos[8].pid == pids[7]);
+	Sem_V(&go, N);
+	for(int i=0; i<N; i++)
+		ASSERT(WaitChild(pids[i], NULL) == pids[i]);
+
+	/* The released processes are not reported */
+	ASSERT(Read(f, (char*) infos, sizeof(infos)) == 0);
+	Close(f);
+	return 0;
+}
+
+
+BOOT_TEST(test_exec_with_files,
+	"Test that ExecWithFiles builds the file table of the child from a list of "
+	"actions, without changing the file table of the caller."
+	)
+{
+	int writer(int argl, void* a) {
+		/* Only fids 1 and 5 are open */
+		for(Fid_t f=0; f<MAX_FILEID; f++)
+			if(f!=1 && f!=5 && Dup2(f, f)==0) return 1;
+		if(Write(5, "xx", 2) != 2) return 2;
+		if(Write(1, "hello", 5) != 5) return 3;
+		return 0;
+	}
+
+	/* Move the pipe to fids 7 and 8, and close everything else */
+	pipe_t q, p = { 7, 8 };
+	ASSERT(Pipe(&q) == 0);
+	ASSERT(Dup2(q.read, p.read) == 0 && Dup2(q.write, p.write) == 0);
+	for(Fid_t f=0; f<MAX_FILEID; f++)
+		if(f!=p.read && f!=p.write) Close(f);
+
+	file_action actions[] = {
+		{ FILE_ACTION_DUP, 1, p.write },
+		{ FILE_ACTION_CLOSE, p.write },
+		{ FILE_ACTION_CLOSE, p.read },
+		{ FILE_ACTION_OPEN_NULL, 5 },
+		{ FILE_ACTION_END }
+	};
+	Pid_t pid = ExecWithFiles(writer, 0, NULL, actions);
+	ASSERT(pid != NOPROC);
+
+	/* Our table is unchanged */
+	ASSERT(Dup2(1, 1) == -1);
+	ASSERT(Dup2(5, 5) == -1);
+	ASSERT(Close(p.write) == 0);
+
+	/* The child holds the only write end */
+	char buf[16];
+	int n = 0, rc;
+	while((rc = Read(p.read, buf+n, sizeof(buf)-n)) > 0) n += rc;
+	ASSERT(n == 5 && memcmp(buf, "hello", 5) == 0);
+
+	int status;
+	ASSERT(WaitChild(pid, &status) == pid);
+	ASSERT(status == 0);
+
+	/* Bad actions create nothing */
+	file_action bad_dup[] = { { FILE_ACTION_DUP, 0, p.write }, { FILE_ACTION_END } };
+	ASSERT(ExecWithFiles(writer, 0, NULL, bad_dup) == NOPROC);
+	file_action bad_fid[] = { { FILE_ACTION_CLOSE, MAX_FILEID }, { FILE_ACTION_END } };
+	ASSERT(ExecWithFiles(writer, 0, NULL, bad_fid) == NOPROC);
+	file_action bad_term[] = { { FILE_ACTION_OPEN_TERMINAL, 0, 0 }, { FILE_ACTION_END } };
+	ASSERT(ExecWithFiles(writer, 0, NULL, bad_term) == NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL) == NOPROC);
+
+	Close(p.read);
+	return 0;
+}
+
+
+BOOT_TEST(test_defer_cleanup,
+	"Test that the teardown of exited processes is queued as deferred work, "
+	"and that its statistics are kept."
+	)
+{
+	const int N = 200;
+	int child(int argl, void* a) { return *(int*) a; }
+
+	deferinfo before, after;
+	ASSERT(GetDeferInfo(NULL) == -1);
+	ASSERT(GetDeferInfo(&before) == 0);
+
+	/* Each child frees its arguments, and its thread, through the queues */
+	for(int i=0; i<N; i++) {
+		Pid_t pid = Exec(child, sizeof(i), &i);
+		ASSERT(pid != NOPROC);
+		int status;
+		ASSERT(WaitChild(pid, &status) == pid);
+		ASSERT(status == i);
+	}
+
+	ASSERT(GetDeferInfo(&after) == 0);
+	ASSERT(after.queued >= before.queued + N);
+	ASSERT(after.processed >= before.processed);
+	ASSERT(after.processed <= after.queued);
+	ASSERT(after.peak >= 1);
+	ASSERT(after.idle_runs + after.switch_runs > 0);
+	return 0;
+}
+
+
+BARE_TEST(test_thread_limit,
+	"Test the thread limit set at boot. Joined and detached threads must "
+	"give back their records, and CreateThread must fail with NOTHREAD "
+	"when the table is exhausted."
+	)
+{
+	const int limit = 16;
+	static SleepMutex mx;
+	static CondVar cv;
+	static int joined, detached, created, release;
+
+	int worker(int argl, void* args) { return argl; }
+	int sleeper(int argl, void* args) {
+		SleepMutex_Lock(&mx);
+		while(!release) SleepMutex_Wait(&mx, &cv, 0);
+		SleepMutex_Unlock(&mx);
+		return 0;
+	}
+
+	/* Fill the table with sleepers, then let them go */
+	int fill() {
+		Tid_t tids[2*limit];
+		int n = 0;
+		release = 0;
+		while(n < 2*limit && (tids[n] = CreateThread(sleeper, 0, NULL)) != NOTHREAD)
+			n++;
+		SleepMutex_Lock(&mx);
+		release = 1;
+		Cond_Broadcast(&cv);
+		SleepMutex_Unlock(&mx);
+		for(int i=0; i<n; i++) ThreadJoin(tids[i], NULL);
+		return n;
+	}
+
+	int boot_task(int argl, void* args) {
+		for(int i=0; i<10*limit; i++) {
+			int val = -1;
+			Tid_t t = CreateThread(worker, i, NULL);
+			if(t != NOTHREAD && ThreadJoin(t, &val)==0 && val==i) joined++;
+		}
+		for(int i=0; i<10*limit; i++) {
+			Tid_t t;
+			/* If the table is full, earlier detached threads have not exited yet */
+			while((t = CreateThread(worker, i, NULL)) == NOTHREAD);
+			if(ThreadDetach(t)==0 && ThreadJoin(t, NULL)==-1) detached++;
+		}
+		/* Retry until the detached threads have exited */
+		while((created = fill()) < limit);
+		return 0;
+	}
+
+	joined = detached = created = 0;
+	mx = SLEEPMUTEX_INIT;
+	cv = COND_INIT;
+	ASSERT(setenv("TINYOS_MAX_THREADS", "16", 1)==0);
+	boot(1, 0, boot_task, 0, NULL);
+	ASSERT(unsetenv("TINYOS_MAX_THREADS")==0);
+
+	ASSERT(joined == 10*limit);
+	ASSERT(detached == 10*limit);
+	ASSERT(created == limit);
+}
+
+
 TEST_SUITE(user_tests, 
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&test_rwlock_exclusion,
+	&test_cond_fifo_morphing,
+	&test_semaphore_batch,
+	&test_barrier_phases,
+	&test_lockstat,
+	&test_listener_reclaim,
+	&test_process_limit,
+	&test_thread_limit,
+	&test_exec_shared,
+	&test_exec_many,
+	&test_wait_nohang_and_batch,
+	&test_exec_detached,
+	&test_kill_group,
+	&test_kill_wakes_sleepers,
+	&test_kill_wakes_blocked,
+	&test_kill_holding_locks,
+	&test_usage,
+	&test_mem_arena,
+	&test_exit_stops_threads,
+	&test_info_batched,
+	&test_exec_with_files,
+	&test_defer_cleanup,
 	NULL
 };
 
@@ -0,0 +1,492 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <assert.h>
+
+#include "util.h"
+#include "bench.h"
+#include "bios.h"
+#include "tinyos.h"
+
+
+/*
+ 	A synthetic workload generator for scheduler evaluation.
+
+ 	The workload consists of a number of tenants, each of which is a process
+ 	belonging to one of the following classes:
+
+ 	- cpu:    repeatedly executes a CPU burst. The latency of an operation is
+ 	          the wall-clock time needed to complete the burst.
+ 	- pipe:   a client process performs a round-trip through a pair of pipes
+ 	          to an echo process, after a CPU burst of its own. The echo process
+ 	          executes a CPU burst before replying. The latency of an operation
+ 	          is the round-trip time.
+ 	- socket: like 'pipe', but the round-trip is made over a connected
+ 	          pair of sockets.
+
+ 	The lengths of the CPU bursts are drawn from a distribution (fixed,
+ 	exponential or Pareto) with a given mean. Bursts are executed by
+ 	spinning a calibrated loop, so that a burst of a given length consumes
+ 	the same CPU time whether or not it is preempted.
+
+ 	At the end, per-class latency percentiles and the total throughput
+ 	are reported.
+
+ 	TinyOS does not offer a timed sleep, so idle (think) periods are not
+ 	part of the workload; blocking happens only at pipes and sockets.
+ */
+
+
+/* Burst length distributions */
+typedef enum { DIST_FIXED, DIST_EXP, DIST_PARETO } dist_t;
+
+/* The shape parameter of the Pareto distribution */
+#define PARETO_ALPHA 1.5
+
+/* The size of a round-trip message */
+#define MSG_SIZE 64
+
+/* The first byte of a message tells the echo server to continue or quit */
+#define MSG_DATA 1
+#define MSG_QUIT 0
+
+/* The first socket port used by socket tenants */
+#define WORKLOAD_PORT 100
+
+typedef enum { CLASS_CPU, CLASS_PIPE, CLASS_SOCKET, NCLASSES } tenant_class;
+
+static const char* class_name[NCLASSES] = { "cpu", "pipe", "socket" };
+
+
+/* The workload definition, shared by all tenants */
+typedef struct {
+	int tenants[NCLASSES];     /* number of tenants per class */
+	int ops;                   /* operations per tenant */
+	dist_t dist;               /* burst length distribution */
+	double mean;               /* mean burst length (usec) */
+	double loops_per_usec;     /* spin loop calibration */
+
+	/* Results: one latency array per class, of size tenants*ops */
+	uint64_t* lat[NCLASSES];
+	Mutex mx;
+	int nlat[NCLASSES];
+
+	/* Start-up gate for socket tenants (see boot_workload) */
+	CondVar cv;
+	int connected;
+	int go;
+} workload_t;
+
+
+/* A tenant descriptor, passed by pointer to the tenant process */
+typedef struct {
+	workload_t* W;
+	tenant_class cls;
+	int id;
+	unsigned short seed[3];
+	Fid_t in, out;             /* client side of the round-trip */
+} tenant_t;
+
+
+
+/* Spin for the given number of loop iterations */
+static void spin(double loops)
+{
+	volatile unsigned long x = 0;
+	for(unsigned long i = 0; i < (unsigned long) loops; i++)
+		x += i;
+}
+
+/* Calibrate the spin loop (done before booting) */
+static double calibrate()
+{
+	const double LOOPS = 5e7;
+	uint64_t t0 = now_nsec();
+	spin(LOOPS);
+	uint64_t t1 = now_nsec();
+	return LOOPS / ((t1 - t0) / 1000.0);
+}
+
+/* Draw a burst length (in usec) */
+static double draw_burst(workload_t* W, unsigned short seed[3])
+{
+	double u = erand48(seed);
+	switch(W->dist) {
+		case DIST_EXP:
+			return - W->mean * log(1.0 - u);
+		case DIST_PARETO: {
+			double xm = W->mean * (PARETO_ALPHA - 1.0) / PARETO_ALPHA;
+			return xm / pow(1.0 - u, 1.0 / PARETO_ALPHA);
+		}
+		default:
+			return W->mean;
+	}
+}
+
+static void burst(workload_t* W, unsigned short seed[3])
+{
+	spin(draw_burst(W, seed) * W->loops_per_usec);
+}
+
+
+/* Read exactly 'size' bytes, unless EOF or error */
+static int read_full(Fid_t fid, char* buf, int size)
+{
+	int count = 0;
+	while(count < size) {
+		int rc = Read(fid, buf+count, size-count);
+		if(rc <= 0) return count;
+		count += rc;
+	}
+	return count;
+}
+
+static void record(workload_t* W, tenant_class cls, uint64_t* lat, int n)
+{
+	Mutex_Lock(& W->mx);
+	memcpy(W->lat[cls] + W->nlat[cls], lat, n*sizeof(uint64_t));
+	W->nlat[cls] += n;
+	Mutex_Unlock(& W->mx);
+}
+
+
+/*
+	The tenant processes
+ */
+
+static int cpu_tenant(int argl, void* args)
+{
+	tenant_t* T = *(tenant_t**) args;
+	workload_t* W = T->W;
+	uint64_t lat[W->ops];
+
+	for(int i=0; i<W->ops; i++) {
+		uint64_t t0 = now_nsec();
+		burst(W, T->seed);
+		lat[i] = now_nsec() - t0;
+	}
+	record(W, CLASS_CPU, lat, W->ops);
+	return 0;
+}
+
+
+/* The server side of a round-trip tenant: echo messages after a burst */
+static int echo_server(int argl, void* args)
+{
+	tenant_t* T = *(tenant_t**) args;
+	char msg[MSG_SIZE];
+
+	/* The client ends were inherited, close them */
+	Close(T->in);
+	Close(T->out);
+
+	while(read_full(0, msg, MSG_SIZE) == MSG_SIZE && msg[0] != MSG_QUIT) {
+		burst(T->W, T->seed);
+		if(Write(1, msg, MSG_SIZE) != MSG_SIZE) break;
+	}
+	return 0;
+}
+
+
+/* The client side of a round-trip tenant */
+static int roundtrip_client(tenant_t* T)
+{
+	workload_t* W = T->W;
+	uint64_t lat[W->ops];
+	char msg[MSG_SIZE];
+	int n;
+
+	memset(msg, MSG_DATA, MSG_SIZE);
+	for(n=0; n<W->ops; n++) {
+		burst(W, T->seed);
+		uint64_t t0 = now_nsec();
+		if(Write(T->out, msg, MSG_SIZE) != MSG_SIZE) break;
+		if(read_full(T->in, msg, MSG_SIZE) != MSG_SIZE) break;
+		lat[n] = now_nsec() - t0;
+	}
+	record(W, T->cls, lat, n);
+
+	/* Tell the server to quit */
+	msg[0] = MSG_QUIT;
+	Write(T->out, msg, MSG_SIZE);
+	return 0;
+}
+
+
+/*
+	Redirect fids 'rd' and 'wr' to 0 and 1, so that the echo server
+	finds them there, and start the server.
+ */
+static Pid_t start_echo_server(tenant_t* T, Fid_t rd, Fid_t wr)
+{
+	Fid_t savein = OpenNull(), saveout = OpenNull();
+	Dup2(0, savein);  Dup2(1, saveout);
+	Dup2(rd, 0);  Dup2(wr, 1);
+
+	Pid_t pid = Exec(echo_server, sizeof(T), &T);
+
+	Dup2(savein, 0);  Dup2(saveout, 1);
+	Close(savein);  Close(saveout);
+	return pid;
+}
+
+
+static int pipe_tenant(int argl, void* args)
+{
+	tenant_t* T = *(tenant_t**) args;
+	pipe_t req, rep;
+
+	if(Pipe(&req) || Pipe(&rep)) {
+		fprintf(stderr, "pipe tenant %d: cannot create pipes\n", T->id);
+		return 1;
+	}
+
+	T->out = req.write;
+	T->in = rep.read;
+	Pid_t srv = start_echo_server(T, req.read, rep.write);
+	Close(req.read);
+	Close(rep.write);
+
+	roundtrip_client(T);
+
+	Close(T->out);
+	Close(T->in);
+	WaitChild(srv, NULL);
+	return 0;
+}
+
+
+/* Helpers to connect a pair of sockets */
+typedef struct {
+	Fid_t lsock, csock, ssock;
+	port_t port;
+} sock_pair;
+
+static int accept_proc(int argl, void* args)
+{
+	sock_pair* sp = *(sock_pair**) args;
+	sp->ssock = Accept(sp->lsock);
+	return 0;
+}
+
+static int connect_proc(int argl, void* args)
+{
+	sock_pair* sp = *(sock_pair**) args;
+	Connect(sp->csock, sp->port, 1000);
+	return 0;
+}
+
+
+/*
+	The accept_flag hack redirects the file table of *every* process to
+	its parent's, so no other tenant may do I/O while a socket tenant
+	connects. Socket tenants are started and connected one at a time, and
+	then wait for the boot task to open the gate.
+ */
+static void socket_tenant_ready(workload_t* W)
+{
+	Mutex_Lock(& W->mx);
+	W->connected++;
+	Cond_Broadcast(& W->cv);
+	Mutex_Unlock(& W->mx);
+}
+
+static void socket_tenant_wait(workload_t* W)
+{
+	Mutex_Lock(& W->mx);
+	while(! W->go)
+		Cond_Wait(& W->mx, & W->cv, 0);
+	Mutex_Unlock(& W->mx);
+}
+
+static int socket_tenant(int argl, void* args)
+{
+	tenant_t* T = *(tenant_t**) args;
+	sock_pair sp = { NOFILE, NOFILE, NOFILE, WORKLOAD_PORT + T->id };
+	sock_pair* spp = &sp;
+
+	sp.lsock = Socket(sp.port);
+	sp.csock = Socket(NOPORT);
+	if(sp.lsock==NOFILE || sp.csock==NOFILE || Listen(sp.lsock)) {
+		fprintf(stderr, "socket tenant %d: cannot listen on port %d\n", T->id, sp.port);
+		socket_tenant_ready(T->W);
+		return 1;
+	}
+
+	/* Connect, using the same helper-process pattern as the API tests */
+	accept_flag = 1;
+	Pid_t p1 = Exec(accept_proc, sizeof(spp), &spp);
+	Pid_t p2 = Exec(connect_proc, sizeof(spp), &spp);
+	WaitChild(p1, NULL);
+	WaitChild(p2, NULL);
+	accept_flag = 0;
+
+	socket_tenant_ready(T->W);
+	if(sp.ssock == NOFILE) {
+		fprintf(stderr, "socket tenant %d: cannot connect\n", T->id);
+		return 1;
+	}
+	socket_tenant_wait(T->W);
+	Close(sp.lsock);
+
+	T->out = T->in = sp.csock;
+	Pid_t srv = start_echo_server(T, sp.ssock, sp.ssock);
+	Close(sp.ssock);
+
+	roundtrip_client(T);
+
+	Close(sp.csock);
+	WaitChild(srv, NULL);
+	return 0;
+}
+
+
+static Task tenant_task[NCLASSES] = { cpu_tenant, pipe_tenant, socket_tenant };
+
+
+/*
+	The boot task starts all tenants and waits for them.
+ */
+static uint64_t elapsed;
+
+int boot_workload(int argl, void* args)
+{
+	workload_t* W = *(workload_t**) args;
+
+	int total = 0;
+	for(int c=0; c<NCLASSES; c++) total += W->tenants[c];
+	tenant_t T[total];
+
+	/* Occupy fids 0 and 1, so that the round-trip tenants can redirect them */
+	OpenNull();
+	OpenNull();
+
+	uint64_t t0 = now_nsec();
+
+	/* Socket tenants go first, one at a time (see socket_tenant_ready) */
+	static const tenant_class order[NCLASSES] = { CLASS_SOCKET, CLASS_CPU, CLASS_PIPE };
+	int k = 0;
+	for(int o=0; o<NCLASSES; o++) {
+		tenant_class c = order[o];
+		for(int i=0; i<W->tenants[c]; i++, k++) {
+			T[k].W = W;
+			T[k].cls = c;
+			T[k].id = i;
+			T[k].seed[0] = 0x330E; T[k].seed[1] = k; T[k].seed[2] = c;
+			tenant_t* targ = & T[k];
+			if(Exec(tenant_task[c], sizeof(targ), &targ) == NOPROC) {
+				fprintf(stderr, "Cannot start %s tenant %d\n", class_name[c], i);
+				if(c == CLASS_SOCKET) W->connected++;
+			}
+
+			if(c == CLASS_SOCKET) {
+				Mutex_Lock(& W->mx);
+				while(W->connected <= i)
+					Cond_Wait(& W->mx, & W->cv, 0);
+				Mutex_Unlock(& W->mx);
+			}
+		}
+
+		if(c == CLASS_SOCKET) {
+			Mutex_Lock(& W->mx);
+			W->go = 1;
+			Cond_Broadcast(& W->cv);
+			Mutex_Unlock(& W->mx);
+		}
+	}
+
+	while(WaitChild(NOPROC, NULL) != NOPROC); /* Wait for all children */
+
+	elapsed = now_nsec() - t0;
+	return 0;
+}
+
+
+/****************************************************/
+
+
+void usage(const char* pname)
+{
+	printf("usage:\n  %s [-c <ncores>] [-C <cpu>] [-P <pipe>] [-S <socket>] [-n <ops>] [-m <mean>] [-d <dist>]\n\n\
+    where:\n\
+    <ncores> is the number of cpu cores to use (default 1),\n\
+    <cpu>, <pipe>, <socket> are the numbers of tenants of each class (default 4, 2, 1),\n\
+    <ops> is the number of operations per tenant (default 50),\n\
+    <mean> is the mean CPU burst length in usec (default 10000),\n\
+    <dist> is one of fixed, exp, pareto (default exp).\n",
+		pname);
+	exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned int ncores = 1;
+	workload_t W = {
+		.tenants = { 4, 2, 1 },
+		.ops = 50,
+		.dist = DIST_EXP,
+		.mean = 10000.0,
+		.mx = MUTEX_INIT,
+		.cv = COND_INIT,
+		.connected = 0,
+		.go = 0
+	};
+	int opt;
+
+	while((opt = getopt(argc, argv, "c:C:P:S:n:m:d:")) != -1) {
+		switch(opt) {
+			case 'c': ncores = atoi(optarg); break;
+			case 'C': W.tenants[CLASS_CPU] = atoi(optarg); break;
+			case 'P': W.tenants[CLASS_PIPE] = atoi(optarg); break;
+			case 'S': W.tenants[CLASS_SOCKET] = atoi(optarg); break;
+			case 'n': W.ops = atoi(optarg); break;
+			case 'm': W.mean = atof(optarg); break;
+			case 'd':
+				if(strcmp(optarg, "fixed")==0) W.dist = DIST_FIXED;
+				else if(strcmp(optarg, "exp")==0) W.dist = DIST_EXP;
+				else if(strcmp(optarg, "pareto")==0) W.dist = DIST_PARETO;
+				else usage(argv[0]);
+				break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if(optind != argc || ncores < 1 || ncores > MAX_CORES || W.ops < 1 || W.mean <= 0.0)
+		usage(argv[0]);
+	for(int c=0; c<NCLASSES; c++) {
+		if(W.tenants[c] < 0) usage(argv[0]);
+		W.lat[c] = xmalloc((W.tenants[c]*W.ops+1) * sizeof(uint64_t));
+		W.nlat[c] = 0;
+	}
+	if(WORKLOAD_PORT + W.tenants[CLASS_SOCKET] > MAX_PORT) usage(argv[0]);
+
+	W.loops_per_usec = calibrate();
+
+	workload_t* Wp = &W;
+	boot(ncores, 0, boot_workload, sizeof(Wp), &Wp);
+
+	/* Report */
+	printf("%-8s %8s %8s %10s %10s %10s %10s\n",
+		"class", "tenants", "ops", "p50", "p90", "p99", "max");
+	int total = 0;
+	for(int c=0; c<NCLASSES; c++) {
+		int n = W.nlat[c];
+		sort_u64(W.lat[c], n);
+		printf("%-8s %8d %8d %10.0f %10.0f %10.0f %10.0f\n",
+			class_name[c], W.tenants[c], n,
+			percentile(W.lat[c], n, 0.5)/1000.0, percentile(W.lat[c], n, 0.9)/1000.0,
+			percentile(W.lat[c], n, 0.99)/1000.0, percentile(W.lat[c], n, 1.0)/1000.0);
+		total += n;
+		free(W.lat[c]);
+	}
+	printf("\ncores=%u dist=%s mean=%.0f usec: %d ops in %.3f sec, throughput %.1f ops/sec\n",
+		ncores, (W.dist==DIST_FIXED ? "fixed" : W.dist==DIST_EXP ? "exp" : "pareto"), W.mean,
+		total, elapsed/1e9, total/(elapsed/1e9));
+
+	return 0;
+}